@@ -0,0 +1,728 @@
+/*
+ * Benchmarks for bgh, compared against std::unordered_map, and
+ * absl::flat_hash_map if built with abseil. Results are printed one row per
+ * measurement as CSV, or as JSON with --json, to be kept and compared
+ * between builds.
+ *
+ * Workloads:
+ *   hit_miss   Lookups with a given share of them hits
+ *   syn_flood  Every packet is a new flow: a lookup that misses, then an
+ *              insert
+ *   zipf       Lookups over flows with Zipfian popularity
+ *   refresh    Lookups while a refresh drains the table. The first pass
+ *              moves every session, the second finds them in the new table
+ *   threads    Lookups from several threads at once. The maps are behind a
+ *              reader-writer lock
+ *   threads_insert
+ *              Inserts from several threads, each of its own flows. The
+ *              maps are behind a mutex
+ *
+ * Run with --help for options.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../bgh/bgh.h"
+
+#ifdef BGH_BENCH_ABSL
+#include "absl/container/flat_hash_map.h"
+#endif
+
+// Tables are sized for the keys to fill about this much of them
+#define BENCH_LOAD_PCT 60
+#define BENCH_DEFAULT_OPS 2000000
+#define BENCH_DEFAULT_REPS 3
+#define BENCH_BURST 32
+
+struct bench_opts_t {
+    std::vector<uint64_t> sizes;
+    std::vector<int> threads;
+    uint64_t ops;
+    int reps;
+    bool json;
+    std::vector<std::string> workloads;
+};
+
+static bench_opts_t opts;
+
+/////////////////////////
+// Output
+
+static bool first_result = true;
+
+static void report(const char *workload, const char *impl, uint64_t keys,
+        int threads, const std::string &param, uint64_t ops, double ns) {
+    double ns_per_op = ns / ops;
+    double mops = ops * 1000.0 / ns;
+
+    if(opts.json) {
+        printf("%s\n  {\"workload\": \"%s\", \"impl\": \"%s\", \"keys\": %lu, "
+               "\"threads\": %d, \"param\": \"%s\", \"ops\": %lu, "
+               "\"ns_per_op\": %.2f, \"mops\": %.3f}",
+            first_result ? "[" : ",", workload, impl, keys, threads,
+            param.c_str(), ops, ns_per_op, mops);
+    }
+    else {
+        if(first_result)
+            printf("workload,impl,keys,threads,param,ops,ns_per_op,mops\n");
+        printf("%s,%s,%lu,%d,%s,%lu,%.2f,%.3f\n", workload, impl, keys,
+            threads, param.c_str(), ops, ns_per_op, mops);
+    }
+    first_result = false;
+    fflush(stdout);
+}
+
+static void report_end() {
+    if(opts.json)
+        printf(first_result ? "[]\n" : "\n]\n");
+}
+
+/////////////////////////
+// Keys and timing
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Repeatable across runs, so builds are compared on the same keys
+struct rng_t {
+    uint64_t state;
+
+    rng_t(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // [0, 1)
+    double uniform() {
+        return (next() >> 11) * (1.0 / (1ULL << 53));
+    }
+};
+
+static std::vector<bgh_key_t> make_keys(uint64_t n, uint64_t seed) {
+    rng_t rng(seed);
+    std::vector<bgh_key_t> keys(n);
+
+    // Zeroed, pad bytes included, since the maps compare whole keys
+    memset(keys.data(), 0, n * sizeof(bgh_key_t));
+    for(uint64_t i=0; i<n; i++) {
+        uint64_t r = rng.next();
+        keys[i].sip = (uint32_t)r;
+        keys[i].dip = (uint32_t)(r >> 32);
+        r = rng.next();
+        keys[i].sport = (uint16_t)r;
+        keys[i].dport = (uint16_t)(r >> 16);
+        keys[i].proto = 6;
+    }
+    return keys;
+}
+
+// Median of reps runs of f, which returns the ns it took
+template<class F>
+static double median_ns(F f) {
+    std::vector<double> runs;
+    for(int i=0; i<opts.reps; i++)
+        runs.push_back(f());
+    std::sort(runs.begin(), runs.end());
+    return runs[runs.size() / 2];
+}
+
+// Keeps the compiler from dropping lookups whose results go unused
+static volatile uintptr_t sink;
+
+/////////////////////////
+// Implementations
+
+static void nop_free_cb(void *p) {}
+
+static uint64_t pow2(uint64_t n) {
+    uint64_t p = 1;
+    while(p < n)
+        p <<= 1;
+    return p;
+}
+
+// A tracker with room for nkeys, that never resizes
+static bgh_t *new_tracker(uint64_t nkeys,
+        uint32_t nshards = 1, bool refresh = false) {
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    uint64_t rows = pow2(nkeys * 100 / BENCH_LOAD_PCT);
+    conf.starting_rows = conf.min_rows = conf.max_rows = rows;
+    conf.hash_full_pct = 90;
+    conf.scale_up_pct = 0;
+    conf.scale_down_pct = 0;
+    conf.refresh_period = 0;
+
+    // Refreshes happen only when the benchmark says so
+    if(refresh) {
+        conf.manual_maintenance = true;
+        conf.refresh_period = 1;
+        conf.timeout = 3600;
+    }
+
+    bgh_t *tracker = bgh_sharded_new(nshards, &conf, nop_free_cb);
+    if(!tracker) {
+        fprintf(stderr, "Failed to allocate a tracker for %lu keys\n", nkeys);
+        exit(1);
+    }
+    return tracker;
+}
+
+struct key_hash {
+    size_t operator()(const bgh_key_t &k) const {
+        uint64_t a, b;
+        memcpy(&a, &k.sip, sizeof(a));
+        memcpy(&b, &k.dip, sizeof(b));
+        uint64_t h = a ^ (b * 0x9E3779B97F4A7C15ULL) ^
+            ((uint64_t)k.vlan << 8 | k.proto);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        return h ^ (h >> 33);
+    }
+};
+
+struct key_eq {
+    bool operator()(const bgh_key_t &k1, const bgh_key_t &k2) const {
+        return !memcmp(&k1, &k2, sizeof(bgh_key_t));
+    }
+};
+
+typedef std::unordered_map<bgh_key_t, void*, key_hash, key_eq> std_map_t;
+#ifdef BGH_BENCH_ABSL
+typedef absl::flat_hash_map<bgh_key_t, void*, key_hash, key_eq> absl_map_t;
+#endif
+
+// Runs fn<Map>(name) for each map compared against
+#ifdef BGH_BENCH_ABSL
+#define FOR_EACH_MAP(fn, ...) \
+    fn<std_map_t>("unordered_map", __VA_ARGS__); \
+    fn<absl_map_t>("absl_flat_hash_map", __VA_ARGS__)
+#else
+#define FOR_EACH_MAP(fn, ...) \
+    fn<std_map_t>("unordered_map", __VA_ARGS__)
+#endif
+
+static void *const present = (void*)"present";
+
+/////////////////////////
+// hit_miss
+
+// Lookups of the inserted keys, with the given percentage of them hits
+static std::vector<bgh_key_t> hit_miss_ops(const std::vector<bgh_key_t> &keys,
+        const std::vector<bgh_key_t> &misses, int hit_pct) {
+    rng_t rng(hit_pct);
+    std::vector<bgh_key_t> ops(opts.ops);
+    for(uint64_t i=0; i<opts.ops; i++) {
+        const std::vector<bgh_key_t> &from =
+            rng.next() % 100 < (uint64_t)hit_pct ? keys : misses;
+        ops[i] = from[rng.next() % from.size()];
+    }
+    return ops;
+}
+
+template<class Map>
+static void map_lookups(const char *name, const char *workload,
+        const std::vector<bgh_key_t> &keys,
+        const std::vector<bgh_key_t> &ops, const std::string &param) {
+    Map map;
+    map.reserve(keys.size());
+    for(auto &k : keys)
+        map[k] = present;
+
+    double ns = median_ns([&]() {
+        uint64_t start = now_ns();
+        uintptr_t found = 0;
+        for(auto &k : ops)
+            found += map.find(k) != map.end();
+        sink = found;
+        return (double)(now_ns() - start);
+    });
+    report(workload, name, keys.size(), 1, param, ops.size(), ns);
+}
+
+static void bgh_lookups(const char *workload,
+        const std::vector<bgh_key_t> &keys,
+        const std::vector<bgh_key_t> &ops, const std::string &param) {
+    bgh_t *tracker = new_tracker(keys.size());
+    for(auto &k : keys)
+        bgh_insert(tracker, (bgh_key_t*)&k, present);
+
+    double ns = median_ns([&]() {
+        uint64_t start = now_ns();
+        uintptr_t found = 0;
+        for(auto &k : ops)
+            found += (uintptr_t)bgh_lookup(tracker, (bgh_key_t*)&k);
+        sink = found;
+        return (double)(now_ns() - start);
+    });
+    report(workload, "bgh", keys.size(), 1, param, ops.size(), ns);
+
+    ns = median_ns([&]() {
+        void *data[BENCH_BURST];
+        uint64_t start = now_ns();
+        uintptr_t found = 0;
+        for(uint64_t i=0; i<ops.size(); i+=BENCH_BURST) {
+            uint32_t n = std::min<uint64_t>(BENCH_BURST, ops.size() - i);
+            found += bgh_lookup_burst(tracker, (bgh_key_t*)&ops[i], n, data);
+        }
+        sink = found;
+        return (double)(now_ns() - start);
+    });
+    report(workload, "bgh_burst", keys.size(), 1, param, ops.size(), ns);
+
+    bgh_free(tracker);
+}
+
+static void hit_miss(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 1),
+                           misses = make_keys(nkeys, 2);
+
+    int pcts[] = { 100, 90, 50, 0 };
+    for(int pct : pcts) {
+        std::vector<bgh_key_t> ops = hit_miss_ops(keys, misses, pct);
+        std::string param = "hit_pct=" + std::to_string(pct);
+        bgh_lookups("hit_miss", keys, ops, param);
+        FOR_EACH_MAP(map_lookups, "hit_miss", keys, ops, param);
+    }
+}
+
+/////////////////////////
+// syn_flood
+
+template<class Map>
+static void map_flood(const char *name, const std::vector<bgh_key_t> &keys) {
+    double ns = median_ns([&]() {
+        Map map;
+        map.reserve(keys.size());
+        uint64_t start = now_ns();
+        for(auto &k : keys) {
+            if(map.find(k) == map.end())
+                map.emplace(k, present);
+        }
+        return (double)(now_ns() - start);
+    });
+    report("syn_flood", name, keys.size(), 1, "", keys.size(), ns);
+}
+
+static void *create_present(void *value, void *ctx) {
+    return present;
+}
+
+// A lookup and then an insert on a miss, or both in one bgh_find_or_insert
+static void bgh_flood(const char *impl, const std::vector<bgh_key_t> &keys,
+        bool find_or_insert) {
+    uint64_t full = 0;
+
+    double ns = median_ns([&]() {
+        bgh_t *tracker = new_tracker(keys.size());
+        full = 0;
+        uint64_t start = now_ns();
+        for(auto &k : keys) {
+            if(find_or_insert) {
+                if(!bgh_find_or_insert(tracker, (bgh_key_t*)&k, 
+                                       create_present, NULL, NULL))
+                    full++;
+            }
+            else if(!bgh_lookup(tracker, (bgh_key_t*)&k) &&
+               bgh_insert(tracker, (bgh_key_t*)&k, present) == BGH_FULL)
+                full++;
+        }
+        double ns = now_ns() - start;
+        bgh_free(tracker);
+        return ns;
+    });
+    report("syn_flood", impl, keys.size(), 1,
+        "full=" + std::to_string(full), keys.size(), ns);
+}
+
+static void syn_flood(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 3);
+
+    bgh_flood("bgh", keys, false);
+    bgh_flood("bgh_find_or_insert", keys, true);
+    FOR_EACH_MAP(map_flood, keys);
+}
+
+/////////////////////////
+// zipf
+
+// Flow indexes drawn with Zipfian popularity, skew s. Inverts the CDF of
+// the continuous approximation, so no table of n weights is needed
+static std::vector<uint64_t> zipf_indexes(uint64_t n, double s) {
+    rng_t rng(4);
+    std::vector<uint64_t> idx(opts.ops);
+    double a = 1.0 - s;
+    double max = (pow((double)n + 1, a) - 1) / a;
+
+    for(uint64_t i=0; i<opts.ops; i++) {
+        double x = pow(rng.uniform() * max * a + 1, 1.0 / a) - 1;
+        idx[i] = std::min<uint64_t>((uint64_t)x, n - 1);
+    }
+    return idx;
+}
+
+static void zipf(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 5);
+    std::vector<uint64_t> idx = zipf_indexes(nkeys, 0.99);
+
+    // Popular flows are spread over the table, not the first keys inserted
+    std::vector<bgh_key_t> ops(opts.ops);
+    for(uint64_t i=0; i<opts.ops; i++)
+        ops[i] = keys[(idx[i] * 0x9E3779B97F4A7C15ULL) % nkeys];
+
+    bgh_lookups("zipf", keys, ops, "s=0.99");
+    FOR_EACH_MAP(map_lookups, "zipf", keys, ops, std::string("s=0.99"));
+}
+
+/////////////////////////
+// refresh
+
+static void refresh(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 6);
+    std::vector<bgh_key_t> order(keys);
+    rng_t rng(7);
+    for(uint64_t i=nkeys-1; i>0; i--)
+        std::swap(order[i], order[rng.next() % (i + 1)]);
+
+    std::vector<double> first, second;
+    for(int r=0; r<opts.reps; r++) {
+        bgh_t *tracker = new_tracker(nkeys, 1, true);
+        for(auto &k : keys)
+            bgh_insert(tracker, &k, present);
+
+        // Start the refresh right away. The drain lasts longer than the
+        // benchmark
+        bgh_maintain(tracker, bgh_now_ms() + 1000, 0);
+
+        for(int pass=0; pass<2; pass++) {
+            uint64_t start = now_ns();
+            uintptr_t found = 0;
+            for(auto &k : order)
+                found += (uintptr_t)bgh_lookup(tracker, &k);
+            sink = found;
+            (pass ? second : first).push_back(now_ns() - start);
+        }
+        bgh_free(tracker);
+    }
+
+    std::sort(first.begin(), first.end());
+    std::sort(second.begin(), second.end());
+    report("refresh", "bgh", nkeys, 1, "pass=moving", nkeys,
+        first[first.size() / 2]);
+    report("refresh", "bgh", nkeys, 1, "pass=moved", nkeys,
+        second[second.size() / 2]);
+}
+
+/////////////////////////
+// threads
+
+struct thread_ctx_t {
+    pthread_barrier_t *barrier;
+    const std::vector<bgh_key_t> *ops;
+    uint64_t begin, end;
+    // Runs ops [begin, end)
+    void (*run)(thread_ctx_t *);
+    bgh_t *tracker;
+    void *map;
+    pthread_rwlock_t *rwlock;
+    pthread_mutex_t *mutex;
+    uint64_t start_ns, end_ns;
+};
+
+static void *thread_main(void *p) {
+    thread_ctx_t *ctx = (thread_ctx_t*)p;
+    pthread_barrier_wait(ctx->barrier);
+    ctx->start_ns = now_ns();
+    ctx->run(ctx);
+    ctx->end_ns = now_ns();
+    return NULL;
+}
+
+// Time nthreads threads each running their share of ops, from the first 
+// to start to the last to finish
+static double run_threads(int nthreads, thread_ctx_t proto, uint64_t nops) {
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<thread_ctx_t> ctx(nthreads, proto);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nthreads);
+
+    for(int i=0; i<nthreads; i++) {
+        ctx[i].barrier = &barrier;
+        ctx[i].begin = nops * i / nthreads;
+        ctx[i].end = nops * (i + 1) / nthreads;
+        pthread_create(&threads[i], NULL, thread_main, &ctx[i]);
+    }
+
+    uint64_t start = UINT64_MAX, end = 0;
+    for(int i=0; i<nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        start = std::min(start, ctx[i].start_ns);
+        end = std::max(end, ctx[i].end_ns);
+    }
+
+    pthread_barrier_destroy(&barrier);
+    return end - start;
+}
+
+static void bgh_lookup_run(thread_ctx_t *ctx) {
+    uintptr_t found = 0;
+    for(uint64_t i=ctx->begin; i<ctx->end; i++)
+        found += (uintptr_t)bgh_lookup(ctx->tracker, (bgh_key_t*)&(*ctx->ops)[i]);
+    sink = found;
+}
+
+template<class Map>
+static void map_lookup_run(thread_ctx_t *ctx) {
+    Map *map = (Map*)ctx->map;
+    uintptr_t found = 0;
+    for(uint64_t i=ctx->begin; i<ctx->end; i++) {
+        pthread_rwlock_rdlock(ctx->rwlock);
+        found += map->find((*ctx->ops)[i]) != map->end();
+        pthread_rwlock_unlock(ctx->rwlock);
+    }
+    sink = found;
+}
+
+template<class Map>
+static void map_threads(const char *name, const std::vector<bgh_key_t> &keys,
+        const std::vector<bgh_key_t> &ops) {
+    Map map;
+    map.reserve(keys.size());
+    for(auto &k : keys)
+        map[k] = present;
+
+    pthread_rwlock_t rwlock;
+    pthread_rwlock_init(&rwlock, NULL);
+
+    thread_ctx_t proto = {};
+    proto.ops = &ops;
+    proto.run = map_lookup_run<Map>;
+    proto.map = &map;
+    proto.rwlock = &rwlock;
+
+    for(int t : opts.threads) {
+        double ns = median_ns([&]() { return run_threads(t, proto, ops.size()); });
+        report("threads", name, keys.size(), t, "", ops.size(), ns);
+    }
+    pthread_rwlock_destroy(&rwlock);
+}
+
+static void threads(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 8),
+                           misses = make_keys(nkeys, 9);
+    std::vector<bgh_key_t> ops = hit_miss_ops(keys, misses, 100);
+
+    bgh_t *tracker = new_tracker(nkeys);
+    for(auto &k : keys)
+        bgh_insert(tracker, &k, present);
+
+    thread_ctx_t proto = {};
+    proto.ops = &ops;
+    proto.run = bgh_lookup_run;
+    proto.tracker = tracker;
+
+    for(int t : opts.threads) {
+        double ns = median_ns([&]() { return run_threads(t, proto, ops.size()); });
+        report("threads", "bgh", nkeys, t, "", ops.size(), ns);
+    }
+    bgh_free(tracker);
+
+    FOR_EACH_MAP(map_threads, keys, ops);
+}
+
+/////////////////////////
+// threads_insert
+
+static void bgh_insert_run(thread_ctx_t *ctx) {
+    for(uint64_t i=ctx->begin; i<ctx->end; i++)
+        bgh_insert(ctx->tracker, (bgh_key_t*)&(*ctx->ops)[i], present);
+}
+
+template<class Map>
+static void map_insert_run(thread_ctx_t *ctx) {
+    Map *map = (Map*)ctx->map;
+    for(uint64_t i=ctx->begin; i<ctx->end; i++) {
+        pthread_mutex_lock(ctx->mutex);
+        map->emplace((*ctx->ops)[i], present);
+        pthread_mutex_unlock(ctx->mutex);
+    }
+}
+
+template<class Map>
+static void map_threads_insert(const char *name,
+        const std::vector<bgh_key_t> &keys) {
+    pthread_mutex_t mutex;
+    pthread_mutex_init(&mutex, NULL);
+
+    for(int t : opts.threads) {
+        double ns = median_ns([&]() {
+            Map map;
+            map.reserve(keys.size());
+
+            thread_ctx_t proto = {};
+            proto.ops = &keys;
+            proto.run = map_insert_run<Map>;
+            proto.map = &map;
+            proto.mutex = &mutex;
+            return run_threads(t, proto, keys.size());
+        });
+        report("threads_insert", name, keys.size(), t, "", keys.size(), ns);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+static void threads_insert(uint64_t nkeys) {
+    std::vector<bgh_key_t> keys = make_keys(nkeys, 10);
+
+    // One shard, so one lock, and a shard per writer thread or more
+    uint32_t shard_counts[] = { 1, 16 };
+    for(uint32_t nshards : shard_counts) {
+        for(int t : opts.threads) {
+            double ns = median_ns([&]() {
+                bgh_t *tracker = new_tracker(nkeys, nshards);
+
+                thread_ctx_t proto = {};
+                proto.ops = &keys;
+                proto.run = bgh_insert_run;
+                proto.tracker = tracker;
+
+                double ns = run_threads(t, proto, keys.size());
+                bgh_free(tracker);
+                return ns;
+            });
+            report("threads_insert", "bgh", nkeys, t,
+                "shards=" + std::to_string(nshards), nkeys, ns);
+        }
+    }
+
+    FOR_EACH_MAP(map_threads_insert, keys);
+}
+
+/////////////////////////
+
+struct workload_t {
+    const char *name;
+    void (*run)(uint64_t nkeys);
+};
+
+static workload_t workloads[] = {
+    { "hit_miss", hit_miss },
+    { "syn_flood", syn_flood },
+    { "zipf", zipf },
+    { "refresh", refresh },
+    { "threads", threads },
+    { "threads_insert", threads_insert },
+};
+
+template<class T>
+static std::vector<T> parse_list(const char *arg) {
+    std::vector<T> list;
+    std::string s(arg);
+    size_t pos = 0;
+    while(pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        if(comma == std::string::npos)
+            comma = s.size();
+        if(comma > pos)
+            list.push_back((T)strtod(s.substr(pos, comma - pos).c_str(), NULL));
+        pos = comma + 1;
+    }
+    return list;
+}
+
+static void usage(const char *prog) {
+    printf(
+        "Usage: %s [options]\n"
+        "  -s, --sizes N,N,...       Keys per table (default 10000,100000,1000000)\n"
+        "                            Up to 2e7, which needs several GB of memory\n"
+        "  -t, --threads N,N,...     Thread counts (default 1,2,4,8)\n"
+        "  -n, --ops N               Operations per measurement (default %d)\n"
+        "  -r, --reps N              Repetitions, the median is reported (default %d)\n"
+        "  -w, --workload NAME       Run only this workload. May be repeated\n"
+        "  -j, --json                JSON instead of CSV\n",
+        prog, BENCH_DEFAULT_OPS, BENCH_DEFAULT_REPS);
+    printf("Workloads:");
+    for(auto &w : workloads)
+        printf(" %s", w.name);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    opts.sizes = { 10000, 100000, 1000000 };
+    opts.threads = { 1, 2, 4, 8 };
+    opts.ops = BENCH_DEFAULT_OPS;
+    opts.reps = BENCH_DEFAULT_REPS;
+    opts.json = false;
+
+    static struct option long_opts[] = {
+        { "sizes", required_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 't' },
+        { "ops", required_argument, NULL, 'n' },
+        { "reps", required_argument, NULL, 'r' },
+        { "workload", required_argument, NULL, 'w' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:t:n:r:w:jh", long_opts, NULL)) != -1) {
+        switch(c) {
+        case 's': opts.sizes = parse_list<uint64_t>(optarg); break;
+        case 't': opts.threads = parse_list<int>(optarg); break;
+        case 'n': opts.ops = strtoull(optarg, NULL, 10); break;
+        case 'r': opts.reps = atoi(optarg); break;
+        case 'w': opts.workloads.push_back(optarg); break;
+        case 'j': opts.json = true; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if(opts.sizes.empty() || opts.threads.empty() || !opts.ops || opts.reps < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for(auto &w : opts.workloads) {
+        bool known = false;
+        for(auto &k : workloads)
+            known |= w == k.name;
+        if(!known) {
+            fprintf(stderr, "Unknown workload: %s\n", w.c_str());
+            return 1;
+        }
+    }
+
+    for(auto &w : workloads) {
+        if(!opts.workloads.empty() &&
+           std::find(opts.workloads.begin(), opts.workloads.end(), w.name) ==
+                opts.workloads.end())
+            continue;
+        for(uint64_t n : opts.sizes)
+            w.run(n);
+    }
+
+    report_end();
+    return 0;
+}
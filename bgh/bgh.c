@@ -5,24 +5,45 @@
  * timeouts and automatic hash resizing
 */
 
+#define _GNU_SOURCE
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bgh.h"
-#include "primes.h"
+#include "group.h"
 
 void bgh_config_init(bgh_config_t *config) {
-    int len = prime_total();
-
-    config->starting_rows = prime_at_idx(len/2); 
-    config->min_rows = prime_at_idx(0);
-    config->max_rows = prime_at_idx(len);
+    config->starting_rows = BGH_DEFAULT_STARTING_ROWS;
+    config->min_rows = BGH_DEFAULT_MIN_ROWS;
+    config->max_rows = BGH_DEFAULT_MAX_ROWS;
     config->timeout = BGH_DEFAULT_TIMEOUT;
     config->refresh_period = BGH_DEFAULT_REFRESH_PERIOD;
     config->hash_full_pct = BGH_DEFAULT_HASH_FULL_PCT;
+    config->max_probe = BGH_DEFAULT_MAX_PROBE;
+    config->key_type = BGH_KEY_V4;
+    config->teardown_rows = BGH_DEFAULT_TEARDOWN_ROWS;
+    config->teardown_slice_us = BGH_DEFAULT_TEARDOWN_SLICE_US;
+    config->teardown_pause_us = BGH_DEFAULT_TEARDOWN_PAUSE_US;
+    config->free_batch_cb = NULL;
+    config->table_pool = BGH_DEFAULT_TABLE_POOL;
+    config->hugepages = BGH_HUGEPAGES_OFF;
+    config->manual_maintenance = false;
+    config->shm_name = NULL;
+    config->value_size = 0;
+    config->tick_ms = BGH_DEFAULT_TICK_MS;
+    memset(config->class_timeout_ms, 0, sizeof(config->class_timeout_ms));
+    config->overload = BGH_OVERLOAD_REFUSE;
+    config->grow_pct = 0;
+    config->shrink_refreshes = BGH_DEFAULT_SHRINK_REFRESHES;
+    config->soft_limit_pct = BGH_DEFAULT_SOFT_LIMIT_PCT;
 
     // Control scaling
     // If the number of inserts > number rows * scale_up_pct
@@ -33,12 +54,14 @@ void bgh_config_init(bgh_config_t *config) {
     config->scale_down_pct = BGH_DEFAULT_HASH_FULL_PCT * 0.1;
 }
 
-bgh_row_t *bgh_new_row() {
-    bgh_row_t *row = (bgh_row_t*)calloc(sizeof(bgh_row_t), 1);
-    if(!row)
-        return NULL;
-    return row;
-};
+// Whether any class has an idle timeout, and so needs the timer wheel
+static bool _idle_timeouts(bgh_config_t *config) {
+    for(int i=0; i<BGH_CLASSES; i++) {
+        if(config->class_timeout_ms[i])
+            return true;
+    }
+    return false;
+}
 
 bgh_t *bgh_new(void (*free_cb)(void *)) {
     bgh_config_t config;
@@ -47,414 +70,3456 @@ bgh_t *bgh_new(void (*free_cb)(void *)) {
     return bgh_config_new(&config, free_cb);
 }
 
+static void _shm_release(bgh_tbl_t *tbl);
+
+static void _free_nop(void *data) {}
+
+// Release a table's memory, without touching what's in it
+static void _unmap_tbl(bgh_tbl_t *tbl) {
+    if(tbl->shm)
+        _shm_release(tbl);
+    else {
+        munmap(tbl->ctrl, tbl->ctrl_len);
+        munmap(tbl->rows, tbl->rows_len);
+    }
+    free(tbl);
+}
+
 void bgh_free_table(bgh_tbl_t *tbl) {
-    for(int i=0; i<tbl->num_rows; i++) {
-        if(tbl->rows[i]->data) {
-            tbl->free_cb(tbl->rows[i]->data);
+    for(uint64_t i=0; i<tbl->num_rows; i++) {
+        if(tbl->ctrl[i] >= 0) {
+            tbl->free_cb(*(void**)((char*)tbl->rows + i * tbl->row_size));
         }
-        free(tbl->rows[i]);
     }
 
-    free(tbl->rows);
-    free(tbl);
+    _unmap_tbl(tbl);
 }
 
-bgh_tbl_t *bgh_new_tbl(uint64_t rows, uint64_t max_inserts, void (*free_cb)(void *)) {
+// Tables are a power of two rows, so the home row is a mask of the hash
+static uint64_t _rows_pow2(uint64_t rows) {
+    uint64_t n = 1;
+    while(n < rows)
+        n <<= 1;
+    return n;
+}
+
+// Every table gets a secret seed from the kernel, so nobody outside the
+// process can pick keys that collide, and keys that collide by chance in one
+// table won't in the next. If getrandom isn't available, fall back to 
+// splitmix64 over a counter, which still differs table to table
+static uint64_t _new_seed() {
+    uint64_t z;
+    if(getrandom(&z, sizeof(z), GRND_NONBLOCK) == sizeof(z))
+        return z;
+
+    static uint64_t state = 0;
+    z = __atomic_add_fetch(&state, 0x9E3779B97F4A7C15ULL, __ATOMIC_RELAXED);
+    z ^= (uint64_t)time(NULL) << 32;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Table memory is mapped directly rather than malloc'd, and faulted in up 
+// front so the first inserts into a new table don't each take a page fault.
+// With BGH_HUGEPAGES_HUGETLB, try for reserved huge pages first. Otherwise, 
+// or if none are available, use regular pages and ask for THP. Sets *len to 
+// the length mapped
+static void *_map(size_t *len, bgh_hugepages_t hugepages) {
+    void *p;
+
+    if(hugepages == BGH_HUGEPAGES_HUGETLB) {
+        size_t hlen = (*len + BGH_HUGE_PAGE - 1) & ~(size_t)(BGH_HUGE_PAGE - 1);
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if(p != MAP_FAILED) {
+            *len = hlen;
+            return p;
+        }
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    *len = (*len + page - 1) & ~(page - 1);
+
+    // THP has to be asked for before the pages are faulted in, so populate
+    // by hand after the madvise
+    p = mmap(NULL, *len, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS | 
+            (hugepages == BGH_HUGEPAGES_OFF ? MAP_POPULATE : 0), -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+
+    if(hugepages != BGH_HUGEPAGES_OFF) {
+        madvise(p, *len, MADV_HUGEPAGE);
+        for(size_t off=0; off<*len; off+=page)
+            ((volatile char*)p)[off] = 0;
+    }
+
+    return p;
+}
+
+// Bytes per row. Inline values go after the row, and the whole is rounded
+// up to a power of two so rows still never straddle a cache line
+static uint32_t _tbl_row_size(bgh_key_type_t key_type, uint32_t value_size) {
+    uint32_t size = 
+        key_type == BGH_KEY_V6 ? sizeof(bgh_row6_t) : sizeof(bgh_row_t);
+    return value_size ? _rows_pow2(size + value_size) : size;
+}
+
+static bool _shm_take(bgh_shm_t *shm, bgh_tbl_t *tbl);
+
+static bgh_tbl_t *_new_tbl(uint64_t rows, uint64_t max_inserts, 
+        void (*free_cb)(void *), bgh_key_type_t key_type, 
+        bgh_hugepages_t hugepages, uint32_t value_size, bgh_shm_t *shm) {
     bgh_tbl_t *tbl = (bgh_tbl_t*)malloc(sizeof(bgh_tbl_t));
     if(!tbl)
         return NULL;
 
-    tbl->num_rows = rows;
-    tbl->rows = (bgh_row_t**)malloc(sizeof(bgh_row_t) * tbl->num_rows);
+    tbl->key_type = key_type;
+    tbl->value_size = value_size;
+    tbl->row_size = _tbl_row_size(key_type, value_size);
+    tbl->num_rows = _rows_pow2(rows);
+    tbl->max_probe = tbl->num_rows;
+    tbl->seed = _new_seed();
+    tbl->version = 0;
+    tbl->shm = NULL;
+
+    // Rows are stored inline in one contiguous block, page aligned so that a
+    // row never straddles two cache lines. A probe touches a single line. 
+    // Fresh mappings are already zeroed
+    if(shm) {
+        if(!_shm_take(shm, tbl)) {
+            free(tbl);
+            return NULL;
+        }
+    }
+    else {
+        tbl->rows_len = (size_t)tbl->row_size * tbl->num_rows;
+        tbl->rows = (bgh_row_t*)_map(&tbl->rows_len, hugepages);
+        if(!tbl->rows) {
+            free(tbl);
+            return NULL;
+        }
 
-    if(!tbl->rows) {
-        free(tbl);
-        return NULL;
+        // Plus a copy of the first group's worth, see _set_ctrl
+        tbl->ctrl_len = tbl->num_rows + BGH_GROUP_WIDTH;
+        tbl->ctrl = (int8_t*)_map(&tbl->ctrl_len, hugepages);
+        if(!tbl->ctrl) {
+            munmap(tbl->rows, tbl->rows_len);
+            free(tbl);
+            return NULL;
+        }
     }
 
-    for(int i=0; i<tbl->num_rows; i++)
-        tbl->rows[i] = bgh_new_row();
+    memset(tbl->ctrl, BGH_CTRL_EMPTY, tbl->num_rows + BGH_GROUP_WIDTH);
 
     tbl->free_cb = free_cb;
-    tbl->inserted = tbl->collisions = 0;
+    tbl->inserted = tbl->collisions = tbl->tombstones = 0;
+    tbl->probe_limit_hits = 0;
     tbl->max_inserts = max_inserts;
+    tbl->soft_inserts = max_inserts + 1;
+    tbl->hand = 0;
     return tbl;
 }
 
-uint64_t _update_size(bgh_config_t *config, int *idx, bgh_tbl_t *tbl) {
-    // TODO: incorporate a timeout
+// A table with IPv4 keys
+bgh_tbl_t *bgh_new_tbl(uint64_t rows, uint64_t max_inserts, void (*free_cb)(void *)) {
+    return _new_tbl(rows, max_inserts, free_cb, BGH_KEY_V4, BGH_HUGEPAGES_OFF, 
+        0, NULL);
+}
+
+// Shared regions. The writer creates the region, carves it into 
+// BGH_SHM_TABLES slots, and places each table it allocates in a free slot. 
+// Whenever the active or standby table changes, it publishes them in the 
+// header for readers in other processes
+
+// Size of a region for config, and where each slot's rows and control 
+// bytes go. Everything is aligned to a huge page, in case the region is on
+// hugetlbfs
+static size_t _shm_layout(bgh_config_t *config, bgh_shm_hdr_t *hdr) {
+    uint64_t slot_rows = _rows_pow2(config->starting_rows);
+    if(_rows_pow2(config->max_rows) > slot_rows)
+        slot_rows = _rows_pow2(config->max_rows);
+
+    uint32_t row_size = _tbl_row_size(config->key_type, config->value_size);
+    size_t align = BGH_HUGE_PAGE;
+    size_t off = (sizeof(bgh_shm_hdr_t) + align - 1) & ~(align - 1);
+
+    hdr->slot_rows = slot_rows;
+    hdr->row_size = row_size;
+    for(int i=0; i<BGH_SHM_TABLES; i++) {
+        hdr->rows_off[i] = off;
+        off += (slot_rows * row_size + align - 1) & ~(align - 1);
+        hdr->ctrl_off[i] = off;
+        off += (slot_rows + BGH_GROUP_WIDTH + align - 1) & ~(align - 1);
+    }
+    return off;
+}
 
-    // printf("Sizing: %lu > %f ? Max inserts: %lu\n", 
-    //       tbl->inserted, tbl->num_rows * config->scale_up_pct/100.0, tbl->max_inserts);
+// Names with a directory in them are files, the rest are for shm_open
+static bool _shm_is_path(const char *name) {
+    return strchr(name + 1, '/') != NULL;
+}
 
-    uint64_t next = 0;
-    if(config->scale_up_pct > 0 && (tbl->inserted > tbl->num_rows * config->scale_up_pct/100.0)) {
-        next = prime_larger_idx(*idx);
-        if(next > config->max_rows)
-            return config->max_rows;
-        (*idx)++;
-        return next;
+// Create the region, replacing any left over from an earlier writer. 
+// Readers still attached to that one keep their mapping, but it is no 
+// longer updated
+static bgh_shm_t *_shm_create(bgh_config_t *config) {
+    bgh_shm_hdr_t layout;
+    memset(&layout, 0, sizeof(layout));
+    size_t len = _shm_layout(config, &layout);
+
+    const char *name = config->shm_name;
+    int fd;
+    if(_shm_is_path(name)) {
+        unlink(name);
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    else {
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
     }
+    if(fd < 0)
+        return NULL;
 
-    if(tbl->inserted < tbl->num_rows * config->scale_down_pct/100.0) {
-        next = prime_smaller_idx(*idx);
-        if(next < config->min_rows)
-            return config->min_rows;
-        (*idx)--;
-        return next;
+    // Slots are only faulted in as tables use them
+    void *p = MAP_FAILED;
+    if(!ftruncate(fd, len))
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    bgh_shm_t *shm = (bgh_shm_t*)calloc(1, sizeof(bgh_shm_t));
+    if(p == MAP_FAILED || !shm || !(shm->name = strdup(name))) {
+        if(p != MAP_FAILED)
+            munmap(p, len);
+        free(shm);
+        _shm_is_path(name) ? unlink(name) : shm_unlink(name);
+        return NULL;
     }
 
-    return tbl->num_rows;
+    shm->hdr = (bgh_shm_hdr_t*)p;
+    shm->len = len;
+    memcpy(shm->hdr, &layout, sizeof(layout));
+    shm->hdr->version = BGH_SHM_VERSION;
+    shm->hdr->key_type = config->key_type;
+    shm->hdr->value_size = config->value_size;
+    shm->hdr->size = len;
+    shm->hdr->active = shm->hdr->standby = -1;
+    return shm;
 }
 
-static void *refresh_thread(void *ctx) {
-    bgh_t *ssns = (bgh_t*)ctx;
-    static time_t last = 0;
-
-    last = time(NULL);
+// Once the first table is published, let readers in
+static void _shm_ready(bgh_shm_t *shm) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->hdr->magic, BGH_SHM_MAGIC, sizeof(BGH_SHM_MAGIC));
+}
 
-    int pindex = prime_nearest_idx(ssns->config.starting_rows);
+static void _shm_destroy(bgh_shm_t *shm) {
+    __atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_RELEASE);
+    munmap(shm->hdr, shm->len);
+    _shm_is_path(shm->name) ? unlink(shm->name) : shm_unlink(shm->name);
+    free(shm->name);
+    free(shm);
+}
 
-    while(ssns->running) {
-        time_t now = time(NULL);
+// Place a table in a free slot. Slots come back from _shm_release zeroed
+static bool _shm_take(bgh_shm_t *shm, bgh_tbl_t *tbl) {
+    if(tbl->num_rows > shm->hdr->slot_rows)
+        return false;
 
-        // See if we should begin building a new table yet
-        if(now - last < ssns->config.refresh_period) {
-            usleep(50000); // 50 ms
+    for(uint32_t i=0; i<BGH_SHM_TABLES; i++) {
+        if(shm->used[i])
             continue;
-        }
 
-        // Calc new hash size
-        uint64_t nrows = _update_size(&ssns->config, &pindex, ssns->active);
-        uint64_t max_inserts = nrows * ssns->config.hash_full_pct/100.0;
+        char *base = (char*)shm->hdr;
+        shm->used[i] = true;
+        tbl->shm = shm;
+        tbl->shm_slot = i;
+        tbl->rows = (bgh_row_t*)(base + shm->hdr->rows_off[i]);
+        tbl->ctrl = (int8_t*)(base + shm->hdr->ctrl_off[i]);
+        tbl->rows_len = (size_t)tbl->row_size * tbl->num_rows;
+        tbl->ctrl_len = tbl->num_rows + BGH_GROUP_WIDTH;
+
+        // Fault the table in up front, as _map does
+        size_t page = sysconf(_SC_PAGESIZE);
+        for(size_t off=0; off<tbl->rows_len; off+=page)
+            ((volatile char*)tbl->rows)[off] = 0;
+        return true;
+    }
+    return false;
+}
 
-        // Create new hash
-        ssns->standby = bgh_new_tbl(nrows, max_inserts, ssns->active->free_cb);
+// Give a table's slot back. By now no reader can be using it, so its pages
+// are dropped, which also zeroes them for the next table
+static void _shm_release(bgh_tbl_t *tbl) {
+    bgh_shm_t *shm = tbl->shm;
+    if(!shm->closing) {
+        madvise(tbl->rows, shm->hdr->slot_rows * shm->hdr->row_size, MADV_REMOVE);
+        madvise(tbl->ctrl, shm->hdr->slot_rows + BGH_GROUP_WIDTH, MADV_REMOVE);
+    }
+    shm->used[tbl->shm_slot] = false;
+}
 
-        if(!ssns->standby) {
-            // XXX Need way to handle/report this case gracefully
-            // For now, just skip resize + timneout :/
-            // abort();
-            continue;
-        }
+static void _shm_publish_tbl(bgh_shm_hdr_t *hdr, bgh_tbl_t *tbl, int32_t *slot) {
+    if(!tbl) {
+        *slot = -1;
+        return;
+    }
+    *slot = tbl->shm_slot;
+    hdr->tables[tbl->shm_slot].num_rows = tbl->num_rows;
+    hdr->tables[tbl->shm_slot].max_probe = tbl->max_probe;
+    hdr->tables[tbl->shm_slot].seed = tbl->seed;
+}
 
-        ssns->refreshing = true;
+// Publish the current tables to readers. Called with the lock held, after
+// the tracker's own pointers have changed
+static void _shm_publish(bgh_t *ssns) {
+    if(!ssns->shm)
+        return;
 
-        // When we're refreshing, all new sessions go into the new table
-        // Lookups are tried on both, if the first lookup fails. When a 
-        // lookup succeeds on the active (and about to be replaced) table, 
-        // the data is removed from that table and inserted in the standby table
-        sleep(ssns->config.timeout);
+    bgh_shm_hdr_t *hdr = ssns->shm->hdr;
+    __atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    _shm_publish_tbl(hdr, ssns->active, &hdr->active);
+    _shm_publish_tbl(hdr, ssns->standby, &hdr->standby);
+    __atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELEASE);
+}
 
-        bgh_tbl_t *old_tbl = ssns->active;
+// Each thread is handed its own reader slot the first time it enters a 
+// read-side section. Slots are shared round-robin past BGH_READER_SLOTS 
+// threads, which is still correct, just with some cache line sharing
+static uint32_t next_reader_slot = 0;
+static __thread int reader_slot = -1;
+
+static inline int _reader_slot() {
+    if(reader_slot < 0)
+        reader_slot = __atomic_fetch_add(
+            &next_reader_slot, 1, __ATOMIC_RELAXED) % BGH_READER_SLOTS;
+    return reader_slot;
+}
 
-        // Swap to the new table
-        pthread_mutex_lock(&ssns->lock);
-        ssns->active = ssns->standby;
-        ssns->refreshing = false;
-        pthread_mutex_unlock(&ssns->lock);
+// Count a reader in its slot for the parity of epoch. If the epoch moves 
+// on between loading it and counting ourselves, a grace period may already
+// be waiting on the parity we didn't pick, without us, so leave and go 
+// again under the new one. Once counted under the current parity, the 
+// epoch can't advance twice past us, see _bgh_epoch_advance
+static inline uint64_t *_epoch_enter(uint64_t *epoch, bgh_reader_t *readers) {
+    bgh_reader_t *slot = &readers[_reader_slot()];
+    for(;;) {
+        uint64_t e = __atomic_load_n(epoch, __ATOMIC_ACQUIRE);
+        uint64_t *ctr = &slot->active[e & 1];
+        __atomic_fetch_add(ctr, 1, __ATOMIC_SEQ_CST);
+        if(!((__atomic_load_n(epoch, __ATOMIC_SEQ_CST) ^ e) & 1))
+            return ctr;
+        __atomic_fetch_sub(ctr, 1, __ATOMIC_RELEASE);
+    }
+}
 
-        // Not technically necessary, but makes debugging easier
-        ssns->standby = NULL;
+// Enter a read-side section. Any table reachable from the tracker when this
+// returns will not be freed until the matching _bgh_read_end
+uint64_t *_bgh_read_begin(bgh_t *ssns) {
+    return _epoch_enter(&ssns->epoch, ssns->readers);
+}
 
-        // Delete old table
-        bgh_free_table(old_tbl);
+void _bgh_read_end(uint64_t *ctr) {
+    __atomic_fetch_sub(ctr, 1, __ATOMIC_RELEASE);
+}
 
-        last = now;
+static bool _readers_drained(bgh_reader_t *readers, uint64_t parity) {
+    for(int i=0; i<BGH_READER_SLOTS; i++) {
+        if(__atomic_load_n(&readers[i].active[parity], __ATOMIC_SEQ_CST))
+            return false;
     }
+    return true;
+}
 
-    return NULL;
+static bool _bgh_epoch_drained(bgh_t *ssns, uint64_t parity) {
+    return _readers_drained(ssns->readers, parity) &&
+        (!ssns->shm || _readers_drained(ssns->shm->hdr->readers, parity));
 }
 
-bgh_t *bgh_config_new(bgh_config_t *config, void (*free_cb)(void *)) {
-    bgh_t *table = (bgh_t*)malloc(sizeof(bgh_t));
-    if(!table)
-        return NULL;
+// Reader processes of a shared tracker count themselves on the region's 
+// epoch. It leads ours by at most one: it only advances once ours has 
+// caught up
+static inline uint64_t *_bgh_epoch_lead(bgh_t *ssns) {
+    return ssns->shm ? &ssns->shm->hdr->epoch : &ssns->epoch;
+}
 
-    table->config = *config;
+// Move the epoch on by one, if every reader counted under the parity it 
+// moves to has left. Those can only be readers from the epoch before the 
+// current one, since later ones count under the current parity. So readers
+// are only ever in flight from two epochs, and a steady stream of new ones
+// can't hold up an advance. Returns whether it moved. Safe to race
+static bool _bgh_epoch_advance(bgh_t *ssns) {
+    uint64_t e = __atomic_load_n(&ssns->epoch, __ATOMIC_SEQ_CST);
+    uint64_t *lead = _bgh_epoch_lead(ssns);
+
+    if(lead != &ssns->epoch) {
+        uint64_t l = __atomic_load_n(lead, __ATOMIC_SEQ_CST);
+        if(l != e) {
+            __atomic_compare_exchange_n(&ssns->epoch, &e, l, false, 
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    }
 
-    table->active = bgh_new_tbl(
-        config->starting_rows, 
-        config->starting_rows * config->hash_full_pct/100.0, 
-        free_cb);
+    if(!_bgh_epoch_drained(ssns, (e + 1) & 1))
+        return false;
+
+    uint64_t expect = e;
+    if(!__atomic_compare_exchange_n(lead, &expect, e + 1, false, 
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return false;
+    if(lead != &ssns->epoch)
+        __atomic_compare_exchange_n(&ssns->epoch, &e, e + 1, false, 
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return true;
+}
 
-    table->standby = NULL;
+// Start a grace period for whatever was unpublished before this call. 
+// Returns a ticket for _bgh_retired
+static uint64_t _bgh_retire(bgh_t *ssns) {
+    return __atomic_load_n(_bgh_epoch_lead(ssns), __ATOMIC_SEQ_CST);
+}
 
-    if(config->refresh_period > 0)
-        table->running = true;
-    else
-        table->running = false;
+// Whether the grace period for ticket is over, moving the epoch on if it 
+// can. A reader that could have found what was retired entered at the 
+// ticket's epoch or before, and holds up the advance to two past it. Never
+// blocks
+static bool _bgh_retired(bgh_t *ssns, uint64_t ticket) {
+    uint64_t *lead = _bgh_epoch_lead(ssns);
+    while(__atomic_load_n(lead, __ATOMIC_SEQ_CST) < ticket + 2) {
+        if(!_bgh_epoch_advance(ssns))
+            return false;
+    }
+    return true;
+}
 
-    table->refreshing = false;
-    pthread_mutex_init(&table->lock, NULL);
+// Wait out every reader that could still hold a pointer to a table that was
+// unpublished before this call
+void _bgh_synchronize(bgh_t *ssns) {
+    uint64_t ticket = _bgh_retire(ssns);
+    while(!_bgh_retired(ssns, ticket))
+        sched_yield();
+}
+
+// Rows for the table to follow tbl, one of ssns's. Sessions the new table 
+// should expect are those in tbl, plus those arriving at the rate seen 
+// lately while tbl drains into it. Past scale_up_pct, the table grows 
+// straight to the size that holds them under scale_up_pct, several 
+// doublings at once if need be. It only halves if this refresh and the 
+// shrink_refreshes - 1 before it found it under scale_down_pct. Never grows 
+// past max_rows, rounded down to a power of two, or shrinks below 
+// min_rows, rounded up
+uint64_t _update_size(bgh_t *ssns, bgh_tbl_t *tbl) {
+    bgh_config_t *config = &ssns->config;
+    uint64_t expect = tbl->inserted + 
+        (uint64_t)(ssns->load_rate * config->timeout);
+
+    if(config->scale_up_pct > 0 && 
+       expect > tbl->num_rows * config->scale_up_pct/100.0) {
+        uint64_t max = _rows_pow2(config->max_rows);
+        if(max > config->max_rows && max > 1)
+            max >>= 1;
+        uint64_t want = _rows_pow2(expect * 100.0 / config->scale_up_pct);
+        if(want < tbl->num_rows * 2)
+            want = tbl->num_rows * 2;
+        return want > max ? 
+            (max > tbl->num_rows ? max : tbl->num_rows) : want;
+    }
 
-    pthread_create(&table->refresh, NULL, refresh_thread, table);
+    if(ssns->low_refreshes + 1 >= config->shrink_refreshes && 
+       tbl->inserted < tbl->num_rows * config->scale_down_pct/100.0) {
+        uint64_t min = _rows_pow2(config->min_rows);
+        return tbl->num_rows / 2 < min ? 
+            (min < tbl->num_rows ? min : tbl->num_rows) : tbl->num_rows / 2;
+    }
 
-    return table;
+    return tbl->num_rows;
 }
 
-void bgh_free(bgh_t *ssns) {
-    if(!ssns) return;
+// A table for a tracker, with the tracker's probe bound
+static bgh_tbl_t *_tracker_new_tbl(
+        bgh_t *ssns, uint64_t nrows, void (*free_cb)(void *)) {
+    bgh_config_t *config = &ssns->config;
+    bgh_tbl_t *tbl = _new_tbl(nrows, nrows * config->hash_full_pct/100.0, 
+        free_cb, config->key_type, config->hugepages, config->value_size, 
+        ssns->shm);
+
+    if(!tbl) {
+        __atomic_add_fetch(&ssns->alloc_failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
 
-    ssns->running = false;
-    pthread_join(ssns->refresh, NULL);
+    __atomic_add_fetch(&ssns->tables_allocated, 1, __ATOMIC_RELAXED);
 
-    bgh_free_table(ssns->active);
-    if(ssns->standby)
-        bgh_free_table(ssns->standby);
-    free(ssns);
+    if(config->max_probe && config->max_probe < tbl->num_rows)
+        tbl->max_probe = config->max_probe;
+
+    // Without a policy, the limit is the only limit
+    if(config->overload) {
+        float pct = config->soft_limit_pct < 100 ? config->soft_limit_pct : 100;
+        tbl->soft_inserts = tbl->max_inserts * (pct > 0 ? pct : 0) / 100.0;
+    }
+    return tbl;
 }
 
-static inline int key_eq(bgh_key_t *k1, bgh_key_t *k2) {
-    uint64_t *p1 = (uint64_t*)k1;
-    uint64_t *p2 = (uint64_t*)k2;
+// Retired tables are kept for reuse by the next refresh, so in steady state 
+// a refresh neither allocates nor faults in a table. Only the refresh 
+// thread, and bgh_free after it has stopped, touch the pool.
+// Tables go in already emptied, see _teardown_table
+static void _pool_put(bgh_t *ssns, bgh_tbl_t *tbl) {
+    uint32_t size = ssns->config.table_pool < BGH_TABLE_POOL_MAX ? 
+        ssns->config.table_pool : BGH_TABLE_POOL_MAX;
+
+    if(!size) {
+        _unmap_tbl(tbl);
+        return;
+    }
+
+    // Full. Drop the oldest
+    if(ssns->pool[size - 1]) {
+        _unmap_tbl(ssns->pool[0]);
+        memmove(&ssns->pool[0], &ssns->pool[1], 
+            (size - 1) * sizeof(bgh_tbl_t*));
+        ssns->pool[size - 1] = NULL;
+    }
 
-    return 
-        ((p1[0] == p2[0] && p1[1] == p1[1]) ||
-        (p1[0] == p2[1] && p1[1] == p2[0])) &&
-        k1->vlan == k2->vlan;
+    for(uint32_t i=0; i<size; i++) {
+        if(!ssns->pool[i]) {
+            ssns->pool[i] = tbl;
+            return;
+        }
+    }
 }
 
-// Hash func: XOR32
-// Reference: https://www.researchgate.net/publication/281571413_COMPARISON_OF_HASH_STRATEGIES_FOR_FLOW-BASED_LOAD_BALANCING
-static inline uint64_t hash_func(uint64_t mask, bgh_key_t *key) {
-#if 1
-    uint64_t h = (uint64_t)(key->sip ^ key->dip) ^
-                  (uint64_t)(key->sport * key->dport);
-    h *= 1 + key->vlan;
-#else
-    // XXX Gave similar distribution performance to the above
-    MD5_CTX c;
-    MD5_Init(&c);
-    MD5_Update(&c, key, sizeof(*key));
-    unsigned char digest[16];
-    MD5_Final(digest, &c);
-    
-    uint64_t h = *(uint64_t*)digest;
-#endif
-    return h % mask;
+// A pooled table of nrows rows, ready for use, or NULL
+static bgh_tbl_t *_pool_get(bgh_t *ssns, uint64_t nrows) {
+    for(uint32_t i=0; i<BGH_TABLE_POOL_MAX; i++) {
+        bgh_tbl_t *tbl = ssns->pool[i];
+        if(!tbl || tbl->num_rows != nrows)
+            continue;
+
+        memmove(&ssns->pool[i], &ssns->pool[i + 1], 
+            (BGH_TABLE_POOL_MAX - i - 1) * sizeof(bgh_tbl_t*));
+        ssns->pool[BGH_TABLE_POOL_MAX - 1] = NULL;
+
+        // Same as a new table, including a new seed
+        tbl->seed = _new_seed();
+        tbl->inserted = tbl->collisions = tbl->tombstones = 0;
+        tbl->probe_limit_hits = 0;
+        tbl->hand = 0;
+        return tbl;
+    }
+    return NULL;
 }
 
-int64_t _lookup_idx(bgh_tbl_t *table, bgh_key_t *key) {
-    int64_t idx = hash_func(table->num_rows, key);
-    bgh_row_t *row = table->rows[idx];
-
-    // If nothing is/was stored here, just return it anyway.
-    // We'll check later
-    // The check for "deleted" is to deal with the case where there was 
-    // previously a collision
-    if((!row->data && !row->deleted) || key_eq(key, &row->key))
-        return idx;
+// Ahead of the next refresh, make sure the pool has a table of the size it
+// will most likely want. Usually that's the table just torn down
+static void _pool_prepare(bgh_t *ssns) {
+    if(!ssns->config.table_pool)
+        return;
 
-    // There was a collision. Use linear probing
-    //  NOTE: 
-    //  - while draining or on _clear, we set data to null
-    //  - if there had been a collision, we still need to be able to reach the
-    //    collided node
-    //  - "deleted" is used to handle that case
+    uint64_t nrows = _update_size(ssns, ssns->active);
+    for(uint32_t i=0; i<BGH_TABLE_POOL_MAX; i++) {
+        if(ssns->pool[i] && ssns->pool[i]->num_rows == nrows)
+            return;
+    }
 
-    uint64_t collisions = 0;
-    uint64_t start = idx++;
-    while(idx != start) {
-        collisions++;
+    bgh_tbl_t *tbl = _tracker_new_tbl(ssns, nrows, ssns->active->free_cb);
+    if(tbl)
+        _pool_put(ssns, tbl);
+}
 
-        //printf("%llu vs %llu\n", 
-        //        hash_func(table->num_rows, &table->rows[start]->key),
-        //        hash_func(table->num_rows, key));
+static void _pool_free(bgh_t *ssns) {
+    for(uint32_t i=0; i<BGH_TABLE_POOL_MAX; i++) {
+        if(ssns->pool[i])
+            _unmap_tbl(ssns->pool[i]);
+        ssns->pool[i] = NULL;
+    }
+}
 
-        if(idx >= table->num_rows)
-            idx = 0;
+// Build a standby table and start draining into it. Returns false if the
+// table couldn't be allocated, in which case the refresh is skipped
+static bool _refresh_begin(bgh_t *ssns) {
+    bgh_tbl_t *active = ssns->active;
 
-        bgh_row_t *row = table->rows[idx];
+    // Calc new hash size
+    uint64_t nrows = _update_size(ssns, active);
 
-        if(key_eq(key, &row->key)) {
-            // Intentionally ignoring the collision count here. Otherwise, we 
-            // wind up counting extra collisions every time we look up this row
-            return idx;
-        }
+    // Create new hash, or reuse one. Either way it gets a fresh seed
+    bgh_tbl_t *standby = _pool_get(ssns, nrows);
+    if(!standby)
+        standby = _tracker_new_tbl(ssns, nrows, active->free_cb);
 
-        if(!row->data && !row->deleted) {
-            table->collisions += collisions;
-            return idx;
-        }
+    if(!standby)
+        return false;
 
-        idx++;
-    }
+    // Count refreshes in a row that found the table under scale_down_pct. 
+    // Shrinking starts the count over
+    if(nrows >= active->num_rows && active->inserted < 
+            active->num_rows * ssns->config.scale_down_pct/100.0)
+        ssns->low_refreshes++;
+    else
+        ssns->low_refreshes = 0;
 
-    return -1;
+    pthread_mutex_lock(&ssns->lock);
+    __atomic_store_n(&ssns->standby, standby, __ATOMIC_SEQ_CST);
+    ssns->refreshing = true;
+    __atomic_store_n(&ssns->overloaded, false, __ATOMIC_RELAXED);
+    _shm_publish(ssns);
+    pthread_mutex_unlock(&ssns->lock);
+    return true;
 }
 
-bgh_row_t *_lookup_row(bgh_tbl_t *table, bgh_key_t *key) {
-    int64_t idx = hash_func(table->num_rows, key);
-    bgh_row_t *row = table->rows[idx];
+// Swap in the standby table. The old one is left in retired, for 
+// _teardown_slice once the grace period has passed
+static void _refresh_finish(bgh_t *ssns) {
+    bgh_tbl_t *old_tbl = ssns->active;
+
+    // Swap to the new table. Readers look at standby before active, so 
+    // publish the new active table before clearing standby
+    pthread_mutex_lock(&ssns->lock);
+    __atomic_store_n(&ssns->active, ssns->standby, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ssns->standby, NULL, __ATOMIC_SEQ_CST);
+    ssns->refreshing = false;
+    _shm_publish(ssns);
+    pthread_mutex_unlock(&ssns->lock);
+
+    // Lookups don't take the lock. Don't free the old table out from 
+    // under any that might still be walking it
+    ssns->retired = old_tbl;
+    ssns->retired_epoch = _bgh_retire(ssns);
+}
 
-    if(key_eq(key, &row->key))
-        return row;
+static inline uint64_t _now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    // If nothing is/was stored here, just return it anyway.
-    // We'll check later
-    // The check for 'deleted' is to handle the case where
-    // a collided row was moved
-    if(!row->data && !row->deleted)
-        return row;
+// Refresh periods, timeouts and ticks only need ms. The coarse clock is 
+// read from the vDSO without a syscall, and without reading the TSC
+static inline uint64_t _now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    uint64_t start = idx++;
-    while(idx != start) {
-        if(idx >= table->num_rows)
-            idx = 0;
+// Hand a batch of expired sessions to the user
+static void _expire_batch(bgh_t *ssns, bgh_tbl_t *tbl, void **batch, uint32_t n) {
+    if(!n)
+        return;
 
-        bgh_row_t *row = table->rows[idx];
+    if(ssns->config.free_batch_cb)
+        ssns->config.free_batch_cb(batch, n);
+    else {
+        for(uint32_t i=0; i<n; i++)
+            tbl->free_cb(batch[i]);
+    }
 
-        if(key_eq(key, &row->key)) {
-            // Intentionally ignoring the collision count here. Otherwise, we 
-            // wind up counting extra collisions every time we look up this row
-            return row;
-        }
+    __atomic_add_fetch(&ssns->expired, n, __ATOMIC_RELAXED);
+}
 
-        if(!row->data && !row->deleted) {
-            return row;
+// Bucket i counts slices that took under 2^i us. The last also takes 
+// anything longer
+static void _teardown_hist_add(bgh_t *ssns, uint64_t us) {
+    int bucket = 0;
+    while(bucket < BGH_TEARDOWN_HIST - 1 && us >= (1ULL << bucket))
+        bucket++;
+    __atomic_add_fetch(&ssns->teardown_hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Expire whatever is left in a retired table, one slice at a time starting
+// from *row. A slice ends after teardown_rows rows or teardown_slice_us, 
+// whichever comes first, and the scheduler waits teardown_pause_us before 
+// the next. Spreads the free_cb calls and the cache misses from walking the 
+// table out, instead of one long stall that lands on the datapath cores.
+// Rows are emptied on the way. Returns true when the table is done, and has
+// gone back to its owner's pool. If budget is set, the slice walks at most 
+// that many rows, and they're taken off it.
+// Stats go to ssns, the tracker being maintained
+static bool _teardown_slice(bgh_t *ssns, bgh_t *owner, bgh_tbl_t *tbl, 
+        uint64_t *row, uint64_t *budget) {
+    bgh_config_t *config = &ssns->config;
+    uint64_t slice_rows = config->teardown_rows ? 
+        config->teardown_rows : tbl->num_rows;
+    if(budget && *budget < slice_rows)
+        slice_rows = *budget;
+    void *batch[BGH_TEARDOWN_BATCH];
+    uint64_t i = *row;
+    uint64_t start = _now_us();
+    uint64_t end = tbl->num_rows - i < slice_rows ? 
+        tbl->num_rows : i + slice_rows;
+    uint32_t n = 0;
+
+    while(i < end) {
+        if(tbl->ctrl[i] >= 0) {
+            void **data = (void**)((char*)tbl->rows + i * tbl->row_size);
+            batch[n++] = *data;
+            *data = NULL;
+            if(n == BGH_TEARDOWN_BATCH) {
+                _expire_batch(ssns, tbl, batch, n);
+                n = 0;
+            }
         }
 
-        idx++;
+        // Clock checks are spaced out, they cost more than a row
+        if(!(++i & 1023) && config->teardown_slice_us && 
+           _now_us() - start >= config->teardown_slice_us)
+            break;
     }
 
-    return NULL;
+    _expire_batch(ssns, tbl, batch, n);
+    _teardown_hist_add(ssns, _now_us() - start);
+    if(budget)
+        *budget -= i - *row;
+    *row = i;
+
+    if(i < tbl->num_rows)
+        return false;
+
+    memset(tbl->ctrl, BGH_CTRL_EMPTY, tbl->num_rows + BGH_GROUP_WIDTH);
+    _pool_put(owner, tbl);
+    return true;
 }
-bgh_stat_t bgh_insert_table(bgh_tbl_t *tbl, bgh_key_t *key, void *data) {
-    // XXX Handle this case better ...
-    // - should allow overwrites
-    // - use to influence the size of the next hash table
-    if(tbl->inserted > tbl->max_inserts)
-        return BGH_FULL;
 
-    int64_t idx = _lookup_idx(tbl, key);
+// Advance the clock every shard stamps rows with
+static void _clock_update(bgh_t *ssns, uint64_t now_ms) {
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
 
-    if(idx < 0)
-        return BGH_EXCEPTION;
+    uint32_t clock = (now_ms - ssns->start_ms) / ssns->config.tick_ms;
+    for(uint32_t i=0; i<nshards; i++)
+        __atomic_store_n(&shards[i]->clock, clock, __ATOMIC_RELAXED);
+}
+
+static void _wheel_advance(bgh_t *ssns, bgh_t *shard);
 
-    bgh_row_t *row = tbl->rows[idx];
+// _expire_batch, counting the sessions as idle timeouts too if idle is set
+static void _hand_over(bgh_t *ssns, bgh_t *shard, void **batch, uint32_t n,
+        bool idle) {
+    if(idle)
+        __atomic_add_fetch(&ssns->idle_expired, n, __ATOMIC_RELAXED);
+    _expire_batch(ssns, shard->active, batch, n);
+}
 
-    // If there was something there already, free it and overwrite
-    if(row->data)
-        tbl->free_cb(row->data);
+// Hand expired sessions, whose rows are already cleared, to the user once
+// lookups that may have found them are done. Maintenance doesn't wait for 
+// those: the batch is kept with a ticket for its grace period, and handed 
+// over by a later step, see _defer_flush. idle is set for sessions 
+// expired by idle timeouts. Stats go to ssns. Returns false if there was 
+// nowhere to keep them, and the caller has to wait out the grace period 
+// itself. Writers can be in a read-side section waiting for the lock, so 
+// not while holding it
+static bool _defer(bgh_t *ssns, bgh_t *shard, void **batch, uint32_t n, 
+        bool idle) {
+    if(!n)
+        return true;
+
+    bgh_deferred_t *d = (bgh_deferred_t*)malloc(sizeof(bgh_deferred_t));
+    if(!d)
+        return false;
+
+    d->next = NULL;
+    d->ticket = _bgh_retire(shard);
+    d->n = n;
+    d->idle = idle;
+    memcpy(d->data, batch, n * sizeof(void*));
+    if(shard->deferred_tail)
+        shard->deferred_tail->next = d;
     else
-        tbl->inserted++;
+        shard->deferred = d;
+    shard->deferred_tail = d;
+    return true;
+}
 
-    row->deleted = false;
-    memcpy(&row->key, key, sizeof(row->key));
-    row->data = data;
-    return BGH_OK;
+// Hand over the batches whose grace period is over, oldest first. Returns 
+// whether any are left waiting
+static bool _defer_flush(bgh_t *ssns, bgh_t *shard) {
+    bgh_deferred_t *d;
+    while((d = shard->deferred) && _bgh_retired(shard, d->ticket)) {
+        shard->deferred = d->next;
+        if(!shard->deferred)
+            shard->deferred_tail = NULL;
+        _hand_over(ssns, shard, d->data, d->n, d->idle);
+        free(d);
+    }
+    return shard->deferred != NULL;
 }
 
-bgh_stat_t bgh_insert(bgh_t *ssns, bgh_key_t *key, void *data) {
-    // null data is not allowed
-    // data is used to check if a row is used
-    if(!data)
-        return BGH_EXCEPTION;
+// Queue sessions evicted since the last step for the user, behind a grace
+// period like idle expiry. See _evict
+static void _evict_flush(bgh_t *ssns, bgh_t *shard) {
+    void *batch[BGH_TEARDOWN_BATCH];
 
-    pthread_mutex_lock(&ssns->lock);
-    if(ssns->refreshing) {
-        bgh_stat_t retval = bgh_insert_table(ssns->standby, key, data);
-        pthread_mutex_unlock(&ssns->lock);
-        return retval;
+    pthread_mutex_lock(&shard->lock);
+    uint32_t n = shard->evicting_n;
+    memcpy(batch, shard->evicting, n * sizeof(void*));
+    shard->evicting_n = 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    if(!_defer(ssns, shard, batch, n, false)) {
+        _bgh_synchronize(shard);
+        _hand_over(ssns, shard, batch, n, false);
     }
-    pthread_mutex_unlock(&ssns->lock);
-    return bgh_insert_table(ssns->active, key, data);
 }
 
-static inline void _move_tables(
-        bgh_tbl_t *active, bgh_tbl_t *standby, bgh_key_t *key, bgh_row_t *row) {
-    bgh_insert_table(standby, key, row->data);
-    active->inserted--;
-    row->data = NULL;
-    row->deleted = true; // this is necessary to handle the case where there 
-                         // was a previous collision with this row
-}
+// Sample how fast a shard's active table is gaining sessions, for sizing 
+// the next one, see _update_size. Smoothed by halves, one sample a step. 
+// Draining tables are left out: sessions moving would count as new ones
+static void _load_sample(bgh_t *shard, uint64_t now) {
+    bgh_tbl_t *tbl = shard->active;
+    if(shard->refreshing) {
+        shard->load_tbl = NULL;
+        return;
+    }
 
-void *_draining_lookup_active(
-        bgh_tbl_t *active, bgh_tbl_t *standby, bgh_key_t *key) {
-    bgh_row_t *row = _lookup_row(active, key);
-    if(!row || !row->data) {
-        row = _lookup_row(standby, key);
-        if(row) 
-            return row->data;
-        return NULL;
+    uint64_t inserted = __atomic_load_n(&tbl->inserted, __ATOMIC_RELAXED);
+    if(tbl == shard->load_tbl) {
+        if(now <= shard->load_ms)
+            return;
+        double rate = inserted > shard->load_inserted ? 
+            (inserted - shard->load_inserted) * 1000.0 / 
+                (now - shard->load_ms) : 0;
+        shard->load_rate = (shard->load_rate + rate) / 2;
     }
 
-    void *data = row->data;
-    _move_tables(active, standby, key, row);
-    return data;
+    shard->load_tbl = tbl;
+    shard->load_inserted = inserted;
+    shard->load_ms = now;
 }
 
-void *_draining_prefer_standby(
-        bgh_tbl_t *active, bgh_tbl_t *standby, bgh_key_t *key) {
-    bgh_row_t *row = _lookup_row(standby, key);
-    if(row && row->data) {
-        return row->data;
+// Whether any shard's table is past grow_pct, and has room to grow
+static bool _load_due(bgh_t **shards, uint32_t nshards) {
+    for(uint32_t i=0; i<nshards; i++) {
+        bgh_tbl_t *tbl = shards[i]->active;
+        if(tbl->inserted > tbl->num_rows * shards[i]->config.grow_pct/100.0 &&
+           _update_size(shards[i], tbl) > tbl->num_rows)
+            return true;
     }
+    return false;
+}
 
-    row = _lookup_row(active, key);
-    if(!row || !row->data)
-        return NULL;
+// Whether any shard has asked for an early refresh, see BGH_OVERLOAD_REFRESH
+// and _make_room
+static bool _overload_due(bgh_t **shards, uint32_t nshards) {
+    for(uint32_t i=0; i<nshards; i++) {
+        if(__atomic_load_n(&shards[i]->overloaded, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
 
-    void *data = row->data;
-    _move_tables(active, standby, key, row);
-    return data;
+// Wait before retrying a refresh whose tables couldn't be allocated
+#define _MAINT_RETRY_MS 50
+// Lookups are short, so a grace period is polled for often
+#define _MAINT_GRACE_POLL_US 100
+
+static inline uint64_t _min_u64(uint64_t a, uint64_t b) {
+    return a < b ? a : b;
 }
 
-void *bgh_lookup(bgh_t *ssns, bgh_key_t *key) {
-    void *data = NULL;
+// Take a tracker one step through its refresh cycle at time now, and keep 
+// its clock and timer wheels. No step blocks for long: a grace period is 
+// polled for, and a teardown is done a slice per step, bounded by budget if
+// set. Returns the us until the tracker next needs a step, or UINT64_MAX if 
+// it never will
+static uint64_t _maintain(bgh_t *ssns, uint64_t now, uint64_t *budget) {
+    // A sharded tracker refreshes all of its shards together
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
+    bgh_config_t *config = &ssns->config;
+    uint64_t wait_us = UINT64_MAX;
+
+    if(_idle_timeouts(config)) {
+        _clock_update(ssns, now);
+        for(uint32_t i=0; i<nshards; i++)
+            _wheel_advance(ssns, shards[i]);
+        wait_us = (config->tick_ms - (now - ssns->start_ms) % config->tick_ms) 
+            * 1000ULL;
+    }
 
-    pthread_mutex_lock(&ssns->lock);
-    if(ssns->refreshing) {
-        if(ssns->active->inserted > ssns->standby->inserted)
-            data = _draining_lookup_active(ssns->active, ssns->standby, key);
-        else 
-            data = _draining_prefer_standby(ssns->active, ssns->standby, key);
-        pthread_mutex_unlock(&ssns->lock);
+    if(config->overload & BGH_OVERLOAD_EVICT) {
+        for(uint32_t i=0; i<nshards; i++)
+            _evict_flush(ssns, shards[i]);
+    }
 
-        return data;
-    } 
-    pthread_mutex_unlock(&ssns->lock);
-        
-    bgh_row_t *row = _lookup_row(ssns->active, key);
-    if(row)
-        return row->data;
-    return NULL;
+    // Expired sessions go to the user as their grace periods end
+    for(uint32_t i=0; i<nshards; i++) {
+        if(_defer_flush(ssns, shards[i]))
+            wait_us = _min_u64(wait_us, _MAINT_GRACE_POLL_US);
+    }
+
+    // Occupancy is watched every tick
+    if(config->grow_pct > 0) {
+        for(uint32_t i=0; i<nshards; i++)
+            _load_sample(shards[i], now);
+        wait_us = _min_u64(wait_us, config->tick_ms * 1000ULL);
+    }
+
+    switch(ssns->maint) {
+    case BGH_MAINT_IDLE: {
+        if(!config->refresh_period)
+            break;
+
+        // See if we should begin building a new table yet. A shard that's
+        // filling up or overloaded doesn't wait
+        uint64_t due = ssns->last_ms + config->refresh_period * 1000ULL;
+        bool early = now < due;
+        bool load = early && config->grow_pct > 0 && 
+            _load_due(shards, nshards);
+        if(early && !load && !_overload_due(shards, nshards))
+            return _min_u64(wait_us, (due - now) * 1000);
+
+        bool started = false;
+        for(uint32_t i=0; i<nshards; i++) {
+            // A shard whose table couldn't be allocated skips this refresh
+            if(_refresh_begin(shards[i]))
+                started = true;
+        }
+
+        // Retry shortly. Allocation failures are counted in the stats
+        if(!started)
+            return _min_u64(wait_us, _MAINT_RETRY_MS * 1000);
+
+        if(load)
+            __atomic_add_fetch(&ssns->load_refreshes, 1, __ATOMIC_RELAXED);
+        else if(early)
+            __atomic_add_fetch(&ssns->overload_refreshes, 1, __ATOMIC_RELAXED);
+        ssns->maint = BGH_MAINT_DRAINING;
+        ssns->began_ms = now;
+        return _min_u64(wait_us, config->timeout * 1000000ULL);
+    }
+
+    case BGH_MAINT_DRAINING: {
+        // When we're refreshing, all new sessions go into the new table
+        // Lookups are tried on both, if the first lookup fails. When a 
+        // lookup succeeds on the active (and about to be replaced) table, 
+        // the data is removed from that table and inserted in the standby 
+        // table
+        uint64_t due = ssns->began_ms + config->timeout * 1000ULL;
+        if(now < due)
+            return _min_u64(wait_us, (due - now) * 1000);
+
+        // Swap every shard before tearing any down, so no shard's drain
+        // runs long waiting on another's teardown
+        for(uint32_t i=0; i<nshards; i++) {
+            if(shards[i]->refreshing)
+                _refresh_finish(shards[i]);
+        }
+        ssns->maint = BGH_MAINT_GRACE;
+        return 0;
+    }
+
+    case BGH_MAINT_GRACE:
+        for(uint32_t i=0; i<nshards; i++) {
+            if(shards[i]->retired && 
+               !_bgh_retired(shards[i], shards[i]->retired_epoch))
+                return _min_u64(wait_us, _MAINT_GRACE_POLL_US);
+        }
+        ssns->maint = BGH_MAINT_TEARDOWN;
+        ssns->teardown_shard = 0;
+        ssns->teardown_row = 0;
+        return 0;
+
+    case BGH_MAINT_TEARDOWN:
+        while(ssns->teardown_shard < nshards && 
+              !shards[ssns->teardown_shard]->retired)
+            ssns->teardown_shard++;
+
+        if(ssns->teardown_shard < nshards) {
+            bgh_t *shard = shards[ssns->teardown_shard];
+            if(_teardown_slice(ssns, shard, shard->retired, 
+                               &ssns->teardown_row, budget)) {
+                shard->retired = NULL;
+                ssns->teardown_shard++;
+                ssns->teardown_row = 0;
+            }
+            return _min_u64(wait_us, config->teardown_pause_us);
+        }
+
+        for(uint32_t i=0; i<nshards; i++)
+            _pool_prepare(shards[i]);
+
+        ssns->maint = BGH_MAINT_IDLE;
+        ssns->last_ms = ssns->began_ms;
+        return 0;
+    }
+
+    return wait_us;
 }
 
-void bgh_delete_from_table(bgh_tbl_t *table, bgh_key_t *key) {
-    bgh_row_t *row = _lookup_row(table, key);
-    if(!row || !row->data) 
-        return;
+// Finish tearing down any retired tables, for bgh_free. The tracker is no 
+// longer maintained, and nothing else is using it, so no pauses or grace 
+// period
+static void _maintain_finish(bgh_t *ssns) {
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
+
+    for(uint32_t i=0; i<nshards; i++) {
+        if(!shards[i]->retired)
+            continue;
 
-    table->free_cb(row->data);
+        uint64_t row = ssns->maint == BGH_MAINT_TEARDOWN && 
+            i == ssns->teardown_shard ? ssns->teardown_row : 0;
+        while(!_teardown_slice(ssns, shards[i], shards[i]->retired, &row, NULL))
+            ;
+        shards[i]->retired = NULL;
+    }
+}
 
-    table->inserted--;
-    row->data = NULL;
-    row->deleted = true;
+// One thread maintains every tracker in the process, rather than a thread 
+// each. Trackers are kept in a list with the time each is next due, and the
+// thread sleeps on a condition variable until the earliest of those, or 
+// until a tracker is added. It exits when the last tracker is removed
+static struct {
+    pthread_mutex_t lock;
+    // Signalled when a tracker is added, or the thread should exit
+    pthread_cond_t wake;
+    // Signalled after every step
+    pthread_cond_t stepped;
+    bgh_t *trackers;
+    // The tracker whose step is running, without the lock
+    bgh_t *current;
+    bool started;
+    pthread_t thread;
+    // Bumped to tell the thread to exit
+    uint64_t gen;
+} _sched = { PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t _sched_once = PTHREAD_ONCE_INIT;
+
+// Deadlines are CLOCK_MONOTONIC, so the condition variables have to wait 
+// on it too
+static void _sched_init() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_sched.wake, &attr);
+    pthread_cond_init(&_sched.stepped, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
-void bgh_clear(bgh_t *ssns, bgh_key_t *key) {
-    pthread_mutex_lock(&ssns->lock);
-    if(ssns->refreshing) {
-        // XXX Revisit: Not optimal to just do both this way, but this is an edge case
-        bgh_delete_from_table(ssns->active, key);
-        bgh_delete_from_table(ssns->standby, key);
-        pthread_mutex_unlock(&ssns->lock);
-        return;
+static void *_sched_thread(void *ctx) {
+    uint64_t gen = (uint64_t)(uintptr_t)ctx;
+
+    pthread_mutex_lock(&_sched.lock);
+    while(_sched.gen == gen) {
+        bgh_t *next = NULL;
+        for(bgh_t *t = _sched.trackers; t; t = t->sched_next) {
+            if(!next || t->sched_due_us < next->sched_due_us)
+                next = t;
+        }
+
+        if(!next || next->sched_due_us == UINT64_MAX) {
+            pthread_cond_wait(&_sched.wake, &_sched.lock);
+            continue;
+        }
+
+        if(next->sched_due_us > _now_us()) {
+            struct timespec ts;
+            ts.tv_sec = next->sched_due_us / 1000000;
+            ts.tv_nsec = next->sched_due_us % 1000000 * 1000;
+            pthread_cond_timedwait(&_sched.wake, &_sched.lock, &ts);
+            continue;
+        }
+
+        // Rescheduled after the step, unless _sched_wake gets in first
+        _sched.current = next;
+        next->sched_due_us = UINT64_MAX;
+        pthread_mutex_unlock(&_sched.lock);
+
+        uint64_t wait_us = _maintain(next, _now_ms(), NULL);
+
+        pthread_mutex_lock(&_sched.lock);
+        if(next->sched_due_us == UINT64_MAX)
+            next->sched_due_us = wait_us == UINT64_MAX ? 
+                UINT64_MAX : _now_us() + wait_us;
+        _sched.current = NULL;
+        pthread_cond_broadcast(&_sched.stepped);
     }
-    pthread_mutex_unlock(&ssns->lock);
-    bgh_delete_from_table(ssns->active, key);
+    pthread_mutex_unlock(&_sched.lock);
+
+    return NULL;
 }
 
-void bgh_get_stats(bgh_t *ssns, bgh_stats_t *stats) {
-    pthread_mutex_lock(&ssns->lock);
-    stats->in_refresh = ssns->refreshing;
-    stats->num_rows = ssns->active->num_rows;
-    stats->inserted = ssns->active->inserted;
-    stats->collisions = ssns->active->collisions;
-    stats->max_inserts = ssns->active->max_inserts;
-    pthread_mutex_unlock(&ssns->lock);
+static void _sched_add(bgh_t *ssns) {
+    pthread_once(&_sched_once, _sched_init);
+
+    pthread_mutex_lock(&_sched.lock);
+    ssns->sched_due_us = _now_us();
+    ssns->sched_next = _sched.trackers;
+    _sched.trackers = ssns;
+
+    if(!_sched.started && !pthread_create(&_sched.thread, NULL, 
+                _sched_thread, (void*)(uintptr_t)_sched.gen))
+        _sched.started = true;
+
+    pthread_cond_signal(&_sched.wake);
+    pthread_mutex_unlock(&_sched.lock);
 }
 
+// Returns once the tracker is out of the list and no step of its is running
+static void _sched_remove(bgh_t *ssns) {
+    pthread_mutex_lock(&_sched.lock);
+    while(_sched.current == ssns)
+        pthread_cond_wait(&_sched.stepped, &_sched.lock);
+
+    for(bgh_t **t = &_sched.trackers; *t; t = &(*t)->sched_next) {
+        if(*t == ssns) {
+            *t = ssns->sched_next;
+            break;
+        }
+    }
+
+    // Last one out stops the thread. A tracker added meanwhile starts a new
+    // one, and the old thread sees the generation has moved on
+    bool join = !_sched.trackers && _sched.started;
+    pthread_t thread = _sched.thread;
+    if(join) {
+        _sched.gen++;
+        _sched.started = false;
+        pthread_cond_signal(&_sched.wake);
+    }
+    pthread_mutex_unlock(&_sched.lock);
+
+    if(join)
+        pthread_join(thread, NULL);
+}
+
+// Bring a registered tracker's next step forward to now. If a step is 
+// running, there's another straight after
+static void _sched_wake(bgh_t *ssns) {
+    pthread_mutex_lock(&_sched.lock);
+    ssns->sched_due_us = 0;
+    pthread_cond_signal(&_sched.wake);
+    pthread_mutex_unlock(&_sched.lock);
+}
+
+// Set up the tables and reader state of a tracker, without registering it
+// for maintenance
+static bool _bgh_init(
+        bgh_t *table, bgh_config_t *config, void (*free_cb)(void *)) {
+    table->config = *config;
+    if(!table->config.tick_ms)
+        table->config.tick_ms = BGH_DEFAULT_TICK_MS;
+    table->nshards = 0;
+    table->shards = NULL;
+
+    // Values inline in the rows may not need any cleanup
+    if(!free_cb && config->value_size)
+        free_cb = _free_nop;
+
+    table->shm = NULL;
+    if(config->shm_name) {
+        // The region only has so many slots
+        if(table->config.table_pool > 1)
+            table->config.table_pool = 1;
+        table->shm = _shm_create(&table->config);
+        if(!table->shm)
+            return false;
+    }
+
+    memset(table->pool, 0, sizeof(table->pool));
+    table->tables_allocated = table->alloc_failures = 0;
+    table->active = 
+        _tracker_new_tbl(table, config->starting_rows, free_cb);
+
+    if(!table->active) {
+        if(table->shm)
+            _shm_destroy(table->shm);
+        return false;
+    }
+
+    table->standby = NULL;
+
+    table->clock = 0;
+    table->start_ms = _now_ms();
+    table->idle_expired = 0;
+    table->wheel = NULL;
+    if(_idle_timeouts(config)) {
+        table->wheel = (bgh_wheel_t*)calloc(1, sizeof(bgh_wheel_t));
+        if(!table->wheel) {
+            bgh_free_table(table->active);
+            if(table->shm)
+                _shm_destroy(table->shm);
+            return false;
+        }
+    }
+
+    table->overloaded = false;
+    table->evicting = NULL;
+    table->evicting_n = 0;
+    table->deferred = table->deferred_tail = NULL;
+    table->admit_rng = _new_seed() | 1;
+    table->evicted = table->refused = table->overload_refreshes = 0;
+    table->maintainer = table;
+    table->load_tbl = NULL;
+    table->load_inserted = table->load_ms = 0;
+    table->load_rate = 0;
+    table->low_refreshes = 0;
+    table->load_refreshes = 0;
+    if(config->overload & BGH_OVERLOAD_EVICT) {
+        table->evicting = (void**)malloc(BGH_TEARDOWN_BATCH * sizeof(void*));
+        if(!table->evicting) {
+            free(table->wheel);
+            bgh_free_table(table->active);
+            if(table->shm)
+                _shm_destroy(table->shm);
+            return false;
+        }
+    }
+
+    table->epoch = 0;
+    table->expired = 0;
+    memset(table->teardown_hist, 0, sizeof(table->teardown_hist));
+    if(posix_memalign((void**)&table->readers, BGH_CACHE_LINE, 
+                      sizeof(bgh_reader_t) * BGH_READER_SLOTS)) {
+        free(table->evicting);
+        free(table->wheel);
+        bgh_free_table(table->active);
+        if(table->shm)
+            _shm_destroy(table->shm);
+        return false;
+    }
+    memset(table->readers, 0, sizeof(bgh_reader_t) * BGH_READER_SLOTS);
+
+    if(table->shm) {
+        _shm_publish(table);
+        _shm_ready(table->shm);
+    }
+
+    table->running = false;
+    table->refreshing = false;
+    table->maint = BGH_MAINT_IDLE;
+    table->retired = NULL;
+    table->sched_next = NULL;
+    pthread_mutex_init(&table->lock, NULL);
+
+    return true;
+}
+
+static void _wheel_free(bgh_wheel_t *wheel);
+
+static void _bgh_deinit(bgh_t *table) {
+    if(table->shm)
+        table->shm->closing = true;
+    // Evicted sessions still waiting on a grace period. Nothing is looking
+    // anymore
+    if(table->evicting_n)
+        _expire_batch(table, table->active, table->evicting, table->evicting_n);
+    free(table->evicting);
+    while(table->deferred) {
+        bgh_deferred_t *d = table->deferred;
+        table->deferred = d->next;
+        _hand_over(table, table, d->data, d->n, d->idle);
+        free(d);
+    }
+    _wheel_free(table->wheel);
+    _pool_free(table);
+    bgh_free_table(table->active);
+    if(table->standby)
+        bgh_free_table(table->standby);
+    if(table->shm)
+        _shm_destroy(table->shm);
+    pthread_mutex_destroy(&table->lock);
+    free(table->readers);
+}
+
+static void _bgh_start(bgh_t *table) {
+    table->last_ms = _now_ms();
+
+    // Maintenance also keeps the clock and timer wheel for idle timeouts, 
+    // and frees evicted sessions
+    if(!table->config.manual_maintenance && 
+       (table->config.refresh_period > 0 || _idle_timeouts(&table->config) ||
+        table->config.overload & BGH_OVERLOAD_EVICT)) {
+        table->running = true;
+        _sched_add(table);
+    }
+    else
+        table->running = false;
+}
+
+bgh_t *bgh_config_new(bgh_config_t *config, void (*free_cb)(void *)) {
+    // Data pointers would mean nothing to readers in other processes
+    if(config->shm_name && !config->value_size)
+        return NULL;
+
+    bgh_t *table = (bgh_t*)malloc(sizeof(bgh_t));
+    if(!table)
+        return NULL;
+
+    if(!_bgh_init(table, config, free_cb)) {
+        free(table);
+        return NULL;
+    }
+
+    _bgh_start(table);
+    return table;
+}
+
+bgh_t *bgh_sharded_new(
+        uint32_t nshards, bgh_config_t *config, void (*free_cb)(void *)) {
+    if(nshards <= 1)
+        return bgh_config_new(config, free_cb);
+
+    // A region holds the tables of a single tracker
+    if(config->shm_name)
+        return NULL;
+
+    bgh_t *table = (bgh_t*)calloc(1, sizeof(bgh_t));
+    if(!table)
+        return NULL;
+
+    table->config = *config;
+    if(!table->config.tick_ms)
+        table->config.tick_ms = BGH_DEFAULT_TICK_MS;
+    table->seed = _new_seed();
+    table->maintainer = table;
+    table->start_ms = _now_ms();
+    table->shards = (bgh_t**)calloc(nshards, sizeof(bgh_t*));
+    if(!table->shards) {
+        free(table);
+        return NULL;
+    }
+
+    // Row counts in the config are for the tracker as a whole
+    bgh_config_t shard_conf = *config;
+    shard_conf.starting_rows = config->starting_rows / nshards;
+    shard_conf.min_rows = config->min_rows / nshards;
+    shard_conf.max_rows = config->max_rows / nshards;
+    if(!shard_conf.starting_rows)
+        shard_conf.starting_rows = 1;
+    if(!shard_conf.max_rows)
+        shard_conf.max_rows = 1;
+
+    for(; table->nshards < nshards; table->nshards++) {
+        bgh_t *shard;
+        // Shards get their own cache lines so writers on different shards
+        // don't false-share locks or table pointers
+        if(posix_memalign((void**)&shard, BGH_CACHE_LINE, sizeof(bgh_t)))
+            break;
+        if(!_bgh_init(shard, &shard_conf, free_cb)) {
+            free(shard);
+            break;
+        }
+        shard->maintainer = table;
+        table->shards[table->nshards] = shard;
+    }
+
+    if(table->nshards < nshards) {
+        for(uint32_t i=0; i<table->nshards; i++) {
+            _bgh_deinit(table->shards[i]);
+            free(table->shards[i]);
+        }
+        free(table->shards);
+        free(table);
+        return NULL;
+    }
+
+    _bgh_start(table);
+    return table;
+}
+
+void bgh_free(bgh_t *ssns) {
+    if(!ssns) return;
+
+    if(ssns->running) {
+        _sched_remove(ssns);
+        ssns->running = false;
+    }
+    _maintain_finish(ssns);
+
+    if(ssns->shards) {
+        for(uint32_t i=0; i<ssns->nshards; i++) {
+            _bgh_deinit(ssns->shards[i]);
+            free(ssns->shards[i]);
+        }
+        free(ssns->shards);
+    }
+    else 
+        _bgh_deinit(ssns);
+
+    free(ssns);
+}
+
+// Everything on the lookup and insert paths takes the key type as an 
+// argument and is forced inline, with the public functions passing a 
+// constant. The compiler builds a separate copy of each path for each key 
+// type, so v4 keeps its 32 byte rows and key compare with no runtime checks
+#define _BGH_INLINE static inline __attribute__((always_inline))
+
+_BGH_INLINE size_t _key_size(int kt) {
+    return kt == BGH_KEY_V6 ? sizeof(bgh_key6_t) : sizeof(bgh_key_t);
+}
+
+// This thread's datapath counters for a tracker, or shard
+_BGH_INLINE bgh_counters_t *_counters(bgh_t *ssns) {
+    return &ssns->readers[_reader_slot()].counters;
+}
+
+// Only the slot's own thread writes its counters, unless slots are shared,
+// so a plain add will do rather than a locked one
+_BGH_INLINE void _count(uint64_t *ctr, uint64_t n) {
+    __atomic_store_n(ctr, 
+        __atomic_load_n(ctr, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+_BGH_INLINE void _count_insert(bgh_counters_t *c, bgh_stat_t stat) {
+    if(stat == BGH_OK)
+        _count(&c->inserts, 1);
+    else if(stat == BGH_FULL)
+        _count(&c->full, 1);
+}
+
+// Clears the padding byte, last in a key, in the word holding it
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define _KEY_PAD_MASK 0x00FFFFFFU
+#else
+#define _KEY_PAD_MASK 0xFFFFFF00U
+#endif
+
+// Keys are stored and compared in one canonical form: endpoints in a fixed
+// order, padding zeroed. Every key is put in that form once on its way in, 
+// so either direction of a session is the same bytes, and comparing two 
+// keys is a plain equality test. Endpoints are ordered as whole words, 
+// address and port together, which takes a compare and a pair of 
+// conditional moves. Builds the canonical form of key in out, and returns
+// whether the endpoints were swapped
+_BGH_INLINE int _key4_canon(bgh_key_t *out, const bgh_key_t *key) {
+    uint64_t w[2];
+    memcpy(w, key, sizeof(w));
+    int swap = w[0] > w[1];
+
+    // VLAN, protocol and padding go in as one word. Lookups read them back
+    // that way right after, and byte stores would keep the loads waiting
+    uint32_t rest;
+    memcpy(&rest, (const char*)key + sizeof(w), sizeof(rest));
+    rest &= _KEY_PAD_MASK;
+
+    uint64_t lo = swap ? w[1] : w[0],
+             hi = swap ? w[0] : w[1];
+    memcpy(out, &lo, sizeof(lo));
+    memcpy((char*)out + sizeof(lo), &hi, sizeof(hi));
+    memcpy((char*)out + sizeof(w), &rest, sizeof(rest));
+    return swap;
+}
+
+// Ordered by address, then port
+_BGH_INLINE int _key6_canon(bgh_key6_t *out, const bgh_key6_t *key) {
+    uint64_t s[2], d[2];
+    memcpy(s, key->sip, sizeof(s));
+    memcpy(d, key->dip, sizeof(d));
+    int swap = s[0] != d[0] ? s[0] > d[0] : 
+               s[1] != d[1] ? s[1] > d[1] : key->sport > key->dport;
+
+    // Ports, VLAN, protocol and padding as one word. Swapping the two 16 bit
+    // ports is a rotate, in either byte order
+    uint32_t ports, rest;
+    memcpy(&ports, &key->sport, sizeof(ports));
+    memcpy(&rest, &key->vlan, sizeof(rest));
+    if(swap)
+        ports = ports << 16 | ports >> 16;
+    rest &= _KEY_PAD_MASK;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t tail = ports | (uint64_t)rest << 32;
+#else
+    uint64_t tail = (uint64_t)ports << 32 | rest;
+#endif
+
+    memcpy(out->sip, swap ? d : s, sizeof(s));
+    memcpy(out->dip, swap ? s : d, sizeof(d));
+    memcpy(&out->sport, &tail, sizeof(tail));
+    return swap;
+}
+
+// Room for a key of either type
+typedef union {
+    bgh_key_t v4;
+    bgh_key6_t v6;
+} _key_buf_t;
+
+// The canonical form of key, in buf
+_BGH_INLINE const void *_canon(_key_buf_t *buf, const void *key, int kt) {
+    if(kt == BGH_KEY_V6)
+        _key6_canon(&buf->v6, (const bgh_key6_t*)key);
+    else
+        _key4_canon(&buf->v4, (const bgh_key_t*)key);
+    return buf;
+}
+
+int bgh_key_normalize(bgh_key_t *key) {
+    bgh_key_t canon;
+    int swapped = _key4_canon(&canon, key);
+    *key = canon;
+    return swapped;
+}
+
+int bgh_key6_normalize(bgh_key6_t *key) {
+    bgh_key6_t canon;
+    int swapped = _key6_canon(&canon, key);
+    *key = canon;
+    return swapped;
+}
+
+// Canonical keys compare as whole words: the endpoints in one 16 byte 
+// compare, then VLAN, protocol and padding in one 4 byte compare
+typedef char _bgh_key_size_check[sizeof(bgh_key_t) == 20 ? 1 : -1];
+typedef char _bgh_key6_size_check[sizeof(bgh_key6_t) == 40 ? 1 : -1];
+
+static inline int key_eq(const bgh_key_t *k1, const bgh_key_t *k2) {
+    uint64_t a[2], b[2];
+    uint32_t at, bt;
+    memcpy(a, k1, sizeof(a));
+    memcpy(b, k2, sizeof(b));
+    memcpy(&at, (const char*)k1 + sizeof(a), sizeof(at));
+    memcpy(&bt, (const char*)k2 + sizeof(b), sizeof(bt));
+    return !((a[0] ^ b[0]) | (a[1] ^ b[1]) | (at ^ bt));
+}
+
+static inline int key6_eq(const bgh_key6_t *k1, const bgh_key6_t *k2) {
+    uint64_t a[5], b[5];
+    memcpy(a, k1, sizeof(a));
+    memcpy(b, k2, sizeof(b));
+    return !((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | 
+             (a[3] ^ b[3]) | (a[4] ^ b[4]));
+}
+
+_BGH_INLINE int _key_eq(const void *k1, const void *k2, int kt) {
+    if(kt == BGH_KEY_V6)
+        return key6_eq((const bgh_key6_t*)k1, (const bgh_key6_t*)k2);
+    return key_eq((const bgh_key_t*)k1, (const bgh_key_t*)k2);
+}
+
+// Fold the 128 bit product of a and b into 64 bits. Every output bit 
+// depends on every input bit
+static inline uint64_t _hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Seeded multiply-xorshift over a canonical key's two endpoints, each 
+// (address and port) packed into one word. Keys are already in order, so 
+// the hash needn't be symmetric and the endpoints are mixed in as they 
+// are. Both the low bits (row index) and the high bits (tag, shard) are 
+// well distributed
+// Previously: XOR32, see https://www.researchgate.net/publication/281571413_COMPARISON_OF_HASH_STRATEGIES_FOR_FLOW-BASED_LOAD_BALANCING
+// which collapsed on port scans and ignored the VLAN when it was 0
+_BGH_INLINE uint64_t _canon4_hash(uint64_t seed, const bgh_key_t *key) {
+    uint64_t w[2];
+    uint32_t rest;
+    memcpy(w, key, sizeof(w));
+    memcpy(&rest, (const char*)key + sizeof(w), sizeof(rest));
+
+    uint64_t h = _hash_mix(w[0] ^ seed, w[1] ^ 0xE7037ED1A0B428DBULL);
+    return _hash_mix(h ^ rest, seed ^ 0x8EBC6AF09C88C6E3ULL);
+}
+
+_BGH_INLINE uint64_t _canon6_hash(uint64_t seed, const bgh_key6_t *key) {
+    uint64_t s[2], d[2], rest;
+    memcpy(s, key->sip, sizeof(s));
+    memcpy(d, key->dip, sizeof(d));
+    memcpy(&rest, &key->sport, sizeof(rest));
+
+    uint64_t h = _hash_mix(s[0] ^ seed, s[1] ^ 0xE7037ED1A0B428DBULL);
+    h = _hash_mix(h ^ d[0], d[1] ^ 0xA0761D6478BD642FULL);
+    return _hash_mix(h ^ rest, seed ^ 0x8EBC6AF09C88C6E3ULL);
+}
+
+// Hashes of keys in either direction, as the tables see them
+uint64_t _key_hash(uint64_t seed, bgh_key_t *key) {
+    bgh_key_t canon;
+    _key4_canon(&canon, key);
+    return _canon4_hash(seed, &canon);
+}
+
+uint64_t _key6_hash(uint64_t seed, bgh_key6_t *key) {
+    bgh_key6_t canon;
+    _key6_canon(&canon, key);
+    return _canon6_hash(seed, &canon);
+}
+
+// Keys are canonical from here on
+_BGH_INLINE uint64_t _hash(uint64_t seed, const void *key, int kt) {
+    if(kt == BGH_KEY_V6)
+        return _canon6_hash(seed, (const bgh_key6_t*)key);
+    return _canon4_hash(seed, (const bgh_key_t*)key);
+}
+
+// Sharded trackers have their own seed, independent of any table's, and use
+// the top bits so shard choice doesn't correlate with the row index
+_BGH_INLINE uint32_t _shard_idx(bgh_t *ssns, const void *key, int kt) {
+    uint64_t h = _hash(ssns->seed, key, kt);
+    return ((h >> 32) * ssns->nshards) >> 32;
+}
+
+_BGH_INLINE bgh_t *_shard_for(bgh_t *ssns, const void *key, int kt) {
+    return ssns->shards[_shard_idx(ssns, key, kt)];
+}
+
+static inline uint64_t _wrap(bgh_tbl_t *table, uint64_t idx) {
+    return idx & (table->num_rows - 1);
+}
+
+// The row a probe for hash h starts from
+static inline uint64_t _home(bgh_tbl_t *table, uint64_t h) {
+    return _wrap(table, h);
+}
+
+// 7 bit control byte tag, from the top bits. The row index uses the bottom
+static inline int8_t _tag(uint64_t h) {
+    return (int8_t)(h >> 57);
+}
+
+// Rows of either type are the data pointer followed by the key
+_BGH_INLINE void *_row_at(bgh_tbl_t *table, uint64_t idx, int kt) {
+    return (char*)table->rows + idx * table->row_size;
+}
+
+static inline void *_row_key(void *row) {
+    return (char*)row + sizeof(void*);
+}
+
+// Row data is read without holding the writer lock. Writers fill in the key
+// before publishing data, so a reader that sees data also sees its key
+static inline void *_row_data(void *row) {
+    return __atomic_load_n((void**)row, __ATOMIC_ACQUIRE);
+}
+
+static inline void _row_set_data(void *row, void *data) {
+    __atomic_store_n((void**)row, data, __ATOMIC_RELEASE);
+}
+
+// A row's inline value, for tables with a value_size
+_BGH_INLINE void *_row_value(void *row, int kt) {
+    return (char*)row + 
+        (kt == BGH_KEY_V6 ? sizeof(bgh_row6_t) : sizeof(bgh_row_t));
+}
+
+// Last seen tick, class, and referenced bit, see bgh_row_t
+_BGH_INLINE uint32_t *_row_seen(void *row, int kt) {
+    if(kt == BGH_KEY_V6)
+        return &((bgh_row6_t*)row)->seen;
+    return &((bgh_row_t*)row)->seen;
+}
+
+#define _SEEN_TICK_MASK 0xFFFFFF
+// Set by lookups, cleared by the eviction hand, see _evict
+#define _SEEN_REF 0x80000000u
+
+static inline uint32_t _seen(uint32_t clock, uint8_t cls) {
+    return (clock & _SEEN_TICK_MASK) | (uint32_t)cls << 24;
+}
+
+static inline uint8_t _seen_class(uint32_t seen) {
+    return (seen >> 24) & 0x7F;
+}
+
+// Ticks since seen was stamped. Ticks are stored mod 2^24, so idle timeouts
+// have to be shorter than that many ticks
+static inline uint32_t _seen_age(uint32_t seen, uint32_t clock) {
+    // Rows can be stamped with a clock just ahead of the wheel's
+    uint32_t age = (clock - seen) & _SEEN_TICK_MASK;
+    return age > _SEEN_TICK_MASK / 2 ? 0 : age;
+}
+
+// Readers stamp rows they find, and mark them referenced, without the lock.
+// Skip the write if it's already current, which is most lookups. A writer 
+// changing the class at the same time wins
+_BGH_INLINE void _touch(void *row, int kt, uint32_t clock) {
+    uint32_t *seen = _row_seen(row, kt);
+    uint32_t old = __atomic_load_n(seen, __ATOMIC_RELAXED);
+    uint32_t mask = _SEEN_TICK_MASK | _SEEN_REF;
+    uint32_t stamp = (clock & _SEEN_TICK_MASK) | _SEEN_REF;
+    if(((old ^ stamp) & mask) == 0)
+        return;
+    __atomic_compare_exchange_n(seen, &old, (old & ~mask) | stamp, 
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// The control bytes are followed by a copy of the first BGH_GROUP_WIDTH, so 
+// a group can be loaded starting at any row without wrapping. Every change
+// bumps the table's version, after the control bytes, see _find_or_insert
+static inline void _set_ctrl(bgh_tbl_t *table, uint64_t idx, int8_t ctrl) {
+    __atomic_store_n(&table->ctrl[idx], ctrl, __ATOMIC_RELEASE);
+    for(uint64_t i=idx; i<BGH_GROUP_WIDTH; i+=table->num_rows)
+        __atomic_store_n(&table->ctrl[table->num_rows + i], ctrl, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->version, table->version + 1, __ATOMIC_RELEASE);
+}
+
+// Marks a row as drained or deleted. Deleted rows don't end a probe, so keys
+// that collided with this one are still reachable. 
+// A probe only moves past a group with no empty rows. If every group this 
+// row could be part of has an empty row, no probe has ever gone past it and
+// it can go straight back to empty instead of leaving a tombstone
+_BGH_INLINE void _row_clear(bgh_tbl_t *table, void *row, int kt) {
+    uint64_t idx = ((char*)row - (char*)table->rows) >> 
+        __builtin_ctz(table->row_size);
+    uint64_t before = _wrap(table, idx - BGH_GROUP_WIDTH);
+
+    uint32_t empty_before = group_match_empty(&table->ctrl[before]);
+    uint32_t empty_after = group_match_empty(&table->ctrl[idx]);
+
+    // Full rows immediately before and from idx on
+    int full_before = empty_before ? 
+        BGH_GROUP_WIDTH - 1 - (31 - __builtin_clz(empty_before)) : BGH_GROUP_WIDTH;
+    int full_after = empty_after ? __builtin_ctz(empty_after) : BGH_GROUP_WIDTH;
+
+    if(full_before + full_after < BGH_GROUP_WIDTH)
+        _set_ctrl(table, idx, BGH_CTRL_EMPTY);
+    else {
+        _set_ctrl(table, idx, BGH_CTRL_DELETED);
+        table->tombstones++;
+    }
+
+    _row_set_data(row, NULL);
+}
+
+// Group probing. Each step compares a group of control bytes against the 
+// key's tag, so only rows with a matching tag get a full key compare, and 
+// deleted rows cost nothing. A probe ends after the first group containing 
+// an empty row, or after max_probe rows. Inserts never place a key further 
+// than that into its probe, so however many keys share a home row, lookups
+// stay bounded
+//
+// Each step skips one group further than the last, so keys with nearby 
+// home rows soon go separate ways instead of piling up into long runs. That
+// keeps probes short with tables most of the way full. The offsets are 
+// triangular numbers of groups, which reach every row of a power of two 
+// table
+//
+// Lookups run concurrently with a writer. Writers publish the key and data
+// before the tag (see _insert_table_at), and the fence orders our reads of
+// the rows after the group load
+//
+// If c is set, the probe is counted in its probe length histogram
+_BGH_INLINE void _count_probe(bgh_counters_t *c, uint64_t groups) {
+    if(c)
+        _count(&c->probe_hist[
+            groups < BGH_PROBE_HIST ? groups : BGH_PROBE_HIST - 1], 1);
+}
+
+_BGH_INLINE int64_t _find_at(bgh_tbl_t *table, 
+        const void *key, uint64_t h, bgh_counters_t *c, int kt) {
+    int8_t tag = _tag(h);
+    uint64_t idx = _home(table, h);
+
+    // In a lightly loaded table most keys sit in their home row. Rows not in
+    // use have no data, so check it before touching the control bytes
+    void *row = _row_at(table, idx, kt);
+    if(_row_data(row) && _key_eq(key, _row_key(row), kt)) {
+        _count_probe(c, 0);
+        return idx;
+    }
+
+    uint64_t groups = 0;
+    for(uint64_t probed=0; probed<table->max_probe; probed+=BGH_GROUP_WIDTH) {
+        const int8_t *group = &table->ctrl[idx];
+        uint32_t empty = group_match_empty(group);
+        uint32_t match = group_match(group, tag);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        groups++;
+
+        while(match) {
+            uint64_t i = _wrap(table, idx + __builtin_ctz(match));
+            if(_key_eq(key, _row_key(_row_at(table, i, kt)), kt)) {
+                _count_probe(c, groups);
+                return i;
+            }
+            match &= match - 1;
+        }
+
+        if(empty)
+            break;
+
+        idx = _wrap(table, idx + probed + BGH_GROUP_WIDTH);
+    }
+
+    _count_probe(c, groups);
+    return -1;
+}
+
+// Like _find_at, but when the key isn't there returns the row it should be
+// inserted into instead: the first deleted or empty row in its probe 
+// sequence. Deleted rows get reused, which keeps tombstones from piling up
+// under churn. Returns -1 if there is no room within max_probe rows. 
+// Safe without the lock too, but then the row is only good for an insert 
+// if the table's version hasn't changed by the time the lock is taken
+_BGH_INLINE int64_t _find_slot_at(bgh_tbl_t *table, const void *key, 
+        uint64_t h, bool *found, bgh_counters_t *c, int kt) {
+    int8_t tag = _tag(h);
+    uint64_t idx = _home(table, h);
+    int64_t slot = -1;
+
+    *found = true;
+
+    void *row = _row_at(table, idx, kt);
+    if(_row_data(row) && _key_eq(key, _row_key(row), kt)) {
+        _count_probe(c, 0);
+        return idx;
+    }
+
+    *found = false;
+
+    uint64_t groups = 0;
+    for(uint64_t probed=0; probed<table->max_probe; probed+=BGH_GROUP_WIDTH) {
+        const int8_t *group = &table->ctrl[idx];
+        uint32_t empty = group_match_empty(group);
+        uint32_t match = group_match(group, tag);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        groups++;
+
+        while(match) {
+            uint64_t i = _wrap(table, idx + __builtin_ctz(match));
+            if(_key_eq(key, _row_key(_row_at(table, i, kt)), kt)) {
+                _count_probe(c, groups);
+                *found = true;
+                return i;
+            }
+            match &= match - 1;
+        }
+
+        if(slot < 0) {
+            uint32_t avail = group_match_empty_or_deleted(group);
+            if(avail)
+                slot = _wrap(table, idx + __builtin_ctz(avail));
+        }
+
+        if(empty)
+            break;
+
+        idx = _wrap(table, idx + probed + BGH_GROUP_WIDTH);
+    }
+
+    _count_probe(c, groups);
+    return slot;
+}
+
+// Returns the row holding key, or the row it would be inserted into
+int64_t _lookup_idx(bgh_tbl_t *table, bgh_key_t *key) {
+    bgh_key_t canon;
+    bool found;
+    _key4_canon(&canon, key);
+    return _find_slot_at(table, &canon, 
+        _canon4_hash(table->seed, &canon), &found, NULL, BGH_KEY_V4);
+}
+
+_BGH_INLINE void *_lookup_row_at(bgh_tbl_t *table, 
+        const void *key, uint64_t h, bgh_counters_t *c, int kt) {
+    int64_t idx = _find_at(table, key, h, c, kt);
+    return idx < 0 ? NULL : _row_at(table, idx, kt);
+}
+
+// Returns the row holding key, or NULL
+_BGH_INLINE void *_lookup_row(bgh_tbl_t *table, const void *key, int kt) {
+    return _lookup_row_at(table, key, _hash(table->seed, key, kt), NULL, kt);
+}
+
+// Puts a new session in row idx of tbl, an empty or deleted row found by 
+// _find_slot_at. data is the session's data, or for inline values what to 
+// copy in, NULL for a zeroed value. If create_cb is set, it makes the data
+// instead, see bgh_find_or_insert, and may return NULL to leave the row 
+// unused. Returns the data as stored: for inline values, the row's copy
+_BGH_INLINE void *_place_at(bgh_tbl_t *tbl, int64_t idx, const void *key, 
+        void *data, uint64_t h, uint32_t seen, 
+        void *(*create_cb)(void *, void *), void *ctx, int kt) {
+    void *row = _row_at(tbl, idx, kt);
+
+    // The row isn't published yet, so the value can be built in place
+    if(tbl->value_size) {
+        void *value = _row_value(row, kt);
+        if(data)
+            memcpy(value, data, tbl->value_size);
+        else
+            memset(value, 0, tbl->value_size);
+        if(create_cb && !create_cb(value, ctx))
+            return NULL;
+        data = value;
+    }
+    else if(create_cb && !(data = create_cb(NULL, ctx)))
+        return NULL;
+
+    if(tbl->ctrl[idx] == BGH_CTRL_DELETED)
+        tbl->tombstones--;
+
+    uint64_t dist = _wrap(tbl, idx - _home(tbl, h));
+    tbl->collisions += dist;
+
+    // Key and data go in before the tag is published. See _find_at
+    memcpy(_row_key(row), key, _key_size(kt));
+    *_row_seen(row, kt) = seen;
+    _row_set_data(row, data);
+    _set_ctrl(tbl, idx, _tag(h));
+
+    tbl->inserted++;
+    return data;
+}
+
+// Overload policies, see bgh_overload_t. All called with the lock held, by
+// writers putting a new session in tbl, the table ssns takes them in
+
+// Ask maintenance for a refresh now, once per refresh
+static void _overload_refresh(bgh_t *ssns) {
+    if(ssns->overloaded || !ssns->config.refresh_period)
+        return;
+
+    __atomic_store_n(&ssns->overloaded, true, __ATOMIC_RELAXED);
+    if(ssns->maintainer->running)
+        _sched_wake(ssns->maintainer);
+}
+
+// Past the soft limit, a new session's chance of getting in falls with the 
+// room left, to 1 in 16 at the limit, so with BGH_OVERLOAD_EVICT new 
+// sessions still trickle in. xorshift64
+static bool _admit(bgh_t *ssns, bgh_tbl_t *tbl) {
+    uint64_t x = ssns->admit_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ssns->admit_rng = x;
+
+    if(!(x >> 60))
+        return true;
+
+    uint64_t limit = tbl->max_inserts + 1;
+    if(tbl->inserted >= limit)
+        return false;
+    return x % (limit - tbl->soft_inserts) < limit - tbl->inserted;
+}
+
+// Rows the hand covers looking for a session to evict before giving up
+#define _EVICT_SCAN 1024
+
+// Make room by evicting the first session the hand finds unreferenced, 
+// clearing the referenced bit on those it passes. If they've all been 
+// looked up lately, established sessions stay and the new one is refused. 
+// Lookups may still be using an evicted session's data, so pointers wait 
+// in evicting for maintenance to free after a grace period, and eviction 
+// stops while that's full. Inline values are released right away: their row
+// can be reused as soon as it's cleared in any case
+static bool _evict(bgh_t *ssns, bgh_tbl_t *tbl, int kt) {
+    if(!tbl->value_size && ssns->evicting_n == BGH_TEARDOWN_BATCH)
+        return false;
+
+    for(int i=0; i<_EVICT_SCAN; i++) {
+        uint64_t idx = tbl->hand++ & (tbl->num_rows - 1);
+        if(tbl->ctrl[idx] < 0)
+            continue;
+
+        void *row = _row_at(tbl, idx, kt);
+        uint32_t *seen = _row_seen(row, kt);
+        if(__atomic_load_n(seen, __ATOMIC_RELAXED) & _SEEN_REF) {
+            __atomic_and_fetch(seen, ~_SEEN_REF, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        void *data = _row_data(row);
+        tbl->inserted--;
+        _row_clear(tbl, row, kt);
+        __atomic_add_fetch(&ssns->evicted, 1, __ATOMIC_RELAXED);
+
+        if(tbl->value_size)
+            _expire_batch(ssns->maintainer, tbl, &data, 1);
+        else {
+            ssns->evicting[ssns->evicting_n++] = data;
+            if(ssns->evicting_n == 1 && ssns->maintainer->running)
+                _sched_wake(ssns->maintainer);
+        }
+        return true;
+    }
+    return false;
+}
+
+// tbl is past its soft limit. Returns whether a new session gets in. May 
+// evict a session, changing tbl's version
+static bool _overload(bgh_t *ssns, bgh_tbl_t *tbl, int kt) {
+    uint32_t policy = ssns->config.overload;
+
+    if(policy & BGH_OVERLOAD_REFRESH)
+        _overload_refresh(ssns);
+
+    if(policy & BGH_OVERLOAD_ADMIT && !_admit(ssns, tbl)) {
+        __atomic_add_fetch(&ssns->refused, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if(tbl->inserted <= tbl->max_inserts)
+        return true;
+    return (policy & BGH_OVERLOAD_EVICT) && _evict(ssns, tbl, kt);
+}
+
+// Whether a new session found no room at idx gets in after all. Past the 
+// soft limit the overload policy decides, and if it evicted a session to 
+// make room, the row has to be found again. ssns may be NULL for a bare 
+// table, which only has its limits, and isn't refreshed
+_BGH_INLINE bool _make_room(bgh_t *ssns, bgh_tbl_t *tbl, const void *key, 
+        uint64_t h, int64_t *idx, int kt) {
+    if(tbl->inserted >= tbl->soft_inserts) {
+        uint64_t version = tbl->version;
+        if(!(ssns ? _overload(ssns, tbl, kt) : 
+                    tbl->inserted <= tbl->max_inserts))
+            return false;
+
+        if(tbl->version != version) {
+            bool found;
+            *idx = _find_slot_at(tbl, key, h, &found, NULL, kt);
+        }
+    }
+
+    // Every row within reach is taken. Most likely a flood of keys crafted
+    // to collide, so drop the insert instead of probing further. A refresh
+    // brings a new seed
+    if(*idx < 0) {
+        tbl->probe_limit_hits++;
+        if(ssns && ssns->config.overload & BGH_OVERLOAD_REFRESH)
+            _overload_refresh(ssns);
+        return false;
+    }
+
+    // Deleted rows don't end a probe any more than sessions do. Once they 
+    // take a table halfway from its limit to entirely full, misses run long,
+    // so have a refresh clear them out rather than wait for refresh_period
+    if(ssns && tbl->ctrl[*idx] == BGH_CTRL_EMPTY && 
+            tbl->inserted + tbl->tombstones > 
+                (tbl->max_inserts + tbl->num_rows) / 2)
+        _overload_refresh(ssns);
+    return true;
+}
+
+// seen is the row's timestamp and class for a new session. If created isn't
+// NULL, it's set to whether one was created, rather than overwritten. 
+// Sessions already in the table are overwritten even if it's full. New ones
+// are subject to ssns's overload policy, see _make_room
+_BGH_INLINE bgh_stat_t _insert_table_at(bgh_t *ssns, bgh_tbl_t *tbl, 
+        const void *key, void *data, uint64_t h, uint32_t seen, 
+        bool *created, int kt) {
+    bool found;
+    int64_t idx = _find_slot_at(tbl, key, h, &found, NULL, kt);
+
+    if(found) {
+        // If there was something there already, free it and overwrite. 
+        // Inline values are overwritten in place, or kept if data is NULL
+        void *row = _row_at(tbl, idx, kt);
+        void *old = _row_data(row);
+        if(tbl->value_size) {
+            if(data && data != old) {
+                tbl->free_cb(old);
+                memcpy(old, data, tbl->value_size);
+            }
+        }
+        else {
+            _row_set_data(row, data);
+            tbl->free_cb(old);
+        }
+        _touch(row, kt, seen);
+        if(created)
+            *created = false;
+        return BGH_OK;
+    }
+
+    if(!_make_room(ssns, tbl, key, h, &idx, kt))
+        return BGH_FULL;
+
+    _place_at(tbl, idx, key, data, h, seen, NULL, NULL, kt);
+    if(created)
+        *created = true;
+    return BGH_OK;
+}
+
+_BGH_INLINE bgh_stat_t _insert_table(bgh_t *ssns, bgh_tbl_t *tbl, 
+        const void *key, void *data, uint32_t seen, bool *created, int kt) {
+    return _insert_table_at(ssns, tbl, key, data, 
+        _hash(tbl->seed, key, kt), seen, created, kt);
+}
+
+bgh_stat_t bgh_insert_table(bgh_tbl_t *tbl, bgh_key_t *key, void *data) {
+    bgh_key_t canon;
+    _key4_canon(&canon, key);
+    return _insert_table(NULL, tbl, &canon, data, 0, NULL, BGH_KEY_V4);
+}
+
+static void _wheel_add(bgh_wheel_t *wheel, 
+        const void *key, size_t key_size, uint32_t deadline);
+
+// Idle timeout for a class, in ticks, rounded up
+static inline uint32_t _timeout_ticks(bgh_config_t *config, uint8_t cls) {
+    return (config->class_timeout_ms[cls] + config->tick_ms - 1) / config->tick_ms;
+}
+
+// A new session gets a timer, if its class has an idle timeout. Called 
+// with the lock held
+_BGH_INLINE void _schedule_new(bgh_t *ssns, const void *key, uint8_t cls, 
+        int kt) {
+    uint32_t ticks = _timeout_ticks(&ssns->config, cls);
+    if(ssns->wheel && ticks)
+        _wheel_add(ssns->wheel, key, _key_size(kt), 
+            __atomic_load_n(&ssns->clock, __ATOMIC_RELAXED) + ticks);
+}
+
+_BGH_INLINE bgh_stat_t _insert(
+        bgh_t *ssns, const void *key, void *data, int kt) {
+    // null data is not allowed
+    // data is used to check if a row is used
+    if(!data || ssns->config.key_type != kt)
+        return BGH_EXCEPTION;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    if(ssns->nshards)
+        ssns = _shard_for(ssns, key, kt);
+
+    bool created;
+    pthread_mutex_lock(&ssns->lock);
+    bgh_stat_t retval = _insert_table(ssns, 
+        ssns->refreshing ? ssns->standby : ssns->active, key, data, 
+        _seen(__atomic_load_n(&ssns->clock, __ATOMIC_RELAXED), 0), 
+        &created, kt);
+    if(retval == BGH_OK && created)
+        _schedule_new(ssns, key, 0, kt);
+    pthread_mutex_unlock(&ssns->lock);
+
+    _count_insert(_counters(ssns), retval);
+    return retval;
+}
+
+bgh_stat_t bgh_insert(bgh_t *ssns, bgh_key_t *key, void *data) {
+    return _insert(ssns, key, data, BGH_KEY_V4);
+}
+
+bgh_stat_t bgh_insert6(bgh_t *ssns, bgh_key6_t *key, void *data) {
+    return _insert(ssns, key, data, BGH_KEY_V6);
+}
+
+// Returns whether the session moved
+_BGH_INLINE bool _move_tables(bgh_tbl_t *active, bgh_tbl_t *standby, 
+        const void *key, void *row, int kt) {
+    // Copy into the standby table before clearing the active row, so a 
+    // lockless reader always finds the data in at least one of them. If the
+    // standby table has no room, it stays where it is
+    if(_insert_table(NULL, standby, key, _row_data(row), 
+                     *_row_seen(row, kt), NULL, kt) != BGH_OK)
+        return false;
+    active->inserted--;
+    _row_clear(active, row, kt);
+    return true;
+}
+
+// If moved is set, it's set to whether the session moved
+_BGH_INLINE void *_draining_lookup_active_kt(bgh_tbl_t *active, 
+        bgh_tbl_t *standby, const void *key, bool *moved, int kt) {
+    void *row = _lookup_row(active, key, kt);
+    if(!row || !_row_data(row)) {
+        row = _lookup_row(standby, key, kt);
+        if(row) 
+            return _row_data(row);
+        return NULL;
+    }
+
+    void *data = _row_data(row);
+    bool m = _move_tables(active, standby, key, row, kt);
+    // An inline value moved with its row
+    if(m && standby->value_size)
+        data = _row_data(_lookup_row(standby, key, kt));
+    if(moved)
+        *moved = m;
+    return data;
+}
+
+void *_draining_lookup_active(
+        bgh_tbl_t *active, bgh_tbl_t *standby, bgh_key_t *key) {
+    bgh_key_t canon;
+    _key4_canon(&canon, key);
+    return _draining_lookup_active_kt(
+        active, standby, &canon, NULL, BGH_KEY_V4);
+}
+
+void *_draining_prefer_standby(
+        bgh_tbl_t *active, bgh_tbl_t *standby, bgh_key_t *key) {
+    bgh_key_t canon;
+    _key4_canon(&canon, key);
+    key = &canon;
+
+    bgh_row_t *row = (bgh_row_t*)_lookup_row(standby, key, BGH_KEY_V4);
+    if(row && row->data) {
+        return row->data;
+    }
+
+    row = (bgh_row_t*)_lookup_row(active, key, BGH_KEY_V4);
+    if(!row || !row->data)
+        return NULL;
+
+    void *data = row->data;
+    if(_move_tables(active, standby, key, row, BGH_KEY_V4) && 
+       standby->value_size)
+        data = _row_data(_lookup_row(standby, key, BGH_KEY_V4));
+    return data;
+}
+
+// Stamps the row with clock, unless it's _NO_CLOCK
+#define _NO_CLOCK UINT32_MAX
+
+_BGH_INLINE void *_lookup_data(bgh_tbl_t *table, 
+        const void *key, uint32_t clock, bgh_counters_t *c, int kt) {
+    void *row = _lookup_row_at(table, key, _hash(table->seed, key, kt), c, kt);
+    if(!row)
+        return NULL;
+    if(clock != _NO_CLOCK)
+        _touch(row, kt, clock);
+    return _row_data(row);
+}
+
+// The clock to stamp rows with, if anything is watching for idle sessions,
+// or for sessions that aren't looked up
+_BGH_INLINE uint32_t _lookup_clock(bgh_t *ssns) {
+    return ssns->wheel || ssns->evicting ? 
+        __atomic_load_n(&ssns->clock, __ATOMIC_RELAXED) : _NO_CLOCK;
+}
+
+// Lookup while a refresh is in progress, without the lock. Only moving a 
+// session from the draining table is a write, and that is skipped if another
+// writer holds the lock. The session just moves on a later lookup instead
+_BGH_INLINE void *_draining_lookup(bgh_t *ssns, bgh_tbl_t *active, 
+        bgh_tbl_t *standby, const void *key, bgh_counters_t *c, int kt) {
+    uint32_t clock = _lookup_clock(ssns);
+    void *data = _lookup_data(standby, key, clock, c, kt);
+    if(data)
+        return data;
+
+    data = _lookup_data(active, key, clock, c, kt);
+    if(!data) {
+        // A writer may have moved the session between our two probes. It 
+        // lands in standby before it leaves active, so one more look covers 
+        // that race
+        return _lookup_data(standby, key, clock, c, kt);
+    }
+
+    if(pthread_mutex_trylock(&ssns->lock))
+        return data;
+
+    // The refresh may have finished before we got the lock
+    bool moved = false;
+    if(ssns->refreshing && ssns->active == active)
+        data = _draining_lookup_active_kt(active, standby, key, &moved, kt);
+    pthread_mutex_unlock(&ssns->lock);
+
+    if(moved)
+        _count(&c->moved, 1);
+    return data;
+}
+
+_BGH_INLINE void *_lookup(bgh_t *ssns, const void *key, int kt) {
+    void *data;
+
+    if(ssns->config.key_type != kt)
+        return NULL;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    if(ssns->nshards)
+        ssns = _shard_for(ssns, key, kt);
+
+    uint64_t *rd = _bgh_read_begin(ssns);
+    bgh_counters_t *c = _counters(ssns);
+
+    // Standby first. Maintenance publishes the new active table 
+    // before clearing standby, so if standby is set and differs from active
+    // we are draining
+    bgh_tbl_t *standby = __atomic_load_n(&ssns->standby, __ATOMIC_SEQ_CST);
+    bgh_tbl_t *active = __atomic_load_n(&ssns->active, __ATOMIC_SEQ_CST);
+
+    if(standby && standby != active)
+        data = _draining_lookup(ssns, active, standby, key, c, kt);
+    else
+        data = _lookup_data(active, key, _lookup_clock(ssns), c, kt);
+
+    _bgh_read_end(rd);
+
+    _count(data ? &c->hits : &c->misses, 1);
+    return data;
+}
+
+void *bgh_lookup(bgh_t *ssns, bgh_key_t *key) {
+    return _lookup(ssns, key, BGH_KEY_V4);
+}
+
+void *bgh_lookup6(bgh_t *ssns, bgh_key6_t *key) {
+    return _lookup(ssns, key, BGH_KEY_V6);
+}
+
+// The rest of _find_or_insert, with the lock held, for a session its 
+// lockless probe didn't find. tbl, version, idx and h are what the probe 
+// found, with tbl NULL if there was no probe to go on
+_BGH_INLINE void *_find_or_insert_locked(bgh_t *ssns, const void *key, 
+        bgh_tbl_t *tbl, uint64_t version, int64_t idx, uint64_t h, 
+        void *(*create_cb)(void *, void *), void *ctx, bool *created, 
+        bgh_counters_t *c, int kt) {
+    bgh_tbl_t *target = ssns->refreshing ? ssns->standby : ssns->active;
+
+    // Unless a writer got in first, the probe's row is still the one to 
+    // use. Otherwise probe again
+    if(tbl != target || 
+       __atomic_load_n(&tbl->version, __ATOMIC_RELAXED) != version) {
+        bool found;
+        tbl = target;
+        h = _hash(tbl->seed, key, kt);
+        idx = _find_slot_at(tbl, key, h, &found, NULL, kt);
+        if(found)
+            return _row_data(_row_at(tbl, idx, kt));
+    }
+
+    // During a refresh the session may still be in the draining table. Move
+    // it into the row just found for it, if there is one
+    if(ssns->refreshing) {
+        bgh_tbl_t *active = ssns->active;
+        void *row = _lookup_row(active, key, kt);
+        if(row && _row_data(row)) {
+            void *data = _row_data(row);
+            if(idx >= 0 && tbl->inserted <= tbl->max_inserts) {
+                data = _place_at(tbl, idx, key, data, h, 
+                    *_row_seen(row, kt), NULL, NULL, kt);
+                active->inserted--;
+                _row_clear(active, row, kt);
+                _count(&c->moved, 1);
+            }
+            return data;
+        }
+    }
+
+    // Same limits and overload policy as _insert_table_at
+    if(!_make_room(ssns, tbl, key, h, &idx, kt)) {
+        _count_insert(c, BGH_FULL);
+        return NULL;
+    }
+
+    void *data = _place_at(tbl, idx, key, NULL, h, 
+        _seen(__atomic_load_n(&ssns->clock, __ATOMIC_RELAXED), 0), 
+        create_cb, ctx, kt);
+    // create_cb had nothing to insert
+    if(!data)
+        return NULL;
+
+    *created = true;
+    _schedule_new(ssns, key, 0, kt);
+    _count_insert(c, BGH_OK);
+    return data;
+}
+
+// A lookup that keeps what its probe found. On a miss the probe has already
+// found the row the session goes in. The lock is taken with the read-side
+// section still held, so that table can't be freed or reused, and if its 
+// version shows no writer has been in since, the session goes straight 
+// into that row. Only a refresh or a racing writer costs a second probe
+_BGH_INLINE void *_find_or_insert(bgh_t *ssns, const void *key, 
+        void *(*create_cb)(void *, void *), void *ctx, bool *created, 
+        int kt) {
+    bool unused;
+    if(!created)
+        created = &unused;
+    *created = false;
+
+    if(ssns->config.key_type != kt || 
+       (!create_cb && !ssns->config.value_size))
+        return NULL;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    if(ssns->nshards)
+        ssns = _shard_for(ssns, key, kt);
+
+    uint64_t *rd = _bgh_read_begin(ssns);
+    bgh_counters_t *c = _counters(ssns);
+
+    bgh_tbl_t *standby = __atomic_load_n(&ssns->standby, __ATOMIC_SEQ_CST);
+    bgh_tbl_t *active = __atomic_load_n(&ssns->active, __ATOMIC_SEQ_CST);
+    bgh_tbl_t *tbl = NULL;
+    uint64_t version = 0,
+             h = 0;
+    int64_t idx = -1;
+    void *data = NULL;
+
+    // Draining lookups may move the session, and a miss goes through the 
+    // lock without a probe to go on
+    if(standby && standby != active)
+        data = _draining_lookup(ssns, active, standby, key, c, kt);
+    else {
+        bool found;
+        tbl = active;
+        version = __atomic_load_n(&tbl->version, __ATOMIC_ACQUIRE);
+        h = _hash(tbl->seed, key, kt);
+        idx = _find_slot_at(tbl, key, h, &found, c, kt);
+        if(found) {
+            void *row = _row_at(tbl, idx, kt);
+            uint32_t clock = _lookup_clock(ssns);
+            if(clock != _NO_CLOCK)
+                _touch(row, kt, clock);
+            data = _row_data(row);
+        }
+    }
+
+    _count(data ? &c->hits : &c->misses, 1);
+
+    if(!data) {
+        pthread_mutex_lock(&ssns->lock);
+        data = _find_or_insert_locked(ssns, key, tbl, version, idx, h, 
+            create_cb, ctx, created, c, kt);
+        pthread_mutex_unlock(&ssns->lock);
+    }
+
+    _bgh_read_end(rd);
+    return data;
+}
+
+void *bgh_find_or_insert(bgh_t *ssns, bgh_key_t *key, 
+        void *(*create_cb)(void *value, void *ctx), void *ctx, 
+        bool *created) {
+    return _find_or_insert(ssns, key, create_cb, ctx, created, BGH_KEY_V4);
+}
+
+void *bgh_find_or_insert6(bgh_t *ssns, bgh_key6_t *key, 
+        void *(*create_cb)(void *value, void *ctx), void *ctx, 
+        bool *created) {
+    return _find_or_insert(ssns, key, create_cb, ctx, created, BGH_KEY_V6);
+}
+
+void *bgh_lookup_or_insert(bgh_t *ssns, bgh_key_t *key) {
+    return _find_or_insert(ssns, key, NULL, NULL, NULL, BGH_KEY_V4);
+}
+
+void *bgh_lookup_or_insert6(bgh_t *ssns, bgh_key6_t *key) {
+    return _find_or_insert(ssns, key, NULL, NULL, NULL, BGH_KEY_V6);
+}
+
+_BGH_INLINE void _delete_from_table(
+        bgh_tbl_t *table, const void *key, int kt) {
+    void *row = _lookup_row(table, key, kt);
+    if(!row || !_row_data(row)) 
+        return;
+
+    void *data = _row_data(row);
+
+    table->inserted--;
+    _row_clear(table, row, kt);
+    table->free_cb(data);
+}
+
+void bgh_delete_from_table(bgh_tbl_t *table, bgh_key_t *key) {
+    bgh_key_t canon;
+    _key4_canon(&canon, key);
+    _delete_from_table(table, &canon, BGH_KEY_V4);
+}
+
+_BGH_INLINE void _clear(bgh_t *ssns, const void *key, int kt) {
+    if(ssns->config.key_type != kt)
+        return;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    if(ssns->nshards)
+        ssns = _shard_for(ssns, key, kt);
+
+    pthread_mutex_lock(&ssns->lock);
+    if(ssns->refreshing) {
+        // XXX Revisit: Not optimal to just do both this way, but this is an edge case
+        _delete_from_table(ssns->active, key, kt);
+        _delete_from_table(ssns->standby, key, kt);
+    }
+    else
+        _delete_from_table(ssns->active, key, kt);
+    pthread_mutex_unlock(&ssns->lock);
+}
+
+void bgh_clear(bgh_t *ssns, bgh_key_t *key) {
+    _clear(ssns, key, BGH_KEY_V4);
+}
+
+void bgh_clear6(bgh_t *ssns, bgh_key6_t *key) {
+    _clear(ssns, key, BGH_KEY_V6);
+}
+
+// Idle timeouts. The timer wheel is only touched with the lock held
+
+static void _wheel_free(bgh_wheel_t *wheel) {
+    if(!wheel)
+        return;
+    for(int l=0; l<BGH_WHEEL_LEVELS; l++) {
+        for(int i=0; i<BGH_WHEEL_SLOTS; i++)
+            free(wheel->slots[l][i].entries);
+    }
+    free(wheel);
+}
+
+// Put an entry in the slot for its deadline, relative to the wheel's time. 
+// Entries already due go in the next tick's slot. If there's 
+// no memory for it, the entry is dropped and the session is left to the 
+// refresh
+static void _wheel_place(bgh_wheel_t *wheel, bgh_wheel_entry_t *e) {
+    uint32_t delta = e->deadline - wheel->now;
+    if((int32_t)delta <= 0)
+        delta = 1;
+
+    int level = 0;
+    while(level < BGH_WHEEL_LEVELS - 1 && 
+          delta >= 1U << (BGH_WHEEL_BITS * (level + 1)))
+        level++;
+
+    // Past the end of the wheel. Park it in the last slot and place it 
+    // again from there
+    if(delta >= 1U << (BGH_WHEEL_BITS * BGH_WHEEL_LEVELS))
+        delta = (1U << (BGH_WHEEL_BITS * BGH_WHEEL_LEVELS)) - 1;
+
+    uint32_t tick = wheel->now + delta;
+    bgh_wheel_slot_t *slot = &wheel->slots[level]
+        [(tick >> (BGH_WHEEL_BITS * level)) & (BGH_WHEEL_SLOTS - 1)];
+
+    if(slot->count == slot->size) {
+        uint32_t size = slot->size ? slot->size * 2 : 16;
+        bgh_wheel_entry_t *entries = (bgh_wheel_entry_t*)realloc(
+            slot->entries, size * sizeof(bgh_wheel_entry_t));
+        if(!entries)
+            return;
+        slot->entries = entries;
+        slot->size = size;
+    }
+
+    slot->entries[slot->count++] = *e;
+}
+
+static void _wheel_add(bgh_wheel_t *wheel, 
+        const void *key, size_t key_size, uint32_t deadline) {
+    bgh_wheel_entry_t e;
+    memcpy(&e.key, key, key_size);
+    e.deadline = deadline;
+    _wheel_place(wheel, &e);
+}
+
+// Empty a slot, returning what was in it. The caller frees the entries
+static bgh_wheel_slot_t _wheel_take(bgh_wheel_slot_t *slot) {
+    bgh_wheel_slot_t taken = *slot;
+    memset(slot, 0, sizeof(*slot));
+    return taken;
+}
+
+// Handle a due entry. If the session has been seen since, or changed class,
+// the entry goes back in the wheel for the new deadline. Otherwise the 
+// session is expired and its data added to batch
+_BGH_INLINE void _wheel_fire(bgh_t *shard, 
+        bgh_wheel_entry_t *e, void **batch, uint32_t *n, int kt) {
+    bgh_wheel_t *wheel = shard->wheel;
+
+    // Parked past the end of the wheel
+    if((int32_t)(e->deadline - wheel->now) > 0) {
+        _wheel_place(wheel, e);
+        return;
+    }
+
+    bgh_tbl_t *tbl = NULL;
+    void *row = NULL;
+    if(shard->refreshing) {
+        tbl = shard->standby;
+        row = _lookup_row(tbl, &e->key, kt);
+    }
+    if(!row) {
+        tbl = shard->active;
+        row = _lookup_row(tbl, &e->key, kt);
+    }
+
+    // Cleared, or already expired by a refresh
+    if(!row)
+        return;
+
+    uint32_t seen = __atomic_load_n(_row_seen(row, kt), __ATOMIC_RELAXED);
+    uint32_t ticks = _timeout_ticks(&shard->config, _seen_class(seen));
+    if(!ticks)
+        return;
+
+    uint32_t age = _seen_age(seen, wheel->now);
+    if(age < ticks) {
+        e->deadline = wheel->now + ticks - age;
+        _wheel_place(wheel, e);
+        return;
+    }
+
+    batch[(*n)++] = _row_data(row);
+    tbl->inserted--;
+    _row_clear(tbl, row, kt);
+}
+
+// Cascade a slot of a higher level down, now that its time has come
+static void _wheel_cascade(bgh_wheel_t *wheel, int level) {
+    uint32_t idx = 
+        (wheel->now >> (BGH_WHEEL_BITS * level)) & (BGH_WHEEL_SLOTS - 1);
+    bgh_wheel_slot_t taken = _wheel_take(&wheel->slots[level][idx]);
+
+    for(uint32_t i=0; i<taken.count; i++)
+        _wheel_place(wheel, &taken.entries[i]);
+    free(taken.entries);
+}
+
+// Pass on sessions expired by the wheel. Their rows are already cleared, 
+// but a lookup may have found one just before, so pointers wait out a grace
+// period. Inline values are released right away, as _evict does, before 
+// the lock is dropped and their rows can be reused. Called with the lock 
+// held
+static void _idle_expire(bgh_t *ssns, bgh_t *shard, void **batch, uint32_t n) {
+    if(!n)
+        return;
+
+    if(shard->config.value_size)
+        _hand_over(ssns, shard, batch, n, true);
+    else if(!_defer(ssns, shard, batch, n, true)) {
+        // Nowhere to keep them, so wait here after all, without the lock
+        pthread_mutex_unlock(&shard->lock);
+        _bgh_synchronize(shard);
+        _hand_over(ssns, shard, batch, n, true);
+        pthread_mutex_lock(&shard->lock);
+    }
+}
+
+// Process every tick up to the shard's clock. The lock is dropped every
+// BGH_TEARDOWN_BATCH entries, so writers aren't held up long by a busy tick.
+// Stats go to ssns, the tracker being maintained
+static void _wheel_advance(bgh_t *ssns, bgh_t *shard) {
+    bgh_wheel_t *wheel = shard->wheel;
+    uint32_t clock = __atomic_load_n(&shard->clock, __ATOMIC_RELAXED);
+    void *batch[BGH_TEARDOWN_BATCH];
+    uint32_t n = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    while(wheel->now != clock) {
+        wheel->now++;
+
+        if(!(wheel->now & (BGH_WHEEL_SLOTS - 1))) {
+            for(int l=BGH_WHEEL_LEVELS - 1; l>0; l--) {
+                uint32_t below = (1U << (BGH_WHEEL_BITS * l)) - 1;
+                if(!(wheel->now & below))
+                    _wheel_cascade(wheel, l);
+            }
+        }
+
+        bgh_wheel_slot_t taken = _wheel_take(
+            &wheel->slots[0][wheel->now & (BGH_WHEEL_SLOTS - 1)]);
+
+        for(uint32_t i=0; i<taken.count; i++) {
+            if(shard->config.key_type == BGH_KEY_V6)
+                _wheel_fire(shard, &taken.entries[i], batch, &n, BGH_KEY_V6);
+            else
+                _wheel_fire(shard, &taken.entries[i], batch, &n, BGH_KEY_V4);
+
+            if(n == BGH_TEARDOWN_BATCH || 
+               !((i + 1) % BGH_TEARDOWN_BATCH)) {
+                _idle_expire(ssns, shard, batch, n);
+                n = 0;
+                pthread_mutex_unlock(&shard->lock);
+                pthread_mutex_lock(&shard->lock);
+            }
+        }
+        free(taken.entries);
+    }
+
+    _idle_expire(ssns, shard, batch, n);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Move a session in shard ssns to class cls. key is canonical. Called with
+// the lock held
+_BGH_INLINE void _set_class_locked(bgh_t *ssns, const void *key, uint8_t cls, 
+        int kt) {
+    void *row = NULL;
+    if(ssns->refreshing)
+        row = _lookup_row(ssns->standby, key, kt);
+    if(!row)
+        row = _lookup_row(ssns->active, key, kt);
+
+    if(row) {
+        uint32_t clock = __atomic_load_n(&ssns->clock, __ATOMIC_RELAXED);
+        uint32_t *seen = _row_seen(row, kt);
+        uint8_t old = _seen_class(__atomic_load_n(seen, __ATOMIC_RELAXED));
+        // Counts as a use of the session
+        __atomic_store_n(seen, _seen(clock, cls) | _SEEN_REF, __ATOMIC_RELAXED);
+
+        // A timer pending for the old class finds the new one when it comes
+        // due. Only add another if there is none, or it would be too late
+        uint32_t ticks = _timeout_ticks(&ssns->config, cls),
+                 old_ticks = _timeout_ticks(&ssns->config, old);
+        if(ssns->wheel && ticks && (!old_ticks || ticks < old_ticks))
+            _wheel_add(ssns->wheel, key, _key_size(kt), clock + ticks);
+    }
+}
+
+_BGH_INLINE void _set_class(bgh_t *ssns, const void *key, uint8_t cls, int kt) {
+    if(ssns->config.key_type != kt || cls >= BGH_CLASSES)
+        return;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    if(ssns->nshards)
+        ssns = _shard_for(ssns, key, kt);
+
+    pthread_mutex_lock(&ssns->lock);
+    _set_class_locked(ssns, key, cls, kt);
+    pthread_mutex_unlock(&ssns->lock);
+}
+
+void bgh_set_class(bgh_t *ssns, bgh_key_t *key, uint8_t cls) {
+    _set_class(ssns, key, cls, BGH_KEY_V4);
+}
+
+void bgh_set_class6(bgh_t *ssns, bgh_key6_t *key, uint8_t cls) {
+    _set_class(ssns, key, cls, BGH_KEY_V6);
+}
+
+// Per key state carried between the passes of a burst
+typedef struct _bgh_burst_slot_t {
+    bgh_t *shard;
+    bgh_tbl_t *tbl;
+    uint64_t hash;
+} bgh_burst_slot_t;
+
+// The i'th key of a burst
+_BGH_INLINE const void *_burst_key(const void *keys, uint32_t i, int kt) {
+    return (const char*)keys + i * _key_size(kt);
+}
+
+// The read-side sections a chunk of a burst has entered, one per shard it 
+// touched. A chunk has at most BGH_BURST_MAX keys, so it can't touch more 
+// shards than that, however many the tracker has
+typedef struct {
+    uint32_t n;
+    uint32_t shard[BGH_BURST_MAX];
+    uint64_t *ctr[BGH_BURST_MAX];
+} _burst_rd_t;
+
+// Enter shard s's read-side section, unless this chunk already has
+_BGH_INLINE void _burst_read_begin(_burst_rd_t *rd, bgh_t *shard, uint32_t s) {
+    for(uint32_t i=0; i<rd->n; i++) {
+        if(rd->shard[i] == s)
+            return;
+    }
+    rd->shard[rd->n] = s;
+    rd->ctr[rd->n++] = _bgh_read_begin(shard);
+}
+
+_BGH_INLINE void _burst_read_end(_burst_rd_t *rd) {
+    for(uint32_t i=0; i<rd->n; i++)
+        _bgh_read_end(rd->ctr[i]);
+    rd->n = 0;
+}
+
+// Canonical copies of a chunk of a burst's keys
+typedef union {
+    bgh_key_t v4[BGH_BURST_MAX];
+    bgh_key6_t v6[BGH_BURST_MAX];
+} _burst_keys_t;
+
+_BGH_INLINE const void *_canon_burst(
+        _burst_keys_t *buf, const void *keys, uint32_t n, int kt) {
+    for(uint32_t i=0; i<n; i++) {
+        if(kt == BGH_KEY_V6)
+            _key6_canon(&buf->v6[i], (const bgh_key6_t*)keys + i);
+        else
+            _key4_canon(&buf->v4[i], (const bgh_key_t*)keys + i);
+    }
+    return buf;
+}
+
+// First pass of a burst: route each key to its shard and table, hash it, and
+// prefetch its home row and control bytes. By the time the second pass 
+// resolves the first key most of the burst's rows are on their way into 
+// cache. 
+// Each shard's read-side section is entered in rd the first time one of the
+// keys lands on it, before its tables are loaded. Writers too: they only 
+// take the lock in the second pass, and until then a table they loaded 
+// could be torn down and handed out again by the pool with a new seed. 
+// write is set for inserts, to prefetch for writing
+_BGH_INLINE void _burst_prefetch(bgh_t *ssns, const void *keys, uint32_t n, 
+        bgh_burst_slot_t *slots, _burst_rd_t *rd, bool write, int kt) {
+    for(uint32_t i=0; i<n; i++) {
+        const void *key = _burst_key(keys, i, kt);
+        uint32_t s = ssns->nshards ? _shard_idx(ssns, key, kt) : 0;
+        bgh_t *shard = ssns->nshards ? ssns->shards[s] : ssns;
+
+        _burst_read_begin(rd, shard, s);
+
+        bgh_tbl_t *standby = __atomic_load_n(&shard->standby, __ATOMIC_SEQ_CST);
+        bgh_tbl_t *active = __atomic_load_n(&shard->active, __ATOMIC_SEQ_CST);
+
+        // Lookups during a drain start with the standby table, and so do all
+        // inserts
+        bgh_tbl_t *tbl = standby ? standby : active;
+
+        slots[i].shard = shard;
+        slots[i].tbl = tbl;
+        slots[i].hash = _hash(tbl->seed, key, kt);
+
+        uint64_t home = _home(tbl, slots[i].hash);
+        if(write) {
+            __builtin_prefetch(&tbl->ctrl[home], 1);
+            __builtin_prefetch(_row_at(tbl, home, kt), 1);
+        }
+        else {
+            __builtin_prefetch(&tbl->ctrl[home], 0);
+            __builtin_prefetch(_row_at(tbl, home, kt), 0);
+        }
+    }
+}
+
+_BGH_INLINE uint32_t _lookup_burst(
+        bgh_t *ssns, const void *keys, uint32_t n, void **data, int kt) {
+    bgh_burst_slot_t slots[BGH_BURST_MAX];
+    _burst_keys_t canon;
+    uint32_t found = 0;
+
+    if(ssns->config.key_type != kt) {
+        memset(data, 0, n * sizeof(void*));
+        return 0;
+    }
+
+    _burst_rd_t rd;
+    rd.n = 0;
+
+    for(uint32_t base=0; base<n; base+=BGH_BURST_MAX) {
+        uint32_t count = n - base < BGH_BURST_MAX ? n - base : BGH_BURST_MAX;
+        const void *chunk = 
+            _canon_burst(&canon, _burst_key(keys, base, kt), count, kt);
+
+        _burst_prefetch(ssns, chunk, count, slots, &rd, false, kt);
+
+        for(uint32_t i=0; i<count; i++) {
+            const void *key = _burst_key(chunk, i, kt);
+            bgh_t *shard = slots[i].shard;
+            bgh_counters_t *c = _counters(shard);
+            void *d;
+
+            // A refresh may have started or finished since the prefetch, so
+            // look again, as _lookup does. The prefetched hash is only good
+            // for the table it was taken for
+            bgh_tbl_t *standby = 
+                __atomic_load_n(&shard->standby, __ATOMIC_SEQ_CST);
+            bgh_tbl_t *active = 
+                __atomic_load_n(&shard->active, __ATOMIC_SEQ_CST);
+
+            if(standby && standby != active)
+                d = _draining_lookup(shard, active, standby, key, c, kt);
+            else if(slots[i].tbl != active)
+                d = _lookup_data(active, key, _lookup_clock(shard), c, kt);
+            else {
+                void *row = _lookup_row_at(active, key, slots[i].hash, c, kt);
+                d = NULL;
+                if(row) {
+                    uint32_t clock = _lookup_clock(shard);
+                    if(clock != _NO_CLOCK)
+                        _touch(row, kt, clock);
+                    d = _row_data(row);
+                }
+            }
+
+            data[base + i] = d;
+            if(d)
+                found++;
+
+            _count(d ? &c->hits : &c->misses, 1);
+        }
+
+        _burst_read_end(&rd);
+    }
+
+    return found;
+}
+
+uint32_t bgh_lookup_burst(
+        bgh_t *ssns, bgh_key_t *keys, uint32_t n, void **data) {
+    return _lookup_burst(ssns, keys, n, data, BGH_KEY_V4);
+}
+
+uint32_t bgh_lookup_burst6(
+        bgh_t *ssns, bgh_key6_t *keys, uint32_t n, void **data) {
+    return _lookup_burst(ssns, keys, n, data, BGH_KEY_V6);
+}
+
+// cls, if not NULL, holds each session's class, so sessions that are 
+// already there move to it as well. See _restore_batch
+_BGH_INLINE uint32_t _insert_burst(bgh_t *ssns, const void *keys, uint32_t n, 
+        void **data, bgh_stat_t *results, const uint8_t *cls, int kt) {
+    bgh_burst_slot_t slots[BGH_BURST_MAX];
+    _burst_keys_t canon;
+    _burst_rd_t rd;
+    uint32_t inserted = 0;
+
+    if(ssns->config.key_type != kt) {
+        for(uint32_t i=0; results && i<n; i++)
+            results[i] = BGH_EXCEPTION;
+        return 0;
+    }
+
+    rd.n = 0;
+    for(uint32_t base=0; base<n; base+=BGH_BURST_MAX) {
+        uint32_t count = n - base < BGH_BURST_MAX ? n - base : BGH_BURST_MAX;
+        const void *chunk = 
+            _canon_burst(&canon, _burst_key(keys, base, kt), count, kt);
+        bgh_t *locked = NULL;
+
+        _burst_prefetch(ssns, chunk, count, slots, &rd, true, kt);
+
+        for(uint32_t i=0; i<count; i++) {
+            const void *key = _burst_key(chunk, i, kt);
+            bgh_t *shard = slots[i].shard;
+            bgh_stat_t stat;
+
+            // Hold a shard's lock across consecutive keys for that shard. 
+            // Unsharded trackers take the lock once per chunk
+            if(shard != locked) {
+                if(locked)
+                    pthread_mutex_unlock(&locked->lock);
+                pthread_mutex_lock(&shard->lock);
+                locked = shard;
+            }
+
+            if(!data[base + i])
+                stat = BGH_EXCEPTION;
+            else {
+                bgh_tbl_t *tbl = shard->refreshing ? shard->standby : shard->active;
+                uint8_t c = cls ? cls[base + i] : 0;
+                uint32_t seen = _seen(
+                    __atomic_load_n(&shard->clock, __ATOMIC_RELAXED), c);
+                bool created;
+
+                // A refresh may have started or finished since the prefetch.
+                // The read-side section keeps slots[i].tbl from being reused,
+                // so the same table means the same seed
+                if(tbl == slots[i].tbl)
+                    stat = _insert_table_at(shard, tbl, key, data[base + i], 
+                        slots[i].hash, seen, &created, kt);
+                else
+                    stat = _insert_table(shard, 
+                        tbl, key, data[base + i], seen, &created, kt);
+
+                if(stat == BGH_OK && created)
+                    _schedule_new(shard, key, c, kt);
+                else if(stat == BGH_OK && c)
+                    _set_class_locked(shard, key, c, kt);
+            }
+
+            if(results)
+                results[base + i] = stat;
+            if(stat == BGH_OK)
+                inserted++;
+            _count_insert(_counters(shard), stat);
+        }
+
+        if(locked)
+            pthread_mutex_unlock(&locked->lock);
+        _burst_read_end(&rd);
+    }
+
+    return inserted;
+}
+
+uint32_t bgh_insert_burst(bgh_t *ssns, bgh_key_t *keys, uint32_t n, 
+        void **data, bgh_stat_t *results) {
+    return _insert_burst(ssns, keys, n, data, results, NULL, BGH_KEY_V4);
+}
+
+uint32_t bgh_insert_burst6(bgh_t *ssns, bgh_key6_t *keys, uint32_t n, 
+        void **data, bgh_stat_t *results) {
+    return _insert_burst(ssns, keys, n, data, results, NULL, BGH_KEY_V6);
+}
+
+void bgh_get_stats(bgh_t *ssns, bgh_stats_t *stats) {
+    // Sharded trackers report the sum over their shards
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
+
+    memset(stats, 0, sizeof(*stats));
+
+    // Teardown and idle timeouts are counted on the tracker being maintained,
+    // which is the sharded tracker, not its shards
+    stats->expired = __atomic_load_n(&ssns->expired, __ATOMIC_RELAXED);
+    stats->idle_expired = 
+        __atomic_load_n(&ssns->idle_expired, __ATOMIC_RELAXED);
+    for(int i=0; i<BGH_TEARDOWN_HIST; i++)
+        stats->teardown_hist[i] = 
+            __atomic_load_n(&ssns->teardown_hist[i], __ATOMIC_RELAXED);
+    stats->overload_refreshes = 
+        __atomic_load_n(&ssns->overload_refreshes, __ATOMIC_RELAXED);
+    stats->load_refreshes = 
+        __atomic_load_n(&ssns->load_refreshes, __ATOMIC_RELAXED);
+
+    for(uint32_t i=0; i<nshards; i++) {
+        bgh_t *shard = shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->in_refresh |= shard->refreshing;
+        stats->num_rows += shard->active->num_rows;
+        stats->inserted += shard->active->inserted;
+        stats->collisions += shard->active->collisions;
+        stats->max_inserts += shard->active->max_inserts;
+        stats->probe_limit_hits += shard->active->probe_limit_hits;
+        stats->tables_allocated += 
+            __atomic_load_n(&shard->tables_allocated, __ATOMIC_RELAXED);
+        stats->alloc_failures += 
+            __atomic_load_n(&shard->alloc_failures, __ATOMIC_RELAXED);
+        stats->evicted += shard->evicted;
+        stats->refused += shard->refused;
+        if(shard->refreshing)
+            stats->probe_limit_hits += shard->standby->probe_limit_hits;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void bgh_get_metrics(bgh_t *ssns, bgh_metrics_t *metrics) {
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
+    uint64_t *sums = (uint64_t*)&metrics->counters;
+
+    memset(metrics, 0, sizeof(*metrics));
+
+    for(uint32_t i=0; i<nshards; i++) {
+        bgh_t *shard = shards[i];
+
+        for(int r=0; r<BGH_READER_SLOTS; r++) {
+            uint64_t *ctrs = (uint64_t*)&shard->readers[r].counters;
+            for(size_t j=0; j<sizeof(bgh_counters_t)/sizeof(uint64_t); j++)
+                sums[j] += __atomic_load_n(&ctrs[j], __ATOMIC_RELAXED);
+        }
+
+        // The tables can't be retired out from under us in a read-side 
+        // section. Their counts are only changed by writers, so they may be 
+        // a little stale
+        uint64_t *rd = _bgh_read_begin(shard);
+        bgh_tbl_t *standby = __atomic_load_n(&shard->standby, __ATOMIC_SEQ_CST);
+        bgh_tbl_t *active = __atomic_load_n(&shard->active, __ATOMIC_SEQ_CST);
+
+        metrics->active_rows += active->num_rows;
+        metrics->active_inserted += 
+            __atomic_load_n(&active->inserted, __ATOMIC_RELAXED);
+        metrics->active_tombstones += 
+            __atomic_load_n(&active->tombstones, __ATOMIC_RELAXED);
+
+        if(standby && standby != active) {
+            metrics->in_refresh = true;
+            metrics->standby_rows += standby->num_rows;
+            metrics->standby_inserted += 
+                __atomic_load_n(&standby->inserted, __ATOMIC_RELAXED);
+            metrics->standby_tombstones += 
+                __atomic_load_n(&standby->tombstones, __ATOMIC_RELAXED);
+        }
+        _bgh_read_end(rd);
+    }
+
+    // Not counted separately on the datapath
+    metrics->counters.lookups = metrics->counters.hits + metrics->counters.misses;
+
+    // Drains are timed on the tracker being maintained
+    uint64_t began = __atomic_load_n(&ssns->began_ms, __ATOMIC_RELAXED),
+             now = _now_ms();
+    if(metrics->in_refresh && now > began)
+        metrics->drain_ms = now - began;
+}
+
+uint64_t bgh_now_ms(void) {
+    return _now_ms();
+}
+
+uint64_t bgh_maintain(bgh_t *ssns, uint64_t now, uint64_t budget) {
+    if(!ssns->config.manual_maintenance)
+        return UINT64_MAX;
+
+    if(!now)
+        now = _now_ms();
+
+    // Run steps that are due right away, like a teardown without pauses, 
+    // until the budget is used up
+    uint64_t *left = budget ? &budget : NULL;
+    uint64_t wait_us;
+    do {
+        wait_us = _maintain(ssns, now, left);
+    } while(!wait_us && (!left || budget));
+
+    return wait_us;
+}
+
+// Snapshot records are padded to keep keys aligned
+static inline size_t _snapshot_pad(size_t len) {
+    return (len + 7) & ~(size_t)7;
+}
+
+// Write out the sessions in one table. Called in a read-side section, so
+// the table stays mapped, while writers carry on. A row is only saved if 
+// it held the same session before and after its key was copied
+static bool _snapshot_tbl(bgh_tbl_t *tbl, FILE *f, 
+        int32_t (*serialize_cb)(void *, void *, uint32_t), 
+        char *buf, uint64_t *saved, uint64_t *length) {
+    int kt = tbl->key_type;
+    size_t key_size = _key_size(kt);
+    bgh_snapshot_rec_t *rec = (bgh_snapshot_rec_t*)buf;
+    char *key = buf + sizeof(*rec),
+         *out = key + key_size;
+
+    for(uint64_t i=0; i<tbl->num_rows; i++) {
+        int8_t ctrl = __atomic_load_n(&tbl->ctrl[i], __ATOMIC_ACQUIRE);
+        // Empty or deleted
+        if(ctrl < 0)
+            continue;
+
+        void *row = _row_at(tbl, i, kt);
+        void *data = _row_data(row);
+        if(!data)
+            continue;
+
+        memcpy(key, _row_key(row), key_size);
+        uint32_t seen = __atomic_load_n(_row_seen(row, kt), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&tbl->ctrl[i], __ATOMIC_RELAXED) != ctrl || 
+           _row_data(row) != data)
+            continue;
+
+        int32_t len = serialize_cb(data, out, BGH_SNAPSHOT_DATA_MAX);
+        if(len < 0)
+            continue;
+        if(len > BGH_SNAPSHOT_DATA_MAX)
+            return false;
+
+        memset(rec, 0, sizeof(*rec));
+        rec->data_len = len;
+        rec->cls = _seen_class(seen);
+
+        size_t total = _snapshot_pad(sizeof(*rec) + key_size + len);
+        memset(out + len, 0, total - (sizeof(*rec) + key_size + len));
+        if(fwrite(buf, total, 1, f) != 1)
+            return false;
+
+        (*saved)++;
+        *length += total;
+    }
+    return true;
+}
+
+bgh_stat_t bgh_snapshot(bgh_t *ssns, const char *path, 
+        int32_t (*serialize_cb)(void *data, void *buf, uint32_t len), 
+        uint64_t *saved) {
+    bgh_t **shards = ssns->nshards ? ssns->shards : &ssns;
+    uint32_t nshards = ssns->nshards ? ssns->nshards : 1;
+    int kt = ssns->config.key_type;
+
+    bgh_snapshot_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BGH_SNAPSHOT_MAGIC, sizeof(BGH_SNAPSHOT_MAGIC));
+    hdr.version = BGH_SNAPSHOT_VERSION;
+    hdr.byte_order = BGH_SNAPSHOT_BYTE_ORDER;
+    hdr.key_type = kt;
+    hdr.key_size = _key_size(kt);
+
+    if(saved)
+        *saved = 0;
+
+    // Written beside the old snapshot, which is only replaced once this one
+    // is complete
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char *tmp = (char*)malloc(tmp_len);
+    char *buf = (char*)malloc(sizeof(bgh_snapshot_rec_t) + 
+        sizeof(bgh_key6_t) + BGH_SNAPSHOT_DATA_MAX + 8);
+    FILE *f = NULL;
+    if(tmp && buf) {
+        snprintf(tmp, tmp_len, "%s.tmp", path);
+        f = fopen(tmp, "wb");
+    }
+
+    bool ok = f && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if(f)
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    for(uint32_t i=0; ok && i<nshards; i++) {
+        bgh_t *shard = shards[i];
+
+        // Sessions move from active to standby during a refresh. Walking 
+        // active first means a session is either still there when we reach 
+        // it, or already in standby, which we walk next
+        uint64_t *rd = _bgh_read_begin(shard);
+        bgh_tbl_t *active = __atomic_load_n(&shard->active, __ATOMIC_SEQ_CST);
+        bgh_tbl_t *standby = __atomic_load_n(&shard->standby, __ATOMIC_SEQ_CST);
+
+        ok = _snapshot_tbl(active, f, serialize_cb, buf, 
+            &hdr.sessions, &hdr.length);
+        if(ok && standby && standby != active)
+            ok = _snapshot_tbl(standby, f, serialize_cb, buf, 
+                &hdr.sessions, &hdr.length);
+        _bgh_read_end(rd);
+    }
+
+    ok = ok && !fseek(f, 0, SEEK_SET) && 
+        fwrite(&hdr, sizeof(hdr), 1, f) == 1 && 
+        !fflush(f) && !fsync(fileno(f));
+    if(f && fclose(f))
+        ok = false;
+
+    if(ok && rename(tmp, path))
+        ok = false;
+    if(!ok && f)
+        unlink(tmp);
+
+    free(tmp);
+    free(buf);
+
+    if(!ok)
+        return BGH_EXCEPTION;
+    if(saved)
+        *saved = hdr.sessions;
+    return BGH_OK;
+}
+
+// Whether a mapped file is a snapshot we can restore into ssns
+static bool _snapshot_valid(bgh_t *ssns, const char *map, size_t len) {
+    const bgh_snapshot_hdr_t *hdr = (const bgh_snapshot_hdr_t*)map;
+
+    if(len < sizeof(*hdr) || 
+       memcmp(hdr->magic, BGH_SNAPSHOT_MAGIC, sizeof(BGH_SNAPSHOT_MAGIC)) ||
+       hdr->version != BGH_SNAPSHOT_VERSION ||
+       hdr->byte_order != BGH_SNAPSHOT_BYTE_ORDER)
+        return false;
+
+    return hdr->key_type == (uint32_t)ssns->config.key_type && 
+        hdr->key_size == _key_size(ssns->config.key_type) &&
+        hdr->length == len - sizeof(*hdr);
+}
+
+// Insert a batch of restored sessions in their classes. Any that don't go 
+// in are freed
+static uint64_t _restore_batch(bgh_t *ssns, void *keys, void **data, 
+        const uint8_t *cls, uint32_t n, void (*free_cb)(void *), bool *full) {
+    bgh_stat_t results[BGH_BURST_MAX];
+    uint64_t inserted = _insert_burst(ssns, keys, n, data, results, cls, 
+        ssns->config.key_type);
+
+    for(uint32_t i=0; i<n; i++) {
+        if(results[i] == BGH_OK)
+            continue;
+        // Inline values were only ever copied from data
+        *full = true;
+        if(!ssns->config.value_size)
+            free_cb(data[i]);
+    }
+    return inserted;
+}
+
+bgh_stat_t bgh_restore(bgh_t *ssns, const char *path, 
+        void *(*deserialize_cb)(const void *buf, uint32_t len), 
+        uint64_t *restored) {
+    int kt = ssns->config.key_type;
+    size_t key_size = _key_size(kt);
+
+    if(restored)
+        *restored = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return BGH_EXCEPTION;
+
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(bgh_snapshot_hdr_t)) {
+        close(fd);
+        return BGH_EXCEPTION;
+    }
+
+    size_t len = st.st_size;
+    char *map = (char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return BGH_EXCEPTION;
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    if(!_snapshot_valid(ssns, map, len)) {
+        munmap(map, len);
+        return BGH_EXCEPTION;
+    }
+
+    // Every table has the same free_cb
+    bgh_t *first = ssns->nshards ? ssns->shards[0] : ssns;
+    void (*free_cb)(void *) = first->active->free_cb;
+
+    // Sessions go in a burst at a time, so their rows are prefetched. 
+    // Inline values are copied out as they're read, so deserialize_cb can 
+    // reuse one buffer
+    size_t value_size = ssns->config.value_size;
+    char *values = NULL;
+    if(value_size && !(values = (char*)malloc(BGH_BURST_MAX * value_size))) {
+        munmap(map, len);
+        return BGH_ALLOC_FAILED;
+    }
+
+    bgh_key6_t keys[BGH_BURST_MAX];
+    void *data[BGH_BURST_MAX];
+    uint8_t cls[BGH_BURST_MAX];
+    uint32_t n = 0;
+    uint64_t inserted = 0;
+    bool full = false,
+         ok = true;
+
+    size_t off = sizeof(bgh_snapshot_hdr_t);
+    while(off < len) {
+        const bgh_snapshot_rec_t *rec = (const bgh_snapshot_rec_t*)(map + off);
+        if(len - off < sizeof(*rec) + key_size || 
+           rec->data_len > len - off - sizeof(*rec) - key_size) {
+            ok = false;
+            break;
+        }
+
+        const char *key = (const char*)(rec + 1);
+        void *d = deserialize_cb(key + key_size, rec->data_len);
+        off += _snapshot_pad(sizeof(*rec) + key_size + rec->data_len);
+
+        if(!d)
+            continue;
+
+        memcpy((char*)keys + n * key_size, key, key_size);
+        if(values) {
+            data[n] = values + n * value_size;
+            memcpy(data[n], d, value_size);
+        }
+        else
+            data[n] = d;
+        cls[n] = rec->cls < BGH_CLASSES ? rec->cls : 0;
+        if(++n == BGH_BURST_MAX) {
+            inserted += _restore_batch(ssns, keys, data, cls, n, free_cb, &full);
+            n = 0;
+        }
+    }
+
+    if(n)
+        inserted += _restore_batch(ssns, keys, data, cls, n, free_cb, &full);
+
+    munmap(map, len);
+    free(values);
+
+    if(restored)
+        *restored = inserted;
+    if(!ok)
+        return BGH_EXCEPTION;
+    return full ? BGH_FULL : BGH_OK;
+}
+
+bgh_shm_reader_t *bgh_shm_open(const char *name) {
+    int fd = _shm_is_path(name) ? 
+        open(name, O_RDWR) : shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+        return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(bgh_shm_hdr_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Read-write, since reader sections are counted in the region
+    size_t len = st.st_size;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return NULL;
+
+    bgh_shm_hdr_t *hdr = (bgh_shm_hdr_t*)p;
+    bool ready = !memcmp(hdr->magic, BGH_SHM_MAGIC, sizeof(BGH_SHM_MAGIC));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    bgh_shm_reader_t *reader = NULL;
+    if(ready && hdr->version == BGH_SHM_VERSION && hdr->size == len)
+        reader = (bgh_shm_reader_t*)malloc(sizeof(bgh_shm_reader_t));
+
+    if(!reader) {
+        munmap(p, len);
+        return NULL;
+    }
+
+    reader->hdr = hdr;
+    reader->len = len;
+    return reader;
+}
+
+// A table as the writer last published it, mapped into this process
+static bool _shm_view(bgh_shm_hdr_t *hdr, int32_t slot, bgh_tbl_t *tbl) {
+    if(slot < 0 || slot >= BGH_SHM_TABLES)
+        return false;
+
+    tbl->num_rows = hdr->tables[slot].num_rows;
+    tbl->max_probe = hdr->tables[slot].max_probe;
+    tbl->seed = hdr->tables[slot].seed;
+    tbl->key_type = (bgh_key_type_t)hdr->key_type;
+    tbl->row_size = hdr->row_size;
+    tbl->value_size = hdr->value_size;
+    tbl->rows = (bgh_row_t*)((char*)hdr + hdr->rows_off[slot]);
+    tbl->ctrl = (int8_t*)((char*)hdr + hdr->ctrl_off[slot]);
+    return tbl->num_rows && tbl->num_rows <= hdr->slot_rows;
+}
+
+_BGH_INLINE const void *_shm_find(bgh_tbl_t *tbl, const void *key, int kt) {
+    int64_t idx = _find_at(tbl, key, _hash(tbl->seed, key, kt), NULL, kt);
+    return idx < 0 ? NULL : _row_value(_row_at(tbl, idx, kt), kt);
+}
+
+// Lookups from another process. The same read-side sections as in-process
+// lookups, on the region's own epoch, keep the tables from being reused 
+// while we probe them. Sessions aren't moved or stamped, that is left to 
+// the writer's lookups
+_BGH_INLINE const void *_shm_lookup(
+        bgh_shm_reader_t *reader, const void *key, int kt) {
+    bgh_shm_hdr_t *hdr = reader->hdr;
+
+    if(hdr->key_type != (uint32_t)kt || 
+       __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    _key_buf_t canon;
+    key = _canon(&canon, key, kt);
+
+    uint64_t *rd = _epoch_enter(&hdr->epoch, hdr->readers);
+
+    bgh_tbl_t active, standby;
+    bool have_active, have_standby;
+    uint32_t gen;
+    do {
+        while((gen = __atomic_load_n(&hdr->gen, __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        have_active = _shm_view(hdr, 
+            __atomic_load_n(&hdr->active, __ATOMIC_RELAXED), &active);
+        have_standby = _shm_view(hdr, 
+            __atomic_load_n(&hdr->standby, __ATOMIC_RELAXED), &standby);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(gen != __atomic_load_n(&hdr->gen, __ATOMIC_RELAXED));
+
+    const void *value = NULL;
+    if(have_active) {
+        // Standby, active, then standby again in case the writer moved the
+        // session in between. See _draining_lookup
+        if(have_standby)
+            value = _shm_find(&standby, key, kt);
+        if(!value)
+            value = _shm_find(&active, key, kt);
+        if(!value && have_standby)
+            value = _shm_find(&standby, key, kt);
+    }
+
+    _bgh_read_end(rd);
+    return value;
+}
+
+const void *bgh_shm_lookup(bgh_shm_reader_t *reader, bgh_key_t *key) {
+    return _shm_lookup(reader, key, BGH_KEY_V4);
+}
+
+const void *bgh_shm_lookup6(bgh_shm_reader_t *reader, bgh_key6_t *key) {
+    return _shm_lookup(reader, key, BGH_KEY_V6);
+}
+
+void bgh_shm_close(bgh_shm_reader_t *reader) {
+    if(!reader)
+        return;
+    munmap(reader->hdr, reader->len);
+    free(reader);
+}
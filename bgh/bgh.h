@@ -3,8 +3,8 @@
  * @author  Adam Keeton <ajkeeton@gmail.com>
  * Copyright (C) 2009-2020 Adam Keeton
  * TCP session tracker, with timeouts. Uses a "blue-green" mechanism for 
- * timeouts and automatic hash resizing. Resizing and timeouts are handled in 
- * their own thread
+ * timeouts and automatic hash resizing. Resizing and timeouts are handled by
+ * a maintenance thread shared by every tracker in the process
 */
 
 #include <stdlib.h>
@@ -12,12 +12,63 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 
 #define BGH_DEFAULT_TIMEOUT 60 // seconds
 #define BGH_DEFAULT_REFRESH_PERIOD 120 // seconds
 // When num_rows * hash_full_pct < number inserted, hash is considered 
-// full and we won't insert.
-#define BGH_DEFAULT_HASH_FULL_PCT 6.0 // 6 percent
+// full and we won't insert. Probes stay short to about 85 percent
+#define BGH_DEFAULT_HASH_FULL_PCT 80.0 // 80 percent
+// Refreshes in a row that have to find a table under scale_down_pct before
+// it shrinks
+#define BGH_DEFAULT_SHRINK_REFRESHES 2
+// Share of a table's max inserts past which the overload policy applies
+#define BGH_DEFAULT_SOFT_LIMIT_PCT 80.0
+// Table sizes are rounded up to a power of two
+#define BGH_DEFAULT_STARTING_ROWS (1 << 20)
+#define BGH_DEFAULT_MIN_ROWS (1 << 12)
+#define BGH_DEFAULT_MAX_ROWS (1 << 21)
+// Rows a probe may cover past a key's home row
+#define BGH_DEFAULT_MAX_PROBE 128
+// Retired tables are freed a slice at a time. A slice covers at most this 
+// many rows, or this long, and is followed by a pause
+#define BGH_DEFAULT_TEARDOWN_ROWS (1 << 16)
+#define BGH_DEFAULT_TEARDOWN_SLICE_US 500
+#define BGH_DEFAULT_TEARDOWN_PAUSE_US 1000
+// Expired sessions are passed to free_batch_cb this many at a time
+#define BGH_TEARDOWN_BATCH 256
+// Buckets in the teardown slice duration histogram
+#define BGH_TEARDOWN_HIST 16
+// Retired tables kept for reuse by later refreshes
+#define BGH_DEFAULT_TABLE_POOL 1
+#define BGH_TABLE_POOL_MAX 4
+// For rounding BGH_HUGEPAGES_HUGETLB mappings
+#define BGH_HUGE_PAGE (2 * 1024 * 1024)
+// Idle timeouts. Sessions belong to one of BGH_CLASSES classes, each with 
+// its own timeout, and are expired by a timer wheel advanced every tick
+#define BGH_CLASSES 8
+#define BGH_DEFAULT_TICK_MS 100
+#define BGH_WHEEL_LEVELS 3
+#define BGH_WHEEL_BITS 6
+#define BGH_WHEEL_SLOTS (1 << BGH_WHEEL_BITS)
+#define BGH_CACHE_LINE 64
+// Number of per-thread read-side counters kept by each tracker
+#define BGH_READER_SLOTS 64
+// Bursts are hashed, prefetched and resolved in chunks of this many keys
+#define BGH_BURST_MAX 64
+// Buckets in the probe length histogram, see bgh_counters_t
+#define BGH_PROBE_HIST 8
+// Snapshot files, see bgh_snapshot_hdr_t
+#define BGH_SNAPSHOT_MAGIC "BGHSNAP"
+#define BGH_SNAPSHOT_VERSION 1
+#define BGH_SNAPSHOT_BYTE_ORDER 0x01020304
+// Most bytes serialize_cb may write for one session
+#define BGH_SNAPSHOT_DATA_MAX 4096
+// Shared memory regions, see bgh_shm_hdr_t
+#define BGH_SHM_MAGIC "BGHSHM"
+#define BGH_SHM_VERSION 2
+// Table slots in a shared region: active, standby or retired, and one pooled
+#define BGH_SHM_TABLES 3
 
 typedef enum _bgh_stat_t {
     BGH_OK,
@@ -27,6 +78,42 @@ typedef enum _bgh_stat_t {
     BGH_EXCEPTION
 } bgh_stat_t;
 
+// A tracker holds sessions keyed by one or the other. IPv4 keys are the 
+// compact default. IPv6 sessions need a tracker of their own, and go through
+// the *6 functions
+typedef enum _bgh_key_type_t {
+    BGH_KEY_V4,
+    BGH_KEY_V6
+} bgh_key_type_t;
+
+// What happens to new sessions as the table they go in fills up. Flags, any
+// combination. With none, sessions are refused with BGH_FULL once the table
+// is full, until a refresh makes room
+typedef enum _bgh_overload_t {
+    BGH_OVERLOAD_REFUSE = 0,
+    // At the limit, evict a session to make room. Picked by CLOCK: lookups 
+    // mark the sessions they find, and a hand sweeping the table takes the
+    // first session that hasn't been looked up since it last went by. New 
+    // sessions start unmarked, so a flood of one packet sessions goes 
+    // before established ones do
+    BGH_OVERLOAD_EVICT = 1,
+    // Past the soft limit, start a refresh right away instead of waiting 
+    // for refresh_period. The new table doubles in size if the old one is 
+    // past scale_up_pct, up to max_rows. Needs a refresh_period
+    BGH_OVERLOAD_REFRESH = 2,
+    // Past the soft limit, admit new sessions with a chance that falls with 
+    // the room left, to 1 in 16 at the limit
+    BGH_OVERLOAD_ADMIT = 4
+} bgh_overload_t;
+
+// Backing for table memory. HUGETLB needs huge pages reserved (see 
+// vm.nr_hugepages), and falls back to THP if there aren't enough
+typedef enum _bgh_hugepages_t {
+    BGH_HUGEPAGES_OFF,
+    BGH_HUGEPAGES_THP,
+    BGH_HUGEPAGES_HUGETLB
+} bgh_hugepages_t;
+
 typedef struct _bgh_config_t {
     uint64_t starting_rows,
              min_rows,
@@ -36,6 +123,60 @@ typedef struct _bgh_config_t {
     float hash_full_pct,
           scale_up_pct,
           scale_down_pct;
+    // Start a refresh as soon as the table is this percent full, rather 
+    // than waiting for refresh_period. The new table is sized for the 
+    // sessions in the old one plus those arriving at the current rate over
+    // the drain, several times bigger if need be. Occupancy is checked 
+    // every tick_ms. 0 to only resize on refresh_period
+    float grow_pct;
+    // A table only halves once this many refreshes in a row have found it
+    // under scale_down_pct, so a lull doesn't undo a spike's growth
+    uint32_t shrink_refreshes;
+    // Bound on the rows an insert or lookup probes, rounded up to a whole 
+    // group. Inserts past it fail with BGH_FULL. 0 for no bound
+    uint64_t max_probe;
+    bgh_key_type_t key_type;
+    // Pacing for freeing a retired table after a refresh. 0 rows or us for 
+    // no limit, 0 pause to go straight through
+    uint64_t teardown_rows;
+    uint32_t teardown_slice_us,
+             teardown_pause_us;
+    // If set, expired sessions are passed here in batches of up
+    // to BGH_TEARDOWN_BATCH, instead of one at a time to free_cb
+    void (*free_batch_cb)(void **data, uint32_t n);
+    // Number of retired tables to keep for reuse, up to BGH_TABLE_POOL_MAX.
+    // Each costs a table's worth of memory, but saves allocating and 
+    // faulting in a new one on refresh. 0 to free tables right away
+    uint32_t table_pool;
+    bgh_hugepages_t hugepages;
+    // Per class idle timeouts. A session not looked up for its class's 
+    // timeout is expired, without waiting for a refresh. 0 for no idle 
+    // timeout, leaving only the refresh. If every class has 0, there is no
+    // timer wheel at all. Sessions start in class 0, see bgh_set_class
+    uint32_t class_timeout_ms[BGH_CLASSES];
+    // Idle timeouts are checked at this granularity
+    uint32_t tick_ms;
+    // Don't register with the maintenance thread. Refreshes, teardown and 
+    // idle timeouts only happen in calls to bgh_maintain
+    bool manual_maintenance;
+    // Keep the tables in a shared memory region of this name, for lookups
+    // from other processes with bgh_shm_open. Either a shm_open name, like
+    // "/sessions", or the path of a file to create, say on a hugetlbfs 
+    // mount. NULL for private memory. Shared trackers can't be sharded, 
+    // keep at most one pooled table, and need a value_size
+    const char *shm_name;
+    // Bytes of session data kept in each row, after the key, instead of a 
+    // pointer to data allocated by the caller. bgh_insert copies this much 
+    // from data, and lookups return a pointer into the row, see 
+    // bgh_lookup_or_insert. free_cb, if any, gets the same pointer when 
+    // the session goes, to release whatever the value refers to. 0 to keep
+    // the caller's pointers
+    uint32_t value_size;
+    // Overload policy, BGH_OVERLOAD_* flags, and the soft limit it starts 
+    // at as a percentage of the table's max inserts. Sessions already in 
+    // the table are never refused
+    uint32_t overload;
+    float soft_limit_pct;
 } bgh_config_t;
 
 typedef struct _bgh_key_t {
@@ -47,22 +188,76 @@ typedef struct _bgh_key_t {
     uint32_t dip;
     uint32_t dport;
 
-    uint8_t vlan;
+    // VLAN ID, or any other zone the sessions should be kept apart by
+    uint16_t vlan;
+    // L4 protocol, IPPROTO_TCP, IPPROTO_UDP, ...
+    uint8_t proto;
 } bgh_key_t;
 
+typedef struct _bgh_key6_t {
+    // Only compared and hashed, so any byte order works if it's consistent
+    uint8_t sip[16];
+    uint8_t dip[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t vlan;
+    uint8_t proto;
+} bgh_key6_t;
+
+// Whether a row is empty, deleted or in use is kept in the table's control 
+// bytes, not in the row
 typedef struct _bgh_row_t {
     void *data;
-    // Necessary to prevent drained or deleted rows from preventing lookups 
-    // from working when there had been a collision
-    bool deleted; 
     bgh_key_t key;
+    // Tick the session was last seen, low 24 bits, and its class in the next
+    // 7. The top bit is set by lookups, for BGH_OVERLOAD_EVICT
+    uint32_t seen;
 } bgh_row_t;
 
+// Rows are stored back to back in a cache-line aligned array. Keep them a
+// divisor of the line size so a probe never has to touch two lines
+typedef char _bgh_row_size_check[
+    BGH_CACHE_LINE % sizeof(bgh_row_t) == 0 ? 1 : -1];
+
+// IPv6 rows are padded out to a full line
+typedef struct _bgh_row6_t {
+    void *data;
+    bgh_key6_t key;
+    uint32_t seen;
+    char pad[BGH_CACHE_LINE - sizeof(void*) - sizeof(bgh_key6_t) - sizeof(uint32_t)];
+} bgh_row6_t;
+
+typedef char _bgh_row6_size_check[
+    BGH_CACHE_LINE % sizeof(bgh_row6_t) == 0 ? 1 : -1];
+
 typedef struct _bgh_stats_t {
     uint64_t inserted, 
              collisions,
              max_inserts,
              num_rows;
+    // Inserts dropped because every row within max_probe was taken, 
+    // since the last refresh
+    uint64_t probe_limit_hits;
+    // Sessions expired by refreshes, in total
+    uint64_t expired;
+    // Teardown slice durations. Bucket i counts slices that took under 
+    // 2^i us, the last bucket also counts anything longer
+    uint64_t teardown_hist[BGH_TEARDOWN_HIST];
+    // Tables allocated, not counting pooled tables reused, and allocations
+    // that failed. A failure means a refresh was skipped
+    uint64_t tables_allocated,
+             alloc_failures;
+    // Sessions expired by idle timeouts. Also counted in expired
+    uint64_t idle_expired;
+    // Overload policy at work, see bgh_overload_t. Sessions evicted, also 
+    // counted in expired, new sessions refused admission, and refreshes 
+    // started early. Those include refreshes to clear out deleted rows, 
+    // once they fill a table along with its sessions
+    uint64_t evicted,
+             refused,
+             overload_refreshes;
+    // Refreshes started early by grow_pct
+    uint64_t load_refreshes;
     bool in_refresh;
 } bgh_stats_t;
 
@@ -75,23 +270,309 @@ typedef struct _bgh_tbl_t {
     uint64_t inserted, 
              collisions,
              max_inserts;
+    // Deleted rows not yet reused by an insert
+    uint64_t tombstones;
+    // Always a power of two
     uint64_t num_rows;
-    bgh_row_t **rows;
+    // Rows probed before giving up, and how many inserts did
+    uint64_t max_probe,
+             probe_limit_hits;
+    // Past this many inserts the tracker's overload policy applies
+    uint64_t soft_inserts;
+    // Next row BGH_OVERLOAD_EVICT looks at
+    uint64_t hand;
+    // Every table hashes with its own seed
+    uint64_t seed;
+    bgh_key_type_t key_type;
+    // Rows are bgh_row_t for IPv4 tables and bgh_row6_t for IPv6, followed
+    // by value_size bytes of inline value if set. Always a power of two
+    uint32_t row_size,
+             value_size;
+    bgh_row_t *rows;
+    // Mapped lengths of rows and ctrl
+    size_t rows_len,
+           ctrl_len;
+    // One control byte per row: empty, deleted, or a 7 bit tag of the key's
+    // hash for rows in use. Probes match tags a group at a time. See group.h
+    int8_t *ctrl;
+    // Bumped whenever a control byte changes. A lockless probe that finds
+    // the version unchanged once it has the lock still holds
+    uint64_t version;
+    // Set if the table is a slot of a shared region
+    struct _bgh_shm_t *shm;
+    uint32_t shm_slot;
 } bgh_tbl_t;
 
+// Timer wheel entries hold the key, not a row, since rows move between 
+// tables. When an entry comes due, the session is looked up. If it has been
+// seen since the entry was added, the entry is simply added again for the 
+// new deadline. So lookups only ever update the row's timestamp
+typedef struct _bgh_wheel_entry_t {
+    union {
+        bgh_key_t v4;
+        bgh_key6_t v6;
+    } key;
+    uint32_t deadline; // Tick
+} bgh_wheel_entry_t;
+
+typedef struct _bgh_wheel_slot_t {
+    bgh_wheel_entry_t *entries;
+    uint32_t count, 
+             size;
+} bgh_wheel_slot_t;
+
+// Hierarchical: level 0 has a slot per tick, level 1 a slot per 
+// BGH_WHEEL_SLOTS ticks, and so on. Entries cascade down a level as their 
+// slot comes up. Deadlines past the last level are re-added when reached
+typedef struct _bgh_wheel_t {
+    // Last tick processed
+    uint32_t now;
+    bgh_wheel_slot_t slots[BGH_WHEEL_LEVELS][BGH_WHEEL_SLOTS];
+} bgh_wheel_t;
+
+// Where a tracker is in its refresh cycle. Each step of a refresh is short,
+// so one thread can interleave the maintenance of many trackers
+typedef enum {
+    BGH_MAINT_IDLE,
+    // Sessions are moving from active to standby
+    BGH_MAINT_DRAINING,
+    // Standby has been swapped in. Waiting for lookups still on the old 
+    // table to finish
+    BGH_MAINT_GRACE,
+    // Expiring whatever was left in the old table, a slice at a time
+    BGH_MAINT_TEARDOWN
+} bgh_maint_state_t;
+
+// Datapath counters. Every thread counts into its own reader slot, without 
+// atomics, and bgh_get_metrics adds them up. Past BGH_READER_SLOTS threads,
+// slots are shared and some counts may be lost
+typedef struct _bgh_counters_t {
+    // Lookups, single or burst, and whether they found the session. Only
+    // hits and misses are counted, lookups is their sum
+    uint64_t lookups, 
+             hits, 
+             misses;
+    // Inserts that succeeded, and those refused with BGH_FULL
+    uint64_t inserts, 
+             full;
+    // Sessions moved from the draining table by lookups
+    uint64_t moved;
+    // Table probes by lookups, by the number of control byte groups 
+    // compared. Bucket 0 is a hit on the home row without reading the 
+    // control bytes. The last bucket also counts anything longer
+    uint64_t probe_hist[BGH_PROBE_HIST];
+} bgh_counters_t;
+
+// Read-side counters for one reader slot. There is one counter per epoch 
+// parity, so new readers never hold up a grace period that is already 
+// waiting on older ones. The slot's thread keeps its datapath counters on 
+// the same lines. Padded out to keep slots on their own cache lines
+typedef struct _bgh_reader_t {
+    uint64_t active[2];
+    bgh_counters_t counters;
+    char pad[BGH_CACHE_LINE - 
+        (2 * sizeof(uint64_t) + sizeof(bgh_counters_t)) % BGH_CACHE_LINE];
+} bgh_reader_t;
+
+// A snapshot of a tracker's counters and tables, see bgh_get_metrics. 
+// Totals across shards for sharded trackers
+typedef struct _bgh_metrics_t {
+    bgh_counters_t counters;
+    // Rows, sessions and tombstones in the active table, and in the standby
+    // table during a refresh
+    uint64_t active_rows,
+             active_inserted,
+             active_tombstones,
+             standby_rows,
+             standby_inserted,
+             standby_tombstones;
+    bool in_refresh;
+    // How long the current refresh has been draining, in ms. Drains last 
+    // for the config's timeout
+    uint64_t drain_ms;
+} bgh_metrics_t;
+
+// Snapshot file layout. The header is followed by one record per session:
+// a bgh_snapshot_rec_t, the key, and data_len bytes of serialized data, 
+// padded out to 8 bytes. Everything is in host byte order
+typedef struct _bgh_snapshot_hdr_t {
+    char magic[8];
+    uint32_t version,
+             // BGH_SNAPSHOT_BYTE_ORDER as written by the saving host
+             byte_order;
+    uint32_t key_type,
+             key_size;
+    uint64_t sessions;
+    // Bytes of records following the header
+    uint64_t length;
+} bgh_snapshot_hdr_t;
+
+typedef struct _bgh_snapshot_rec_t {
+    uint32_t data_len;
+    // Idle timeout class, see bgh_set_class
+    uint8_t cls;
+    uint8_t pad[3];
+} bgh_snapshot_rec_t;
+
+// A table as published to reader processes
+typedef struct _bgh_shm_tbl_t {
+    uint64_t num_rows,
+             max_probe,
+             seed;
+} bgh_shm_tbl_t;
+
+// Start of a shared region. Table slots follow, each with room for the 
+// largest table the config allows. Rows hold their value inline, and only
+// offsets from the start of the region are shared, so each process can map
+// it anywhere. The writer's data pointers in rows are only meaningful to 
+// the writer, readers just see them as set or not
+typedef struct _bgh_shm_hdr_t {
+    // Set last, once the region is ready
+    char magic[8];
+    uint32_t version,
+             key_type,
+             row_size,
+             value_size;
+    uint64_t size,
+             slot_rows;
+    uint64_t rows_off[BGH_SHM_TABLES],
+             ctrl_off[BGH_SHM_TABLES];
+    // The active and standby tables, by slot, -1 for none. gen is odd while
+    // the writer is changing them
+    uint32_t gen;
+    int32_t active,
+            standby;
+    bgh_shm_tbl_t tables[BGH_SHM_TABLES];
+    // Set when the writer frees its tracker
+    uint32_t closed;
+    // Read-side sections of reader processes. The writer advances this 
+    // epoch a step ahead of its own, and waits on both before freeing a 
+    // table
+    uint64_t epoch;
+    bgh_reader_t readers[BGH_READER_SLOTS] 
+        __attribute__((aligned(BGH_CACHE_LINE)));
+} bgh_shm_hdr_t;
+
+// A batch of expired sessions, to be handed to the user once the grace 
+// period for ticket is over. idle is set if idle timeouts expired them
+typedef struct _bgh_deferred_t {
+    struct _bgh_deferred_t *next;
+    uint64_t ticket;
+    uint32_t n;
+    bool idle;
+    void *data[BGH_TEARDOWN_BATCH];
+} bgh_deferred_t;
+
+// The writer's handle on its region
+typedef struct _bgh_shm_t {
+    bgh_shm_hdr_t *hdr;
+    size_t len;
+    char *name;
+    bool used[BGH_SHM_TABLES];
+    // Set by bgh_free. Readers may still be mapped, so slots are left as
+    // they are
+    bool closing;
+} bgh_shm_t;
+
+// A reader process's view of a shared tracker, see bgh_shm_open
+typedef struct _bgh_shm_reader_t {
+    bgh_shm_hdr_t *hdr;
+    size_t len;
+} bgh_shm_reader_t;
+
 typedef struct _bgh_t {
     bgh_config_t config;
 
+    // Registered with the maintenance thread
     bool running,
          refreshing;
+    // Serializes writers: inserts, clears, refresh state changes, and moving
+    // sessions out of a draining table. Lookups never wait on it
     pthread_mutex_t lock;
-    pthread_t refresh;
 
     // Our active table
     bgh_tbl_t *active;
 
     // Our standby table, used when refreshing
     bgh_tbl_t *standby;
+
+    // Epoch based reclamation of retired tables and expired sessions. 
+    // Lookups announce themselves in their thread's slot for the current 
+    // epoch parity. Maintenance notes the epoch when it retires something,
+    // and frees it once the epoch has advanced two past that, which it only
+    // does as readers of each parity leave
+    uint64_t epoch;
+    bgh_reader_t *readers;
+    // Set if the tables are in a shared region
+    bgh_shm_t *shm;
+
+    // Set on a sharded tracker. Each shard is a complete tracker of its own,
+    // but maintained as part of the sharded tracker, and sessions are 
+    // spread across them by hash. The sharded tracker's own tables are 
+    // unused
+    uint32_t nshards;
+    struct _bgh_t **shards;
+    // Hash seed for picking a shard
+    uint64_t seed;
+
+    // Teardown stats, see bgh_stats_t
+    uint64_t expired;
+    uint64_t teardown_hist[BGH_TEARDOWN_HIST];
+
+    // Retired tables, emptied and ready for reuse. Oldest first
+    bgh_tbl_t *pool[BGH_TABLE_POOL_MAX];
+    uint64_t tables_allocated,
+             alloc_failures;
+
+    // Current tick, kept by the maintenance thread, and the time it counts 
+    // from
+    uint32_t clock;
+    uint64_t start_ms;
+    // Only if any class has an idle timeout. Guarded by lock
+    bgh_wheel_t *wheel;
+    uint64_t idle_expired;
+
+    // Refresh state. Only the maintenance thread touches these, see 
+    // _maintain. Times are in ms. On a sharded tracker, the table being 
+    // retired and its grace period epoch are kept per shard
+    bgh_maint_state_t maint;
+    uint64_t last_ms,
+             began_ms;
+    bgh_tbl_t *retired;
+    uint64_t retired_epoch;
+    uint32_t teardown_shard;
+    uint64_t teardown_row;
+    // Overload policy state, guarded by lock. overloaded asks maintenance 
+    // for a refresh, and is also read without the lock. Pointers to evicted
+    // sessions wait in evicting for maintenance to pick up, only allocated 
+    // for BGH_OVERLOAD_EVICT. Counts are reported in bgh_stats_t
+    bool overloaded;
+    void **evicting;
+    uint32_t evicting_n;
+    // Expired sessions waiting out their grace period, oldest first. Only 
+    // maintenance touches these
+    bgh_deferred_t *deferred,
+                   *deferred_tail;
+    uint64_t admit_rng;
+    uint64_t evicted,
+             refused,
+             overload_refreshes;
+    // The tracker maintenance runs on: the tracker itself, or the sharded
+    // tracker it's a shard of
+    struct _bgh_t *maintainer;
+    // Kept by maintenance for sizing the next table. The table taking new
+    // sessions, its count when last looked at and when, and new sessions 
+    // per second, smoothed. Refreshes in a row that found the table under
+    // scale_down_pct
+    bgh_tbl_t *load_tbl;
+    uint64_t load_inserted,
+             load_ms;
+    double load_rate;
+    uint32_t low_refreshes;
+    uint64_t load_refreshes;
+    // Trackers are kept in a list, each due for maintenance at sched_due_us
+    struct _bgh_t *sched_next;
+    uint64_t sched_due_us;
 } bgh_t;
 
 #ifdef __cplusplus
@@ -104,24 +585,162 @@ bgh_t *bgh_new(void (*free_cb)(void *));
 // Allocate new session tracker using user config
 bgh_t *bgh_config_new(bgh_config_t *config, void (*free_cb)(void *));
 
+// Allocate a tracker split into nshards independent shards, for multiple 
+// writer threads. Each shard has its own lock and tables, and all shards are
+// refreshed by a single thread. Row counts in the config are totals across 
+// all shards
+bgh_t *bgh_sharded_new(
+    uint32_t nshards, bgh_config_t *config, void (*free_cb)(void *));
+
 // Initialize a configuration with the default values
 void bgh_config_init(bgh_config_t *config);
 
 // Free session tracker
 void bgh_free(bgh_t *tracker);
 
-// Lookup entry
+// Lookup entry. Safe to call from any number of threads concurrently with
+// each other, with writers, and with the maintenance thread. Takes no locks
 void *bgh_lookup(bgh_t *tracker, bgh_key_t *key);
 
-// Insert entry
+// Insert entry. If the session is already there, its old data is passed to
+// free_cb straight away, see bgh_clear
 bgh_stat_t bgh_insert(bgh_t *tracker, bgh_key_t *key, void *data);
 
-// Delete entry 
+// Delete entry. Its data is passed to free_cb straight away, unlike expired
+// and evicted sessions, which wait out a grace period first. A lookup on 
+// another thread may have just returned that data: the caller must make 
+// sure no reader is still using it, typically by only clearing and 
+// overwriting sessions from the thread that looks them up
 void bgh_clear(bgh_t *tracker, bgh_key_t *key);
 
-// Populate given stats structure
+// Lookup n entries. data[i] is set to the data for keys[i], or NULL. All keys
+// in a chunk are hashed and their rows prefetched before any is resolved, so
+// the cache misses overlap. Returns the number found
+uint32_t bgh_lookup_burst(
+    bgh_t *tracker, bgh_key_t *keys, uint32_t n, void **data);
+
+// Insert n entries, prefetching as bgh_lookup_burst does. If results is not 
+// NULL, results[i] is set to the status for keys[i]. Returns the number of
+// entries inserted
+uint32_t bgh_insert_burst(bgh_t *tracker, bgh_key_t *keys, uint32_t n, 
+    void **data, bgh_stat_t *results);
+
+// Look a session up, and create it if it isn't there, with one probe of the
+// table. create_cb is only called for a new session. With a value_size, 
+// it's given the session's zeroed value to fill in, and returns it. 
+// Otherwise it's given NULL, and returns the data to insert. Either way, 
+// it can return NULL to not create the session after all. It's called with
+// the lock held, so it mustn't call into the tracker. If created is not 
+// NULL, it's set to whether the session is new. Returns the session's 
+// data, or NULL if it wasn't there and wasn't created. During a refresh, 
+// a session found in the draining table is moved, as by a lookup
+void *bgh_find_or_insert(bgh_t *tracker, bgh_key_t *key, 
+    void *(*create_cb)(void *value, void *ctx), void *ctx, bool *created);
+
+// bgh_find_or_insert without a create_cb, for trackers with a value_size.
+// Returns a pointer to the session's value in its row, first inserting the
+// session with a zeroed value if there isn't one, or NULL if it couldn't 
+// be inserted. The pointer is good until the session is cleared or 
+// expired, or moved by a refresh. During a refresh, lookups copy sessions 
+// to the new table and return the copy
+void *bgh_lookup_or_insert(bgh_t *tracker, bgh_key_t *key);
+
+// Move a session to another class, and so another idle timeout. Typically 
+// for TCP state: a short timeout for handshakes and closed sessions, a long
+// one for established. Counts as seeing the session
+void bgh_set_class(bgh_t *tracker, bgh_key_t *key, uint8_t cls);
+
+// IPv6 versions of the above, for trackers configured with BGH_KEY_V6. 
+// Calling the functions for one key type on a tracker of the other is an 
+// error: lookups find nothing and inserts return BGH_EXCEPTION
+void *bgh_lookup6(bgh_t *tracker, bgh_key6_t *key);
+void *bgh_lookup_or_insert6(bgh_t *tracker, bgh_key6_t *key);
+void *bgh_find_or_insert6(bgh_t *tracker, bgh_key6_t *key, 
+    void *(*create_cb)(void *value, void *ctx), void *ctx, bool *created);
+bgh_stat_t bgh_insert6(bgh_t *tracker, bgh_key6_t *key, void *data);
+void bgh_clear6(bgh_t *tracker, bgh_key6_t *key);
+void bgh_set_class6(bgh_t *tracker, bgh_key6_t *key, uint8_t cls);
+uint32_t bgh_lookup_burst6(
+    bgh_t *tracker, bgh_key6_t *keys, uint32_t n, void **data);
+uint32_t bgh_insert_burst6(bgh_t *tracker, bgh_key6_t *keys, uint32_t n, 
+    void **data, bgh_stat_t *results);
+
+// Put a key in the canonical form sessions are stored in: its two endpoints
+// in a fixed order, and padding zeroed. Both directions of a session
+// normalize to the same key. Returns 1 if the endpoints were
+// swapped, 0 if not, so comparing with the value returned for a session's 
+// first packet tells which side sent a packet. Every function taking a key
+// normalizes its own copy, so this is only needed for the direction
+int bgh_key_normalize(bgh_key_t *key);
+int bgh_key6_normalize(bgh_key6_t *key);
+
+// Populate given stats structure. Totals across shards for sharded trackers
 void bgh_get_stats(bgh_t *tracker, bgh_stats_t *stats);
 
+// Populate given metrics structure. Takes no locks, so the datapath is never
+// held up, at the cost of the numbers not being from a single instant
+void bgh_get_metrics(bgh_t *tracker, bgh_metrics_t *metrics);
+
+// The clock trackers keep time by, in ms. Monotonic and coarse: cheap 
+// enough to read per packet
+uint64_t bgh_now_ms(void);
+
+// Drive a tracker configured with manual_maintenance. Does whatever refresh,
+// teardown and idle timeout work is due at now, in ms on bgh_now_ms's 
+// clock, or 0 to read it. Teardown walks at most budget rows per call, 0 for
+// no limit beyond the config's own slice limits. Returns the us until more 
+// work is due: 0 if the budget ran out with work left, UINT64_MAX if there 
+// is nothing scheduled at all. Must not be called from more than one thread 
+// at once. Does nothing on trackers without manual_maintenance
+uint64_t bgh_maintain(bgh_t *tracker, uint64_t now, uint64_t budget);
+
+// Save every session to a file at path, for bgh_restore after a restart. 
+// serialize_cb writes a session's data into buf, at most len bytes, and 
+// returns the bytes written, or a negative value to leave the session out.
+// Tables are walked without the lock, so lookups and inserts carry on. 
+// serialize_cb sees data the datapath may be using at the same time, and 
+// a session being moved by a refresh may be saved twice. Each shard is 
+// walked in a single read-side section, so while the snapshot runs this 
+// tracker can't finish tearing down an old table, and expired or evicted 
+// sessions queue up rather than going to free_cb. Lookups, inserts and 
+// maintenance of other trackers carry on. The file is written beside path
+// and renamed over it once complete. If saved is not NULL, it is set to the
+// number of sessions written. Returns BGH_EXCEPTION if the file couldn't be
+// written
+bgh_stat_t bgh_snapshot(bgh_t *tracker, const char *path, 
+    int32_t (*serialize_cb)(void *data, void *buf, uint32_t len), 
+    uint64_t *saved);
+
+// Insert the sessions saved by bgh_snapshot. The file is mapped and read in
+// place. deserialize_cb turns a session's saved bytes back into data for 
+// the tracker, or returns NULL to skip it. With a value_size, the value is
+// copied from what it returns, which stays deserialize_cb's. Restored 
+// sessions keep their class, and count as seen now. The tracker must have 
+// the snapshot's key type, and should be sized to hold its sessions: any 
+// that don't fit are passed to the tracker's free_cb and BGH_FULL is 
+// returned. If restored is not NULL, it is set to the number inserted. 
+// Returns BGH_EXCEPTION if the file can't be read or isn't a snapshot for 
+// this tracker, and BGH_ALLOC_FAILED if a burst's worth of inline values 
+// can't be allocated
+bgh_stat_t bgh_restore(bgh_t *tracker, const char *path, 
+    void *(*deserialize_cb)(const void *buf, uint32_t len), 
+    uint64_t *restored);
+
+// Attach to a tracker created with shm_name by another process, for 
+// lookups. Returns NULL if there is no such region, or it isn't ready
+bgh_shm_reader_t *bgh_shm_open(const char *name);
+
+// Look a session up in a shared tracker. Returns a pointer to its value in
+// the region, or NULL. Takes no locks and never writes to the tables: the 
+// writer moves sessions and stamps them as seen. The value is read in 
+// place, while the writer may be updating it, and the row can be reused 
+// once the writer clears or expires the session. After the writer frees 
+// its tracker, nothing is found
+const void *bgh_shm_lookup(bgh_shm_reader_t *reader, bgh_key_t *key);
+const void *bgh_shm_lookup6(bgh_shm_reader_t *reader, bgh_key6_t *key);
+
+void bgh_shm_close(bgh_shm_reader_t *reader);
+
 #ifdef __cplusplus
 }
 #endif
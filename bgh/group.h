@@ -0,0 +1,104 @@
+#pragma once
+/*
+ * Control byte groups for probing. Every row has a control byte: either
+ * empty, deleted, or a 7 bit tag taken from the key's hash. A probe compares
+ * a whole group of control bytes against the tag at once and only does a
+ * full key compare on rows whose tag matches.
+ *
+ * Group width is 32 with AVX2, 16 with SSE2, otherwise 8 using plain 64 bit
+ * arithmetic. Define BGH_NO_SIMD to force the portable version.
+ *
+ * Each match function returns a bitmask with bit i set if byte i of the
+ * group matches. Groups are read with unaligned loads from any row index.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define BGH_CTRL_EMPTY ((int8_t)-128) // 0b10000000
+#define BGH_CTRL_DELETED ((int8_t)-2) // 0b11111110
+// Tags are 0 - 127. Anything with the high bit set is not a full row
+
+#if defined(__AVX2__) && !defined(BGH_NO_SIMD)
+
+#include <immintrin.h>
+#define BGH_GROUP_WIDTH 32
+
+static inline __m256i _group_load(const int8_t *ctrl) {
+    return _mm256_loadu_si256((const __m256i*)ctrl);
+}
+
+static inline uint32_t group_match(const int8_t *ctrl, int8_t tag) {
+    return _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_group_load(ctrl), _mm256_set1_epi8(tag)));
+}
+
+static inline uint32_t group_match_empty(const int8_t *ctrl) {
+    return group_match(ctrl, BGH_CTRL_EMPTY);
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t *ctrl) {
+    // Both have the high bit set
+    return _mm256_movemask_epi8(_group_load(ctrl));
+}
+
+#elif defined(__SSE2__) && !defined(BGH_NO_SIMD)
+
+#include <emmintrin.h>
+#define BGH_GROUP_WIDTH 16
+
+static inline __m128i _group_load(const int8_t *ctrl) {
+    return _mm_loadu_si128((const __m128i*)ctrl);
+}
+
+static inline uint32_t group_match(const int8_t *ctrl, int8_t tag) {
+    return _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_group_load(ctrl), _mm_set1_epi8(tag)));
+}
+
+static inline uint32_t group_match_empty(const int8_t *ctrl) {
+    return group_match(ctrl, BGH_CTRL_EMPTY);
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t *ctrl) {
+    // Both have the high bit set
+    return _mm_movemask_epi8(_group_load(ctrl));
+}
+
+#else
+
+#define BGH_GROUP_WIDTH 8
+
+#define _GROUP_LSBS 0x0101010101010101ULL
+#define _GROUP_LOW7 0x7F7F7F7F7F7F7F7FULL
+#define _GROUP_MSBS 0x8080808080808080ULL
+
+static inline uint64_t _group_load(const int8_t *ctrl) {
+    uint64_t g;
+    memcpy(&g, ctrl, sizeof(g));
+    return g;
+}
+
+// Gather the high bit of each byte into the low 8 bits
+static inline uint32_t _group_mask(uint64_t m) {
+    return (uint32_t)(((m >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static inline uint32_t group_match(const int8_t *ctrl, int8_t tag) {
+    // Bytes equal to the tag become zero. Find zero bytes exactly, without
+    // letting borrows from one byte leak into the next
+    uint64_t x = _group_load(ctrl) ^ (_GROUP_LSBS * (uint8_t)tag);
+    return _group_mask(~(((x & _GROUP_LOW7) + _GROUP_LOW7) | x | _GROUP_LOW7));
+}
+
+static inline uint32_t group_match_empty(const int8_t *ctrl) {
+    // Empty is the only value with the high bit set and bit 1 clear
+    uint64_t g = _group_load(ctrl);
+    return _group_mask(g & ~(g << 6) & _GROUP_MSBS);
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t *ctrl) {
+    return _group_mask(_group_load(ctrl) & _GROUP_MSBS);
+}
+
+#endif
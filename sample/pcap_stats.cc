@@ -1,18 +1,32 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcap.h>
 #include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
 
 #include "bgh.h"
 
 // Our sample session data
 struct ssn_data_t {
-    int count;
+    // Packets from the side that opened the session, then from the other
+    int count[2];
+    // bgh_key_normalize's direction for the opening packet
+    int dir;
 };
 
 #define SIZE_ETHERNET 14
 #define ETHER_ADDR_LEN    6
+#define ETHERTYPE_IPV4 0x0800
 
 struct eh_t {
     uint8_t src[ETHER_ADDR_LEN];
@@ -50,37 +64,121 @@ struct tcph_t {
         u_short th_urp;
 };
 
+// Latency is sampled for one packet in this many, or every burst
+#define LATENCY_SAMPLE 64
+
+struct pool_t;
+
+// State handed to the pcap callback, and each worker's own
+struct ctx_t {
+    bgh_t *tracker;
+    // Set on the reader when packets are fanned out to workers
+    pool_t *pool;
+    // Packets per burst. 0 to process one packet at a time
+    uint32_t burst;
+    std::vector<bgh_key_t> keys;
+    std::vector<int> sizes;
+    std::vector<uint8_t> dirs;
+    std::vector<void *> data;
+    uint64_t packets;
+    // New sessions, and those that couldn't be inserted
+    uint64_t sessions,
+             failed;
+    // Replays time a sample of packets, or every burst
+    bool sample_latency;
+    std::vector<uint32_t> latency_ns;
+};
+
+// Per session output. Replays turn it off
+static bool verbose = true;
+static uint64_t expired = 0;
+// Overload policy for every tracker, see -o
+static uint32_t overload = BGH_OVERLOAD_REFUSE;
+
 void usage() {
 //    printf("ssn_track sample\nUsing lib version %d.%d\n", ssn_track_VERSION_MAJOR, ssn_track_VERSION_MINOR);
-    puts("Usage: ./pcap_stats <pcap>");
+    puts("Usage: ./pcap_stats [-b <burst size>] [-r [-l <loops>]] "
+         "[-w <workers> [-s]] [-o <policy>] <pcap>");
+    puts("  -b  Look sessions up in bursts with bgh_lookup_burst");
+    puts("  -r  Replay: map the capture and measure throughput, without");
+    puts("      per session output");
+    puts("  -l  With -r, replay the capture this many times. Each pass");
+    puts("      rewrites addresses so its flows are new");
+    puts("  -w  Fan packets out from the reader to this many worker threads,");
+    puts("      keeping both directions of a flow on one worker");
+    puts("  -s  With -w, workers share one sharded tracker instead of");
+    puts("      each having its own");
+    puts("  -o  What to do with new sessions once a table fills up, any of:");
+    puts("      e to evict sessions that haven't been seen again, r to ");
+    puts("      refresh into a bigger table early, a to admit new ones at");
+    puts("      random. Otherwise they're refused until the next refresh");
 }
 
-void pcap_cb(uint8_t *args, const struct pcap_pkthdr *header, const uint8_t *packet)
-{
-    bgh_t *tracker = (bgh_t*)args;
+// -o's letters as BGH_OVERLOAD_* flags. Returns false for any other letter
+bool parse_overload(const char *arg, uint32_t *policy) {
+    *policy = BGH_OVERLOAD_REFUSE;
+    for(; *arg; arg++) {
+        switch(*arg) {
+            case 'e':
+                *policy |= BGH_OVERLOAD_EVICT;
+                break;
+            case 'r':
+                *policy |= BGH_OVERLOAD_REFRESH;
+                break;
+            case 'a':
+                *policy |= BGH_OVERLOAD_ADMIT;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Fill in the session key for a packet of caplen bytes. Returns false for 
+// packets we don't track
+bool parse_key(const uint8_t *packet, uint32_t caplen, 
+        bgh_key_t *key, int *payload_size) {
+    if(caplen < SIZE_ETHERNET + 20)
+        return false;
+
+    eh_t *eh = (eh_t*)packet;
+    if(ntohs(eh->type) != ETHERTYPE_IPV4)
+        return false;
 
     iph_t *ip = (iph_t*)(packet + SIZE_ETHERNET);
 
     int size_ip = IP_HL(ip)*4;
     if (size_ip < 20) {
-        printf("Skipping packet with invalid IP header length\n");
-        return;
+        if(verbose)
+            printf("Skipping packet with invalid IP header length\n");
+        return false;
     }
 
     // Ignore if not TCP
     if(ip->ip_p != IPPROTO_TCP) 
-        return;
+        return false;
+
+    if(caplen < (uint32_t)(SIZE_ETHERNET + size_ip + 20))
+        return false;
     
     tcph_t *tcp = (tcph_t*)(packet + SIZE_ETHERNET + size_ip);
 
     int size_tcp = TH_OFF(tcp)*4;
     if (size_tcp < 20) {
-        printf("Skipping packet with invalid TCP header length\n");
-        return;
+        if(verbose)
+            printf("Skipping packet with invalid TCP header length\n");
+        return false;
     }
     
 
-    int payload_size = ntohs(ip->ip_len) - (size_ip + size_tcp);
+    *payload_size = ntohs(ip->ip_len) - (size_ip + size_tcp);
     /*
     // uint8_t *payload = (uint8_t *)(packet + SIZE_ETHERNET + size_ip + size_tcp);
     
@@ -90,59 +188,679 @@ void pcap_cb(uint8_t *args, const struct pcap_pkthdr *header, const uint8_t *pac
     }
     */
 
-    bgh_key_t key;
+    key->sip = ip->ip_src.s_addr;
+    key->dip = ip->ip_dst.s_addr;
+    key->sport = tcp->th_sport;
+    key->dport = tcp->th_dport;
+    key->vlan = 0;
+    key->proto = IPPROTO_TCP;
+    return true;
+}
 
-    key.sip = ip->ip_src.s_addr;
-    key.dip = ip->ip_dst.s_addr;
-    key.sport = tcp->th_sport;
-    key.dport = tcp->th_dport;
-    key.vlan = 0;
+// key is normalized. dir swaps it back to the packet's own order
+void new_session(ctx_t *ctx, bgh_key_t *key, int dir, int payload_size) {
+    ctx->sessions++;
+    if(!verbose)
+        return;
 
-    ssn_data_t *ssn = (ssn_data_t*)bgh_lookup(tracker, &key);
+    struct in_addr src, dst;
+    src.s_addr = dir ? key->dip : key->sip;
+    dst.s_addr = dir ? key->sip : key->dip;
+    uint16_t sport = dir ? key->dport : key->sport,
+             dport = dir ? key->sport : key->dport;
+
+    // Workers print too, so not inet_ntoa and its static buffer
+    char sbuf[INET_ADDRSTRLEN],
+         dbuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &src, sbuf, sizeof(sbuf));
+    inet_ntop(AF_INET, &dst, dbuf, sizeof(dbuf));
+    printf("New session: %s:%d -> %s:%d size %d\n", 
+        sbuf, ntohs(sport), 
+        dbuf, ntohs(dport), payload_size);
+}
 
+// Sessions are kept inline in the tracker's rows, and new ones start 
+// zeroed. Found or created with one probe. Returns NULL if the tracker had
+// no room for it
+ssn_data_t *track(ctx_t *ctx, bgh_key_t *key, int dir, int payload_size) {
+    bool created;
+    ssn_data_t *ssn = (ssn_data_t*)bgh_find_or_insert(
+        ctx->tracker, key, NULL, NULL, &created);
     if(!ssn) {
-        // New session
-        printf("New session: %s:%d -> %s:%d size %d\n", 
-            inet_ntoa(ip->ip_src), ntohs(tcp->th_sport), 
-            inet_ntoa(ip->ip_dst), ntohs(tcp->th_dport), payload_size);
-
-        ssn = new ssn_data_t;
-        ssn->count = 0;
-        bgh_stat_t stat = bgh_insert(tracker, &key, ssn);
-        if(stat != BGH_OK) {
-            printf("Failed to save session: %d\n", stat);
-            exit(-1);
-        }
+        if(verbose)
+            printf("Failed to save session\n");
+        ctx->failed++;
+        return NULL;
+    }
+
+    if(created) {
+        ssn->dir = dir;
+        new_session(ctx, key, dir, payload_size);
+    }
+    ssn->count[dir != ssn->dir]++;
+    return ssn;
+}
+
+// Resolve every packet queued for the current burst
+void flush_burst(ctx_t *ctx) {
+    uint32_t n = ctx->keys.size();
+    uint64_t start = ctx->sample_latency ? now_ns() : 0;
+
+    ctx->data.resize(n);
+    bgh_lookup_burst(ctx->tracker, ctx->keys.data(), n, ctx->data.data());
+
+    for(uint32_t i=0; i<n; i++) {
+        ssn_data_t *ssn = (ssn_data_t*)ctx->data[i];
+
+        // A new session may show up more than once in a burst. Only the 
+        // first miss creates it
+        if(ssn)
+            ssn->count[ctx->dirs[i] != ssn->dir]++;
+        else
+            track(ctx, &ctx->keys[i], ctx->dirs[i], ctx->sizes[i]);
+    }
+
+    if(ctx->sample_latency)
+        ctx->latency_ns.push_back(now_ns() - start);
+
+    ctx->keys.clear();
+    ctx->sizes.clear();
+    ctx->dirs.clear();
+}
+
+// Track one packet, already counted in ctx->packets
+void process(ctx_t *ctx, bgh_key_t *key, int dir, int payload_size) {
+    if(ctx->burst) {
+        ctx->keys.push_back(*key);
+        ctx->sizes.push_back(payload_size);
+        ctx->dirs.push_back(dir);
+        if(ctx->keys.size() >= ctx->burst)
+            flush_burst(ctx);
+        return;
     }
 
-    ssn->count++;
+    if(ctx->sample_latency && !(ctx->packets % LATENCY_SAMPLE)) {
+        uint64_t start = now_ns();
+        track(ctx, key, dir, payload_size);
+        ctx->latency_ns.push_back(now_ns() - start);
+    }
+    else
+        track(ctx, key, dir, payload_size);
+}
+
+void dispatch(pool_t *pool, bgh_key_t *key, int dir, int payload_size);
+
+// Addresses are xor'd with mask, both directions alike, so a replayed 
+// capture's sessions don't collide with the last pass's. The key is then
+// normalized once here, so workers and the tracker all see the same key for
+// either direction
+void handle_packet(ctx_t *ctx, const uint8_t *packet, uint32_t caplen, 
+        uint32_t mask) {
+    bgh_key_t key;
+    int payload_size;
+
+    if(!parse_key(packet, caplen, &key, &payload_size))
+        return;
+
+    key.sip ^= mask;
+    key.dip ^= mask;
+    int dir = bgh_key_normalize(&key);
+    ctx->packets++;
+
+    if(ctx->pool)
+        dispatch(ctx->pool, &key, dir, payload_size);
+    else
+        process(ctx, &key, dir, payload_size);
+}
+
+void pcap_cb(uint8_t *args, const struct pcap_pkthdr *header, const uint8_t *packet)
+{
+    handle_packet((ctx_t*)args, packet, header->caplen, 0);
 }
 
+// Only counts: the session lives in the tracker's row
 void free_data_cb(void *p) {
     ssn_data_t *ssn = (ssn_data_t*)p;
-    printf("SSN completed. %d packets\n", ssn->count);
-    delete ssn;
+    if(verbose)
+        printf("SSN completed. %d packets, %d replies\n", 
+            ssn->count[0], ssn->count[1]);
+    __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+}
+
+/////////////////////////
+// Workers
+//
+// The reader parses packets and hands each one to a worker through a single
+// producer, single consumer ring, like RSS spreading flows over NIC queues.
+
+// Packets in flight per worker
+#define RING_SIZE 4096
+// The reader publishes packets to a worker this many at a time
+#define RING_BATCH 32
+
+struct item_t {
+    bgh_key_t key;
+    int payload_size;
+    int dir;
+};
+
+// head is only written by the reader and tail only by the worker. Each is
+// kept on a line of its own
+struct ring_t {
+    uint32_t head;
+    char pad0[64 - sizeof(uint32_t)];
+    uint32_t tail;
+    char pad1[64 - sizeof(uint32_t)];
+    item_t items[RING_SIZE];
+};
+
+struct worker_t {
+    ring_t ring;
+    ctx_t ctx;
+    pthread_t thread;
+    // The reader's copies. Packets up to head are written but not yet 
+    // published, and tail is the last one seen from the worker
+    uint32_t head,
+             tail;
+    // Set once the reader has published its last packet
+    bool done;
+};
+
+struct pool_t {
+    std::vector<worker_t*> workers;
+    // Set if workers share this tracker, rather than each having their own
+    bgh_t *shared;
+};
+
+// Pick a worker by flow. Keys are already normalized, so both directions of
+// a session go to one worker
+static inline uint32_t flow_worker(const bgh_key_t *key, uint32_t n) {
+    uint64_t a = ((uint64_t)key->sip << 16) | key->sport;
+    uint64_t b = ((uint64_t)key->dip << 16) | key->dport;
+
+    uint64_t h = (a ^ (b * 0x9E3779B97F4A7C15ULL)) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+    return (uint32_t)(((h & 0xFFFFFFFF) * n) >> 32);
+}
+
+static inline void ring_publish(worker_t *w) {
+    __atomic_store_n(&w->ring.head, w->head, __ATOMIC_RELEASE);
+}
+
+void dispatch(pool_t *pool, bgh_key_t *key, int dir, int payload_size) {
+    worker_t *w = pool->workers[flow_worker(key, pool->workers.size())];
+
+    // Full. Wait for the worker to catch up
+    while(w->head - w->tail == RING_SIZE) {
+        ring_publish(w);
+        w->tail = __atomic_load_n(&w->ring.tail, __ATOMIC_ACQUIRE);
+        if(w->head - w->tail == RING_SIZE)
+            sched_yield();
+    }
+
+    item_t *item = &w->ring.items[w->head & (RING_SIZE - 1)];
+    item->key = *key;
+    item->payload_size = payload_size;
+    item->dir = dir;
+    if(!(++w->head % RING_BATCH))
+        ring_publish(w);
+}
+
+void *worker_main(void *arg) {
+    worker_t *w = (worker_t*)arg;
+    ring_t *ring = &w->ring;
+    uint32_t tail = 0;
+
+    while(1) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if(head == tail) {
+            // done is set after the last publish, so head is final once it
+            // has been seen
+            if(__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) &&
+               __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        for(; tail != head; tail++) {
+            item_t *item = &ring->items[tail & (RING_SIZE - 1)];
+            w->ctx.packets++;
+            process(&w->ctx, &item->key, item->dir, item->payload_size);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if(w->ctx.keys.size())
+        flush_burst(&w->ctx);
+    return NULL;
+}
+
+// Start n workers for the reader. Private trackers split the default 
+// table size between them, as the shards of a shared tracker do
+pool_t *pool_start(ctx_t *reader, uint32_t n, bool shared) {
+    pool_t *pool = new pool_t;
+
+    bgh_config_t config;
+    bgh_config_init(&config);
+    config.value_size = sizeof(ssn_data_t);
+    config.overload = overload;
+    pool->shared = shared ? bgh_sharded_new(n, &config, free_data_cb) : NULL;
+
+    config.starting_rows /= n;
+    config.min_rows /= n;
+    config.max_rows /= n;
+
+    for(uint32_t i=0; i<n; i++) {
+        worker_t *w = new worker_t;
+        w->ring.head = w->ring.tail = 0;
+        w->head = w->tail = 0;
+        w->done = false;
+
+        w->ctx.tracker = shared ? pool->shared : 
+            bgh_config_new(&config, free_data_cb);
+        w->ctx.pool = NULL;
+        w->ctx.burst = reader->burst;
+        w->ctx.packets = 0;
+        w->ctx.sessions = w->ctx.failed = 0;
+        w->ctx.sample_latency = reader->sample_latency;
+
+        if(!w->ctx.tracker) {
+            printf("Failed to allocate a tracker for worker %u\n", i);
+            exit(-1);
+        }
+        pool->workers.push_back(w);
+    }
+
+    for(uint32_t i=0; i<n; i++)
+        pthread_create(&pool->workers[i]->thread, NULL, 
+            worker_main, pool->workers[i]);
+
+    reader->pool = pool;
+    return pool;
+}
+
+// Hand over the last packets and wait for the workers to finish them
+void pool_stop(pool_t *pool) {
+    for(uint32_t i=0; i<pool->workers.size(); i++) {
+        worker_t *w = pool->workers[i];
+        ring_publish(w);
+        __atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+    }
+
+    for(uint32_t i=0; i<pool->workers.size(); i++)
+        pthread_join(pool->workers[i]->thread, NULL);
+}
+
+void pool_free(pool_t *pool) {
+    for(uint32_t i=0; i<pool->workers.size(); i++) {
+        worker_t *w = pool->workers[i];
+        if(!pool->shared)
+            bgh_free(w->ctx.tracker);
+        delete w;
+    }
+
+    if(pool->shared)
+        bgh_free(pool->shared);
+    delete pool;
+}
+
+// Finish whatever the reader still has queued
+void finish(ctx_t *ctx) {
+    if(ctx->pool)
+        pool_stop(ctx->pool);
+    else if(ctx->keys.size())
+        flush_burst(ctx);
+}
+
+/////////////////////////
+// Replay
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+struct pcap_file_hdr_t {
+    uint32_t magic;
+    uint16_t version_major,
+             version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs,
+             snaplen,
+             linktype;
+};
+
+struct pcap_rec_hdr_t {
+    uint32_t ts_sec,
+             ts_frac,
+             caplen,
+             len;
+};
+
+// The capture, mapped whole. Records are read in place
+struct capture_t {
+    const uint8_t *data;
+    size_t len;
+    // Written on a host of the other byte order
+    bool swapped;
+};
+
+static inline uint32_t cap32(const capture_t *cap, uint32_t v) {
+    return cap->swapped ? __builtin_bswap32(v) : v;
+}
+
+bool map_capture(const char *path, capture_t *cap) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(pcap_file_hdr_t)) {
+        printf("%s: not a pcap file\n", path);
+        close(fd);
+        return false;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    cap->data = (const uint8_t*)p;
+    cap->len = st.st_size;
+
+    const pcap_file_hdr_t *hdr = (const pcap_file_hdr_t*)cap->data;
+    uint32_t magic = hdr->magic;
+    cap->swapped = false;
+    if(magic == __builtin_bswap32(PCAP_MAGIC_US) || 
+       magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        cap->swapped = true;
+        magic = __builtin_bswap32(magic);
+    }
+
+    if(magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        printf("%s: not a pcap file. pcapng isn't supported\n", path);
+        munmap(p, cap->len);
+        return false;
+    }
+
+    if(cap32(cap, hdr->linktype) != PCAP_LINKTYPE_ETHERNET) {
+        printf("%s: only Ethernet captures are supported\n", path);
+        munmap(p, cap->len);
+        return false;
+    }
+
+    return true;
+}
+
+// One pass over the capture. Returns false if it ends in a truncated record
+bool replay_pass(ctx_t *ctx, const capture_t *cap, uint32_t mask) {
+    size_t off = sizeof(pcap_file_hdr_t);
+
+    while(off + sizeof(pcap_rec_hdr_t) <= cap->len) {
+        const pcap_rec_hdr_t *rec = (const pcap_rec_hdr_t*)(cap->data + off);
+        uint32_t caplen = cap32(cap, rec->caplen);
+        off += sizeof(pcap_rec_hdr_t);
+
+        if(caplen > cap->len - off)
+            return false;
+
+        handle_packet(ctx, cap->data + off, caplen, mask);
+        off += caplen;
+    }
+
+    return off == cap->len;
+}
+
+static uint32_t percentile(std::vector<uint32_t> &sorted, double pct) {
+    if(sorted.empty())
+        return 0;
+    size_t i = (size_t)(pct / 100 * (sorted.size() - 1));
+    return sorted[i];
+}
+
+// Throughput, table stats and latency, summed over the workers if there are
+// any
+void report(ctx_t *ctx, double secs) {
+    std::vector<ctx_t*> ctxs;
+    std::vector<bgh_t*> trackers;
+
+    if(ctx->pool) {
+        pool_t *pool = ctx->pool;
+        for(uint32_t i=0; i<pool->workers.size(); i++) {
+            ctxs.push_back(&pool->workers[i]->ctx);
+            if(!pool->shared)
+                trackers.push_back(pool->workers[i]->ctx.tracker);
+        }
+        if(pool->shared)
+            trackers.push_back(pool->shared);
+    }
+    else {
+        ctxs.push_back(ctx);
+        trackers.push_back(ctx->tracker);
+    }
+
+    uint64_t sessions = 0,
+             failed = 0;
+    std::vector<uint32_t> latency_ns;
+
+    for(uint32_t i=0; i<ctxs.size(); i++) {
+        sessions += ctxs[i]->sessions;
+        failed += ctxs[i]->failed;
+        latency_ns.insert(latency_ns.end(), 
+            ctxs[i]->latency_ns.begin(), ctxs[i]->latency_ns.end());
+    }
+
+    uint64_t rows = 0,
+             inserted = 0,
+             refresh_expired = 0,
+             probe_limit_hits = 0,
+             evicted = 0,
+             admission_refused = 0,
+             early_refreshes = 0,
+             hits = 0,
+             misses = 0,
+             probe_hist[BGH_PROBE_HIST] = {0};
+
+    for(uint32_t i=0; i<trackers.size(); i++) {
+        bgh_stats_t stats;
+        bgh_metrics_t metrics;
+        bgh_get_stats(trackers[i], &stats);
+        bgh_get_metrics(trackers[i], &metrics);
+
+        rows += stats.num_rows;
+        inserted += stats.inserted;
+        refresh_expired += stats.expired;
+        probe_limit_hits += stats.probe_limit_hits;
+        evicted += stats.evicted;
+        admission_refused += stats.refused;
+        early_refreshes += stats.overload_refreshes;
+        hits += metrics.counters.hits;
+        misses += metrics.counters.misses;
+        for(int j=0; j<BGH_PROBE_HIST; j++)
+            probe_hist[j] += metrics.counters.probe_hist[j];
+    }
+
+    printf("%llu packets in %f s: %.3f Mpps\n", 
+        (unsigned long long)ctx->packets, secs, ctx->packets / secs / 1e6);
+    printf("%llu new sessions: %.0f sessions/s. %llu refused, %llu expired\n",
+        (unsigned long long)sessions, sessions / secs,
+        (unsigned long long)failed, (unsigned long long)expired);
+
+    if(ctx->pool) {
+        printf("%u workers, %s\n", (uint32_t)ctxs.size(), 
+            ctx->pool->shared ? "one shared tracker" : "a tracker each");
+        for(uint32_t i=0; i<ctxs.size(); i++)
+            printf("  Worker %u: %llu packets, %llu new sessions\n", i,
+                (unsigned long long)ctxs[i]->packets, 
+                (unsigned long long)ctxs[i]->sessions);
+    }
+
+    printf("Table: %llu rows, %llu inserted, %llu expired by refreshes, "
+           "%llu probe limit hits\n",
+        (unsigned long long)rows, (unsigned long long)inserted,
+        (unsigned long long)refresh_expired, 
+        (unsigned long long)probe_limit_hits);
+    if(overload)
+        printf("Overload: %llu evicted, %llu refused admission, "
+               "%llu early refreshes\n",
+            (unsigned long long)evicted, (unsigned long long)admission_refused,
+            (unsigned long long)early_refreshes);
+    printf("Lookups: %llu hits, %llu misses. Probe groups:", 
+        (unsigned long long)hits, (unsigned long long)misses);
+    for(int i=0; i<BGH_PROBE_HIST; i++)
+        printf(" %d%s: %llu", i, i == BGH_PROBE_HIST - 1 ? "+" : "", 
+            (unsigned long long)probe_hist[i]);
+    printf("\n");
+
+    std::sort(latency_ns.begin(), latency_ns.end());
+    if(ctx->burst)
+        printf("Latency per burst of %u", ctx->burst);
+    else
+        printf("Latency per packet, 1 in %d sampled", LATENCY_SAMPLE);
+    printf(" (ns): p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+        percentile(latency_ns, 50), percentile(latency_ns, 90),
+        percentile(latency_ns, 99), percentile(latency_ns, 99.9),
+        latency_ns.empty() ? 0 : latency_ns.back());
+}
+
+int replay(ctx_t *ctx, const char *path, uint32_t loops) {
+    capture_t cap;
+    if(!map_capture(path, &cap))
+        return -1;
+
+    verbose = false;
+
+    uint64_t start = now_ns();
+
+    for(uint32_t loop=0; loop<loops; loop++) {
+        // Spread the passes over the whole address space
+        uint32_t mask = loop * 0x9E3779B9;
+        if(!replay_pass(ctx, &cap, mask) && !loop)
+            printf("Warning: %s ends in a truncated record\n", path);
+        if(!ctx->pool && ctx->keys.size())
+            flush_burst(ctx);
+    }
+    finish(ctx);
+
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("Replayed %s %u time(s)\n", path, loops);
+    report(ctx, secs);
+
+    munmap((void*)cap.data, cap.len);
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    if(argc < 2) {
+    ctx_t ctx;
+    ctx.tracker = NULL;
+    ctx.pool = NULL;
+    ctx.burst = 0;
+    ctx.packets = 0;
+    ctx.sessions = ctx.failed = 0;
+    ctx.sample_latency = false;
+
+    bool replaying = false,
+         shared = false;
+    uint32_t loops = 1,
+             workers = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:rl:w:so:")) != -1) {
+        switch(opt) {
+            case 'b':
+                ctx.burst = atoi(optarg);
+                break;
+            case 'r':
+                replaying = true;
+                break;
+            case 'l':
+                loops = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 's':
+                shared = true;
+                break;
+            case 'o':
+                if(!parse_overload(optarg, &overload)) {
+                    usage();
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    if(optind >= argc) {
         usage();
         return -1;
     }
 
-    bgh_t *tracker = bgh_new(free_data_cb);
+    const char *path = argv[optind];
+
+    // Replays sample latency. Workers have to know before they start
+    if(replaying)
+        ctx.sample_latency = true;
+
+    // With workers, the reader has no tracker of its own
+    if(workers)
+        pool_start(&ctx, workers, shared);
+    else {
+        bgh_config_t config;
+        bgh_config_init(&config);
+        config.value_size = sizeof(ssn_data_t);
+        config.overload = overload;
+        ctx.tracker = bgh_config_new(&config, free_data_cb);
+        if(!ctx.tracker) {
+            puts("Failed to allocate a tracker");
+            return -1;
+        }
+    }
+
+    if(replaying) {
+        int ret = replay(&ctx, path, loops ? loops : 1);
+        if(ctx.pool)
+            pool_free(ctx.pool);
+        else
+            bgh_free(ctx.tracker);
+        return ret;
+    }
 
     char errbuf[PCAP_ERRBUF_SIZE];
     pcap_t *ph;
 
-    if(!(ph = pcap_open_offline(argv[1], errbuf))) {
-        printf("Failed to open pcap file: %s: %s\n", argv[1], errbuf);
+    if(!(ph = pcap_open_offline(path, errbuf))) {
+        printf("Failed to open pcap file: %s: %s\n", path, errbuf);
         return -1;
     }
  
-    pcap_loop(ph, 0, pcap_cb, (u_char*)tracker);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pcap_loop(ph, 0, pcap_cb, (u_char*)&ctx);
+    finish(&ctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + 
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%llu packets in %f s (burst size %u)\n", 
+        (unsigned long long)ctx.packets, secs, ctx.burst);
 
-    bgh_free(tracker);
+    if(ctx.pool)
+        pool_free(ctx.pool);
+    else
+        bgh_free(ctx.tracker);
 
     pcap_close(ph);
 }
@@ -5,10 +5,13 @@
 #include <assert.h>
 #include <stdio.h>
 #include <sys/time.h>
-#include <map>
+#include <set>
 #include <list>
 #include <vector>
+#include <string>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include "../bgh/bgh.h"
 
 extern "C" {
@@ -20,12 +23,12 @@ bgh_stat_t bgh_insert_table(bgh_tbl_t *tbl, bgh_key_t *key, void *data);
 int64_t _lookup_idx(bgh_tbl_t *table, bgh_key_t *key);
 bgh_tbl_t 
     *bgh_new_tbl(uint64_t rows, uint64_t max_inserts, void (*free_cb)(void *));
-
-int prime_total();
-uint64_t prime_at_idx(int idx);
-int prime_nearest_idx(uint64_t val);
-uint64_t prime_larger_idx(int idx);
-uint64_t prime_smaller_idx(int idx);
+void bgh_free_table(bgh_tbl_t *tbl);
+void bgh_delete_from_table(bgh_tbl_t *table, bgh_key_t *key);
+uint64_t *_bgh_read_begin(bgh_t *ssns);
+void _bgh_read_end(uint64_t *ctr);
+void _bgh_synchronize(bgh_t *ssns);
+uint64_t _key_hash(uint64_t seed, bgh_key_t *key);
 }
 void free_cb(void *p) {
     free(p);
@@ -41,12 +44,12 @@ void assert_lookup_eq(bgh_tbl_t *t, bgh_key_t *key, const char *val) {
     int64_t idx = _lookup_idx(t, key);
 
     assert(idx >= 0);
-    assert_eq(t->rows[idx]->data, val);
+    assert_eq(t->rows[idx].data, val);
 }
 
 void assert_lookup_clear(bgh_tbl_t *t, bgh_key_t *key) {
     int64_t idx = _lookup_idx(t, key);
-    assert(idx < 0 || !t->rows[idx]->data);
+    assert(idx < 0 || !t->rows[idx].data);
 }
 
 void assert_refresh_within(bgh_t *b, int seconds) {
@@ -57,29 +60,6 @@ void assert_refresh_within(bgh_t *b, int seconds) {
     }
 }
 
-void primes_test() {
-    printf("%s\n", __func__);
-
-    // Limit
-    assert(prime_nearest_idx(0) == 0);
-    assert(prime_nearest_idx(50046) == 0);
-    assert(prime_nearest_idx(50047) == 0);
-    // Rounds up
-    assert(prime_nearest_idx(50048) == 1);
-    assert(prime_nearest_idx(100002) == 1);
-    assert(prime_nearest_idx(100004) == 2);
-
-    assert(prime_smaller_idx(0) == 50047);
-    assert(prime_smaller_idx(1) == 50047);
-    assert(prime_larger_idx(1) == 200003);
-
-    assert(prime_nearest_idx(16000000) == 26);
-    assert(prime_larger_idx(26) == 17000023);
-    assert(prime_larger_idx(31) == 20000003);
-    // Limit
-    assert(prime_larger_idx(32) == 20000003);
-}
-
 void basic() {
     printf("%s\n", __func__);
 
@@ -120,8 +100,18 @@ void basic() {
     key.sip = 30;
     assert_eq(bgh_lookup(tracker, &key), "baz");
 
+    // Same addresses and ports, but a different protocol or VLAN, is a 
+    // different session
+    key.proto = 17;
+    assert(!bgh_lookup(tracker, &key));
+    key.proto = 0;
+    key.vlan = 4095;
+    assert(!bgh_lookup(tracker, &key));
+    key.vlan = 5;
+
     // Swap source and IP, should get same session data
     bgh_key_t key2;
+    bzero(&key2, sizeof(key2)); 
     key2.dip = 30;
     key2.sip = 200;
     key2.dport = 3000;
@@ -233,7 +223,7 @@ void linear_probing() {
 
     bgh_config_t conf;
     bgh_config_init(&conf);
-    conf.starting_rows = 13;
+    conf.starting_rows = 16;
     conf.hash_full_pct = 100;
     conf.refresh_period = 0;
 
@@ -247,11 +237,19 @@ void linear_probing() {
     key1.dip = 200;
     key1.sport = 3000;
     key1.dport = 4000; 
-    // Same IPs, but diff ports, but def a hash collision
+    // Same IPs, diff ports. Search for ports that collide with key1 
+    // under this table's seed
     key2.sip = 10;
     key2.dip = 200;
-    key2.sport = 4000;
-    key2.dport = 3000; 
+
+    uint64_t seed = tracker->active->seed;
+    uint64_t mask = tracker->active->num_rows - 1;
+    assert(mask == 15);
+    uint64_t home = _key_hash(seed, &key1) & mask;
+    do {
+        key2.sport = (uint16_t)rand();
+        key2.dport = (uint16_t)rand();
+    } while((_key_hash(seed, &key2) & mask) != home);
 
     bgh_insert(tracker, &key1, (char*)"foo1");
     bgh_insert(tracker, &key2, (char*)"foo2");
@@ -259,7 +257,8 @@ void linear_probing() {
     int64_t idx1 = _lookup_idx(tracker->active, &key1);
     int64_t idx2 = _lookup_idx(tracker->active, &key2);
 
-    assert(idx1 == idx2-1);
+    assert((uint64_t)idx1 == home);
+    assert((uint64_t)idx2 == ((idx1 + 1) & mask));
 
     // Removed. No longer doing "hash healing" due to edge case and low value
     #if 0
@@ -273,92 +272,232 @@ void linear_probing() {
     bgh_free(tracker);
 }
 
-struct key_cmp {
-    bool operator()(const bgh_key_t &k1, const bgh_key_t &k2) const {
-        // Have to compare going both directions
-        if(((k1.sip == k2.sip &&
-            k1.sport == k2.sport &&
-            k1.dip == k2.dip && 
-            k1.dport == k2.dport)
-                ||
-           (k1.sip == k2.dip && 
-            k1.sport == k2.dport &&
-            k1.dip == k2.sip && 
-            k1.dport == k2.sport))
-                && 
-           k1.vlan == k2.vlan)
-            return 0;
+// The hash BGH used before, for comparison
+uint64_t xor_hash(bgh_key_t *key) {
+    uint64_t h = (uint64_t)(key->sip ^ key->dip) ^
+                  (uint64_t)(key->sport * key->dport);
+    h *= 1 + key->vlan;
+    return h;
+}
 
-        return memcmp((void*)&k1, (void*)&k2, sizeof(bgh_key_t)) < 0;
+// Bucket keys into nrows rows and report the fullest row, and the chi-square 
+// statistic against a uniform distribution, normalized so ~1.0 is uniform
+void bucket_stats(std::vector<uint64_t> &hashes, uint64_t nrows, 
+                  uint64_t *max_load, double *chi2) {
+    std::vector<uint32_t> counts(nrows, 0);
+    for(size_t i=0; i<hashes.size(); i++)
+        counts[hashes[i] & (nrows-1)]++;
+
+    double expected = (double)hashes.size() / nrows;
+    *max_load = 0;
+    *chi2 = 0;
+    for(uint64_t i=0; i<nrows; i++) {
+        if(counts[i] > *max_load)
+            *max_load = counts[i];
+        *chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
     }
-};
+    *chi2 /= nrows - 1;
+}
 
-void bench() {
-    printf("%s\n", __func__);
+void check_distribution(const char *name, std::vector<bgh_key_t> &keys) {
+    const uint64_t nrows = 1 << 16;
+    uint64_t seed = 0x5eed;
+    std::vector<uint64_t> old_h, new_h;
+    for(size_t i=0; i<keys.size(); i++) {
+        old_h.push_back(xor_hash(&keys[i]));
+        new_h.push_back(_key_hash(seed, &keys[i]));
+    }
 
-    bgh_t *tracker = bgh_new(nop_free_cb);
-    bgh_key_t keys[NUM_ITS];
-    memset(&keys, 0, sizeof(keys));
+    uint64_t old_max, new_max;
+    double old_chi, new_chi;
+    bucket_stats(old_h, nrows, &old_max, &old_chi);
+    bucket_stats(new_h, nrows, &new_max, &new_chi);
+
+    printf("\t%-22s old: max %6lu chi2 %10.2f  new: max %3lu chi2 %.2f\n",
+        name, old_max, old_chi, new_max, new_chi);
+
+    // With ~4 keys a row, uniform hashing puts around 15 in the fullest
+    assert(new_max < 32);
+    assert(new_chi < 1.5);
+
+    // Tags come from the top bits, and should be just as even
+    uint32_t tags[128] = {0};
+    for(size_t i=0; i<new_h.size(); i++)
+        tags[new_h[i] >> 57]++;
+    for(int i=0; i<128; i++)
+        assert(tags[i] > keys.size() / 128 / 2);
+}
+
+void distribution() {
+    printf("%s\n", __func__);
 
+    const int nkeys = 1 << 18;
+    std::vector<bgh_key_t> keys(nkeys);
     bgh_key_t key;
-    // Bzero'ing to clean up pad bytes and prevent valgrind from complaining
-    bzero(&key, sizeof(key)); 
+    bzero(&key, sizeof(key));
 
-    for(int i=0; i<NUM_ITS; i++) {
-        key.dip = rand();
-        key.sip = rand();
-        key.sport = (uint16_t)rand();
-        key.dport = (uint16_t)rand();
+    for(int i=0; i<nkeys; i++) {
         keys[i] = key;
+        keys[i].sip = rand();
+        keys[i].dip = rand();
+        keys[i].sport = (uint16_t)rand();
+        keys[i].dport = (uint16_t)rand();
     }
+    check_distribution("random", keys);
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = 1000000 * tv.tv_sec + tv.tv_usec;
+    // One host scanning every port on a range of hosts
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = key;
+        keys[i].sip = 0x0a000001;
+        keys[i].sport = 40000;
+        keys[i].dip = 0x0a010000 + (i >> 16);
+        keys[i].dport = i & 0xffff;
+    }
+    check_distribution("port scan", keys);
 
-    for(int i=0; i<NUM_ITS; i++) {
-        bgh_insert(tracker, &keys[i], (char*)"foo");
+    // Sweeping a subnet on a single port
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = key;
+        keys[i].sip = 0x0a000001;
+        keys[i].sport = 40000 + (i & 0xff);
+        keys[i].dip = 0xc0a80000 + i;
+        keys[i].dport = 80;
     }
+    check_distribution("subnet sweep", keys);
 
-    assert(tracker->active->collisions < 10);
+    // Many clients to one server, sequential ephemeral ports
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = key;
+        keys[i].sip = 0xac100000 + (i >> 12);
+        keys[i].sport = 32768 + (i & 0xfff);
+        keys[i].dip = 0x08080808;
+        keys[i].dport = 443;
+    }
+    check_distribution("clients to server", keys);
 
-    for(int i=0; i<NUM_ITS*100; i++) {
-        assert(bgh_lookup(tracker, &keys[i % NUM_ITS]));
+    // The same few sessions repeated over many VLANs
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = key;
+        keys[i].sip = 0x0a000001 + (i >> 8);
+        keys[i].sport = 5000;
+        keys[i].dip = 0x0a000002;
+        keys[i].dport = 6000;
+        keys[i].vlan = i & 0xff;
     }
+    check_distribution("vlans", keys);
 
-    for(int i=0; i<NUM_ITS; i++) 
-        bgh_clear(tracker, &keys[i]);
+    // Keys built to collide under XOR: same sip^dip, same sport*dport
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = key;
+        keys[i].sip = rand();
+        keys[i].dip = keys[i].sip ^ 0x12345678;
+        keys[i].sport = 1 << (i % 16);
+        keys[i].dport = 1 << (16 - i % 16);
+    }
+    check_distribution("xor adversarial", keys);
+}
 
-    gettimeofday(&tv, NULL);
-    uint64_t fin = 1000000 * tv.tv_sec + tv.tv_usec;
-    printf("%d inserts, deletes, and %d lookups: %f ms\n", 
-        NUM_ITS, NUM_ITS*100, float((fin - now))/1000);
+// Keys with random source addresses and ports that all land in the same
+// home row as key in table
+std::vector<bgh_key_t> craft_collisions(bgh_tbl_t *table, bgh_key_t *key, int n) {
+    uint64_t mask = table->num_rows - 1;
+    uint64_t home = _key_hash(table->seed, key) & mask;
+    std::vector<bgh_key_t> keys;
+
+    bgh_key_t k = *key;
+    while((int)keys.size() < n) {
+        k.sip = rand();
+        k.sport = (uint16_t)rand();
+        k.dport = (uint16_t)rand();
+        if((_key_hash(table->seed, &k) & mask) == home)
+            keys.push_back(k);
+    }
+    return keys;
+}
 
-    bgh_free(tracker);
+// Insert n keys crafted to collide, then time lookups for one more colliding
+// key that isn't in the table. Returns microseconds, best of 3
+uint64_t time_flood(uint64_t max_probe, int n) {
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 12;
+    conf.hash_full_pct = 100;
+    conf.refresh_period = 0;
+    conf.max_probe = max_probe;
 
-    /////////////////////////
-    // The STL map comparison
-    std::map<bgh_key_t, char *, key_cmp> tree;
-    gettimeofday(&tv, NULL);
-    now = 1000000 * tv.tv_sec + tv.tv_usec;
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-    for(int i=0; i<NUM_ITS; i++) {
-        tree[keys[i]] = (char*)"foo";
+    bgh_key_t key;
+    bzero(&key, sizeof(key));
+    key.dip = 0x0a000002;
+
+    std::vector<bgh_key_t> keys = craft_collisions(tracker->active, &key, n + 1);
+    bgh_key_t missing = keys.back();
+    keys.pop_back();
+
+    uint64_t dropped = 0;
+    for(int i=0; i<n; i++)
+        if(bgh_insert(tracker, &keys[i], (char*)"flood") == BGH_FULL)
+            dropped++;
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.probe_limit_hits == dropped);
+    assert(stats.inserted + dropped == (uint64_t)n);
+    if(max_probe)
+        // Rounded up to whole groups, wherever the home row sits in one
+        assert(stats.inserted <= max_probe + 32);
+
+    uint64_t best = ~0ULL;
+    for(int run=0; run<3; run++) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        uint64_t now = 1000000 * tv.tv_sec + tv.tv_usec;
+
+        for(int i=0; i<100000; i++)
+            assert(!bgh_lookup(tracker, &missing));
+
+        gettimeofday(&tv, NULL);
+        uint64_t fin = 1000000 * tv.tv_sec + tv.tv_usec;
+        if(fin - now < best)
+            best = fin - now;
     }
 
-    for(int i=0; i<NUM_ITS*100; i++) {
-        auto it = tree.find(keys[i % NUM_ITS]);
-        assert(it != tree.end());
-    }
+    printf("\t%d colliding keys, max probe %lu: %lu inserted, %lu dropped, "
+           "100000 lookups %f ms\n", 
+           n, max_probe, stats.inserted, dropped, float(best)/1000);
 
-    for(int i=0; i<NUM_ITS; i++) {
-        auto it = tree.find(keys[i]);
-        tree.erase(keys[i]);
-    }
+    bgh_free(tracker);
+    return best;
+}
 
-    gettimeofday(&tv, NULL);
-    fin = 1000000 * tv.tv_sec + tv.tv_usec;
-    printf("STL map: %f ms\n", float((fin - now))/1000);
+void flood() {
+    printf("%s\n", __func__);
+
+    // Lookup cost stays flat however many colliding keys are thrown at it
+    uint64_t small = time_flood(64, 256);
+    uint64_t large = time_flood(64, 2048);
+    uint64_t unbounded = time_flood(0, 2048);
+
+    assert(large < small * 3 + 1000);
+    assert(large < unbounded);
+
+    // Every table gets its own seed, so keys crafted against one table 
+    // scatter in the next
+    bgh_tbl_t *t1 = bgh_new_tbl(1 << 12, 1 << 12, nop_free_cb);
+    bgh_tbl_t *t2 = bgh_new_tbl(1 << 12, 1 << 12, nop_free_cb);
+    assert(t1->seed != t2->seed);
+
+    bgh_key_t key;
+    bzero(&key, sizeof(key));
+    std::vector<bgh_key_t> keys = craft_collisions(t1, &key, 256);
+    std::set<uint64_t> homes;
+    for(size_t i=0; i<keys.size(); i++)
+        homes.insert(_key_hash(t2->seed, &keys[i]) & (t2->num_rows - 1));
+    assert(homes.size() > 200);
+
+    bgh_free_table(t1);
+    bgh_free_table(t2);
 }
 
 void time_draining() {
@@ -366,13 +505,13 @@ void time_draining() {
 
     bgh_config_t conf;
     bgh_config_init(&conf);
-    conf.starting_rows = 10000141;
+    conf.starting_rows = 1 << 24;
     conf.timeout = 2;
     conf.refresh_period = 7;
 
     bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-    assert(tracker->active->num_rows == 10000141);
+    assert(tracker->active->num_rows == 1 << 24);
     bgh_key_t key;
     // Bzero'ing to clean up pad bytes and prevent valgrind from complaining
     bzero(&key, sizeof(key)); 
@@ -493,13 +632,14 @@ void resize() {
 
     bgh_config_t conf;
     bgh_config_init(&conf);
-    conf.starting_rows = 100003;
+    conf.starting_rows = 1 << 17;
     conf.refresh_period = 2;
     conf.timeout = 1;
 
     bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-    int nkeys = conf.starting_rows / 4;
+    // Past the default scale_up_pct, but short of hash_full_pct
+    int nkeys = conf.starting_rows * 7 / 10;
     bgh_key_t keys[nkeys];
     memset(&keys, 0, sizeof(keys));
 
@@ -515,157 +655,2220 @@ void resize() {
         keys[i] = key;
     }
 
-    assert(tracker->active->num_rows == 100003);
+    assert(tracker->active->num_rows == 1 << 17);
     for(int i=0; i<nkeys; i++) 
         bgh_insert(tracker, &keys[i], (char*)"foo");
 
     sleep(4);
-    assert(tracker->active->num_rows == 200003);
+    assert(tracker->active->num_rows == 1 << 18);
     sleep(4);
-    assert(tracker->active->num_rows <= 100003);
+    assert(tracker->active->num_rows <= 1 << 17);
 
     bgh_free(tracker);
 }
 
-std::vector<bgh_key_t> keys;
-
-bgh_key_t gen_rand_key() {
-    bgh_key_t key;
-    bzero(&key, sizeof(key));  // for valgrind
-    key.sport = (uint16_t)rand();
-    key.dport = (uint16_t)rand();
-    key.sip = rand();
-    key.dip = rand();
+bgh_key6_t make_key6(int host, uint16_t sport, uint16_t dport) {
+    bgh_key6_t key;
+    bzero(&key, sizeof(key));
+    // 2001:db8::host -> 2001:db8::1:1
+    key.sip[0] = key.dip[0] = 0x20;
+    key.sip[1] = key.dip[1] = 0x01;
+    key.sip[2] = key.dip[2] = 0x0d;
+    key.sip[3] = key.dip[3] = 0xb8;
+    key.sip[14] = host >> 8;
+    key.sip[15] = host;
+    key.dip[13] = key.dip[15] = 1;
+    key.sport = sport;
+    key.dport = dport;
+    key.proto = 6;
     return key;
 }
 
-bgh_key_t get_rand_key() {
-    return keys[rand() % keys.size()];
-}
+void ipv6() {
+    printf("%s\n", __func__);
 
-static int64_t inline nanos_total(struct timespec *start) {
-    static struct timespec end, ret;
-    clock_gettime(CLOCK_MONOTONIC, &end);
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.key_type = BGH_KEY_V6;
+    conf.starting_rows = 1 << 12;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 2;
+    conf.timeout = 1;
 
-    if ((end.tv_nsec - start->tv_nsec) < 0) {
-        ret.tv_sec = end.tv_sec - start->tv_sec - 1;
-        ret.tv_nsec = 1000000000 + end.tv_nsec - start->tv_nsec;
-    } else {
-        ret.tv_sec = end.tv_sec - start->tv_sec;
-        ret.tv_nsec = end.tv_nsec - start->tv_nsec;
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    assert(tracker->active->row_size == 64);
+
+    bgh_key6_t key = make_key6(1, 3000, 443);
+    assert(bgh_insert6(tracker, &key, strdup("foo")) == BGH_OK);
+    assert_eq(bgh_lookup6(tracker, &key), "foo");
+
+    // Either direction
+    bgh_key6_t rev = key;
+    memcpy(rev.sip, key.dip, 16);
+    memcpy(rev.dip, key.sip, 16);
+    rev.sport = key.dport;
+    rev.dport = key.sport;
+    assert_eq(bgh_lookup6(tracker, &rev), "foo");
+
+    // Protocol and zone are part of the key
+    rev.proto = 17;
+    assert(!bgh_lookup6(tracker, &rev));
+    rev.proto = 6;
+    rev.vlan = 100;
+    assert(!bgh_lookup6(tracker, &rev));
+
+    // One address byte off
+    bgh_key6_t other = key;
+    other.dip[0] ^= 0x80;
+    assert(!bgh_lookup6(tracker, &other));
+
+    // IPv4 calls on an IPv6 tracker are rejected
+    bgh_key_t key4;
+    bzero(&key4, sizeof(key4));
+    char *bad = strdup("bad");
+    assert(bgh_insert(tracker, &key4, bad) == BGH_EXCEPTION);
+    assert(!bgh_lookup(tracker, &key4));
+    free(bad);
+
+    // Bursts
+    const int nkeys = 500;
+    bgh_key6_t keys[nkeys];
+    void *data[nkeys];
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = make_key6(1000 + i, 40000 + i, 80);
+        data[i] = strdup("burst");
     }
+    assert(bgh_insert_burst6(tracker, keys, nkeys, data, NULL) == nkeys);
+    assert(bgh_lookup_burst6(tracker, keys, nkeys, data) == nkeys);
+    for(int i=0; i<nkeys; i++)
+        assert_eq(data[i], "burst");
 
-    return (uint64_t)ret.tv_sec * 1000000000L + ret.tv_nsec;
+    bgh_clear6(tracker, &keys[0]);
+    assert(!bgh_lookup6(tracker, &keys[0]));
+
+    // Sessions looked up during a refresh carry over to the new table, the
+    // rest time out
+    assert_refresh_within(tracker, 3);
+    assert_eq(bgh_lookup6(tracker, &key), "foo");
+    while(tracker->refreshing)
+        usleep(10000);
+
+    assert_eq(bgh_lookup6(tracker, &key), "foo");
+    assert(!bgh_lookup6(tracker, &keys[1]));
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == 1);
+
+    bgh_free(tracker);
 }
 
-void stress() {
-    puts("Starting long-running stress test");
+void *synchronize_thread(void *p) {
+    _bgh_synchronize((bgh_t*)p);
+    return NULL;
+}
+
+void grace_period() {
+    printf("%s\n", __func__);
 
     bgh_config_t conf;
     bgh_config_init(&conf);
-    conf.starting_rows = 3000017;
-    conf.timeout = 4;
-    conf.refresh_period = 8;
+    conf.starting_rows = 31;
+    conf.refresh_period = 0;
 
-    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-    for(int i=0; i<1024*512; i++) {
-        keys.push_back(gen_rand_key());
+    // A reader inside its read-side section holds up the grace period
+    uint64_t *rd = _bgh_read_begin(tracker);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, synchronize_thread, tracker);
+    usleep(100000);
+    assert(pthread_tryjoin_np(thread, NULL) != 0);
+
+    // Readers arriving after the epoch flip don't
+    uint64_t *rd2 = _bgh_read_begin(tracker);
+    _bgh_read_end(rd);
+    pthread_join(thread, NULL);
+    _bgh_read_end(rd2);
+
+    bgh_free(tracker);
+}
+
+// Published to epoch_reader threads. Retired objects are poisoned once
+// their grace period is over, which no reader may ever see
+#define EPOCH_LIVE 0x5afe
+static int *epoch_obj;
+
+struct epoch_worker_t {
+    bgh_t *tracker;
+    volatile bool *stop;
+    uint64_t reads;
+};
+
+void *epoch_reader(void *p) {
+    epoch_worker_t *w = (epoch_worker_t*)p;
+    while(!*w->stop) {
+        uint64_t *rd = _bgh_read_begin(w->tracker);
+        int *obj = __atomic_load_n(&epoch_obj, __ATOMIC_ACQUIRE);
+        for(int i=0; i<8; i++)
+            assert(__atomic_load_n(obj, __ATOMIC_RELAXED) == EPOCH_LIVE);
+        _bgh_read_end(rd);
+        w->reads++;
     }
+    return NULL;
+}
 
-    // Will arbitrarily restrict or grow the max number of sessions over time
-    int sessions_max = keys.size() / 2;
+void *epoch_flipper(void *p) {
+    epoch_worker_t *w = (epoch_worker_t*)p;
+    while(!*w->stop)
+        _bgh_synchronize(w->tracker);
+    return NULL;
+}
 
-    time_t last_out = 0,
-           last_state_change = 5,
-           start = time(NULL);
-    uint64_t failed_insert = 0,
-             lookup_total_time = 0,
-             lookup_count = 1, // hack to avoid /0 with first stat update
-             insert_total_time = 0,
-             insert_count = 1, // hack for first stat update
-             iteration = 0;
-    struct timespec tstart;
+void epoch_stress() {
+    printf("%s\n", __func__);
 
-    while(1) {
-        bgh_key_t key;
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 31;
+    conf.refresh_period = 0;
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-        time_t now = time(NULL);
-        if(now - last_out > 2) {
-            last_out = now;
+    // Readers entering while other threads move the epoch on as fast as 
+    // they can, as maintenance of many trackers would. A reader that 
+    // counted itself under a parity the epoch had already left would let a
+    // grace period end under it
+    epoch_obj = new int(EPOCH_LIVE);
+    volatile bool stop = false;
+    const int nreaders = 4, nflippers = 2;
+    pthread_t threads[nreaders + nflippers];
+    epoch_worker_t workers[nreaders + nflippers];
+    for(int i=0; i<nreaders + nflippers; i++) {
+        workers[i].tracker = tracker;
+        workers[i].stop = &stop;
+        workers[i].reads = 0;
+        pthread_create(&threads[i], NULL, 
+            i < nreaders ? epoch_reader : epoch_flipper, &workers[i]);
+    }
 
-            bgh_stats_t stats;
-            bgh_get_stats(tracker, &stats);
-            // print stats
-            printf("\n%lus, iteration %llu, - Simulating %d sessions\n",
-                    time(NULL) - start, iteration, sessions_max);
-            printf("- inserted:       %llu\n", stats.inserted);
-            printf("- collisions:     %llu\n", stats.collisions);
-            printf("- table size:     %llu\n", stats.num_rows);
-            printf("- in refresh:     %s\n", stats.in_refresh ? "yes" : "no");
-            printf("- failed inserts: %llu\n", failed_insert);
-            printf("- %% used:         %.1f\n", (float)stats.inserted / stats.num_rows * 100);
-            printf("- Lookup time avg: %llu ns\n", lookup_total_time/lookup_count);
-            printf("- Insert time avg: %llu ns\n", insert_total_time/insert_count);
+    std::vector<int*> retired;
+    time_t start = time(NULL);
+    while(time(NULL) - start < 2 && retired.size() < 200000) {
+        int *old = __atomic_exchange_n(&epoch_obj, new int(EPOCH_LIVE), 
+            __ATOMIC_SEQ_CST);
+        _bgh_synchronize(tracker);
+        *old = 0;
+        retired.push_back(old);
+    }
 
-            failed_insert = 0;
-            lookup_total_time = lookup_count = 0,
-            insert_total_time = insert_count  = 0;
-        }
+    stop = true;
+    for(int i=0; i<nreaders + nflippers; i++) {
+        pthread_join(threads[i], NULL);
+        if(i < nreaders)
+            assert(workers[i].reads);
+    }
+    printf("\t%lu objects retired\n", retired.size());
+    for(size_t i=0; i<retired.size(); i++)
+        delete retired[i];
+    delete epoch_obj;
+    bgh_free(tracker);
+}
 
-        if(now - last_state_change > 30) {
-            sessions_max = rand() % keys.size();
-            if(sessions_max < 100)
-                sessions_max = 100;
-            last_state_change = now;
+struct lookup_worker_t {
+    bgh_t *tracker;
+    bgh_key_t *keys;
+    int nkeys;
+    volatile bool *stop;
+    uint64_t hits;
+};
+
+void *lookup_worker(void *p) {
+    lookup_worker_t *w = (lookup_worker_t*)p;
+
+    for(int i=0; !*w->stop; i++) {
+        void *data = bgh_lookup(w->tracker, &w->keys[i % w->nkeys]);
+        // Sessions not looked up during the drain may time out, but we 
+        // must never see anything but the data we inserted
+        if(data) {
+            assert_eq(data, "foo");
+            w->hits++;
         }
+    }
+    return NULL;
+}
 
-        if(now - start > 60*5)
-            break;
+void lockless_lookups() {
+    printf("%s\n", __func__);
 
-        // New session
-        if(!(rand() % 10)) {
-            key = get_rand_key();
-            void *d = strdup("data");
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 100003;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
 
-            clock_gettime(CLOCK_MONOTONIC, &tstart);
-            if(bgh_insert(tracker, &key, d) != BGH_OK) {
-                failed_insert++;
-                free(d);
-            } 
-            else {
-                insert_total_time += nanos_total(&tstart);
-                insert_count++;
-            }
-        }
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
 
-        // Lookup
-        if(!(rand() % 2)) {
-            key = keys[rand() % keys.size()];
-            clock_gettime(CLOCK_MONOTONIC, &tstart);
-            bgh_lookup(tracker, &key);
-            lookup_total_time += nanos_total(&tstart);
-            lookup_count++;
-            // assert_eq(bgh_lookup(tracker, &key), "data");
-        }
+    bgh_key_t keys[NUM_ITS];
+    memset(&keys, 0, sizeof(keys));
 
-        // Clear
-        if(!(rand() % 20)) {
-            key = get_rand_key();
-            bgh_clear(tracker, &key);
-        }
+    for(int i=0; i<NUM_ITS; i++) {
+        keys[i].sip = rand();
+        keys[i].dip = rand();
+        keys[i].sport = (uint16_t)rand();
+        keys[i].dport = (uint16_t)rand();
+        bgh_insert(tracker, &keys[i], (char*)"foo");
+    }
 
-        // Replace a key. The old session will timeout
-        if(!(rand() % 20)) {
-            keys[rand() % sessions_max] = gen_rand_key();
-        }
+    // Readers on several threads while maintenance drains, swaps 
+    // and frees tables underneath them, and we keep writing
+    volatile bool stop = false;
+    const int nthreads = 4;
+    pthread_t threads[nthreads];
+    lookup_worker_t workers[nthreads];
+
+    for(int i=0; i<nthreads; i++) {
+        workers[i].tracker = tracker;
+        workers[i].keys = keys;
+        workers[i].nkeys = NUM_ITS;
+        workers[i].stop = &stop;
+        workers[i].hits = 0;
+        pthread_create(&threads[i], NULL, lookup_worker, &workers[i]);
+    }
 
-        iteration++;
+    bgh_key_t key;
+    bzero(&key, sizeof(key));
+    time_t start = time(NULL);
+    while(time(NULL) - start < 4) {
+        key.sip = rand() % 1024;
+        bgh_insert(tracker, &key, (char*)"foo");
+        key.sip = rand() % 1024;
+        bgh_clear(tracker, &key);
+    }
+
+    stop = true;
+    for(int i=0; i<nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        assert(workers[i].hits);
     }
 
     bgh_free(tracker);
 }
 
+void sharded() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 800000;
+    conf.refresh_period = 0;
+
+    bgh_t *tracker = bgh_sharded_new(8, &conf, free_cb);
+    assert(tracker->nshards == 8);
+
+    bgh_key_t keys[NUM_ITS];
+    memset(&keys, 0, sizeof(keys));
+
+    for(int i=0; i<NUM_ITS; i++) {
+        keys[i].sip = rand();
+        keys[i].dip = rand();
+        keys[i].sport = (uint16_t)rand();
+        keys[i].dport = (uint16_t)rand();
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d", i);
+        assert(bgh_insert(tracker, &keys[i], strdup(buf)) == BGH_OK);
+    }
+
+    // Sessions are spread over every shard
+    for(uint32_t i=0; i<tracker->nshards; i++)
+        assert(tracker->shards[i]->active->inserted > 0);
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == NUM_ITS);
+    assert(stats.num_rows >= conf.starting_rows);
+
+    for(int i=0; i<NUM_ITS; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d", i);
+        assert_eq(bgh_lookup(tracker, &keys[i]), buf);
+
+        // Reverse direction maps to the same shard
+        bgh_key_t rev;
+        bzero(&rev, sizeof(rev));
+        rev.sip = keys[i].dip;
+        rev.sport = keys[i].dport;
+        rev.dip = keys[i].sip;
+        rev.dport = keys[i].sport;
+        assert_eq(bgh_lookup(tracker, &rev), buf);
+    }
+
+    for(int i=0; i<NUM_ITS; i++)
+        bgh_clear(tracker, &keys[i]);
+
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == 0);
+
+    bgh_free(tracker);
+}
+
+struct insert_worker_t {
+    bgh_t *tracker;
+    bgh_key_t *keys;
+    int nkeys;
+};
+
+void *insert_worker(void *p) {
+    insert_worker_t *w = (insert_worker_t*)p;
+
+    for(int rep=0; rep<16; rep++) {
+        for(int i=0; i<w->nkeys; i++)
+            bgh_insert(w->tracker, &w->keys[i], (char*)"foo");
+        for(int i=0; i<w->nkeys; i++)
+            bgh_clear(w->tracker, &w->keys[i]);
+    }
+    return NULL;
+}
+
+double run_writers(bgh_t *tracker, int nthreads, bgh_key_t *keys, int nkeys) {
+    pthread_t threads[nthreads];
+    insert_worker_t workers[nthreads];
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    uint64_t now = 1000000 * tv.tv_sec + tv.tv_usec;
+
+    for(int i=0; i<nthreads; i++) {
+        workers[i].tracker = tracker;
+        workers[i].keys = keys + i * (nkeys / nthreads);
+        workers[i].nkeys = nkeys / nthreads;
+        pthread_create(&threads[i], NULL, insert_worker, &workers[i]);
+    }
+    for(int i=0; i<nthreads; i++) 
+        pthread_join(threads[i], NULL);
+
+    gettimeofday(&tv, NULL);
+    uint64_t fin = 1000000 * tv.tv_sec + tv.tv_usec;
+    return float((fin - now))/1000;
+}
+
+void sharded_writers() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1600000;
+    conf.refresh_period = 0;
+
+    const int nkeys = 64 * 1024, nthreads = 4;
+    std::vector<bgh_key_t> keys(nkeys);
+    for(int i=0; i<nkeys; i++) {
+        bzero(&keys[i], sizeof(keys[i]));
+        keys[i].sip = rand();
+        keys[i].dip = rand();
+        keys[i].sport = (uint16_t)rand();
+        keys[i].dport = (uint16_t)rand();
+    }
+
+    bgh_t *single = bgh_config_new(&conf, nop_free_cb);
+    printf("%d writers, 1 shard: %f ms\n", nthreads, 
+        run_writers(single, nthreads, keys.data(), nkeys));
+    bgh_stats_t stats;
+    bgh_get_stats(single, &stats);
+    assert(stats.inserted == 0);
+    bgh_free(single);
+
+    bgh_t *sharded = bgh_sharded_new(16, &conf, nop_free_cb);
+    printf("%d writers, 16 shards: %f ms\n", nthreads, 
+        run_writers(sharded, nthreads, keys.data(), nkeys));
+    bgh_get_stats(sharded, &stats);
+    assert(stats.inserted == 0);
+    bgh_free(sharded);
+}
+
+void burst() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.refresh_period = 0;
+
+    // More shards than a chunk has keys, so a chunk can touch a shard per key
+    bgh_t *trackers[] = {
+        bgh_config_new(&conf, nop_free_cb),
+        bgh_sharded_new(4, &conf, nop_free_cb),
+        bgh_sharded_new(4 * BGH_BURST_MAX, &conf, nop_free_cb)
+    };
+
+    const int nkeys = 256 * 1024;
+    std::vector<bgh_key_t> keys(nkeys);
+    std::vector<void *> data(nkeys), out(nkeys);
+    std::vector<bgh_stat_t> results(nkeys);
+    static char vals[nkeys];
+
+    for(int i=0; i<nkeys; i++) {
+        bzero(&keys[i], sizeof(keys[i]));
+        keys[i].sip = rand();
+        keys[i].dip = rand();
+        keys[i].sport = (uint16_t)rand();
+        keys[i].dport = (uint16_t)rand();
+        data[i] = &vals[i];
+    }
+
+    for(bgh_t *tracker : trackers) {
+        // Only insert every other key, so half the lookups miss
+        std::vector<bgh_key_t> ins;
+        std::vector<void *> ins_data;
+        for(int i=0; i<nkeys; i+=2) {
+            ins.push_back(keys[i]);
+            ins_data.push_back(data[i]);
+        }
+        // Include a NULL, which is rejected like bgh_insert does
+        ins_data[7] = NULL;
+        assert(bgh_insert_burst(tracker, ins.data(), ins.size(), 
+            ins_data.data(), results.data()) == ins.size() - 1);
+        assert(results[7] == BGH_EXCEPTION);
+        assert(results[8] == BGH_OK);
+
+        // Odd sized, to cover a partial final chunk
+        uint32_t n = nkeys - 5;
+        uint32_t found = bgh_lookup_burst(tracker, keys.data(), n, out.data());
+        assert(found == (n+1)/2 - 1);
+
+        for(uint32_t i=0; i<n; i++) {
+            assert(out[i] == bgh_lookup(tracker, &keys[i]));
+            assert(out[i] == ((i % 2 || i == 14) ? NULL : data[i]));
+        }
+    }
+
+    // Bursts during a drain move sessions into the standby table
+    bgh_t *tracker = trackers[0];
+    uint64_t inserted = tracker->active->inserted;
+    tracker->standby = bgh_new_tbl(tracker->active->num_rows, 
+        tracker->active->max_inserts, nop_free_cb);
+    tracker->refreshing = true;
+
+    assert(bgh_lookup_burst(tracker, keys.data(), 1024, out.data()) == 511);
+    assert(tracker->standby->inserted == 511);
+    assert(tracker->active->inserted == inserted - 511);
+    for(int i=0; i<1024; i++) 
+        assert(out[i] == ((i % 2 || i == 14) ? NULL : data[i]));
+
+    tracker->refreshing = false;
+    bgh_free_table(tracker->standby);
+    tracker->standby = NULL;
+
+    // Bursts vs one at a time, in a random order over a table much larger 
+    // than cache
+    std::vector<bgh_key_t> order(nkeys);
+    for(int i=0; i<nkeys; i++)
+        order[i] = keys[rand() % nkeys];
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = 1000000 * tv.tv_sec + tv.tv_usec;
+
+    for(int i=0; i<nkeys; i+=32)
+        bgh_lookup_burst(tracker, &order[i], 32, &out[i]);
+
+    gettimeofday(&tv, NULL);
+    uint64_t fin = 1000000 * tv.tv_sec + tv.tv_usec;
+    printf("%d lookups in bursts of 32: %f ms\n", nkeys, float((fin - now))/1000);
+
+    now = fin;
+    for(int i=0; i<nkeys; i++)
+        out[i] = bgh_lookup(tracker, &order[i]);
+
+    gettimeofday(&tv, NULL);
+    fin = 1000000 * tv.tv_sec + tv.tv_usec;
+    printf("%d single lookups: %f ms\n", nkeys, float((fin - now))/1000);
+
+    for(bgh_t *t : trackers)
+        bgh_free(t);
+}
+
+std::vector<bgh_key_t> keys;
+
+bgh_key_t gen_rand_key() {
+    bgh_key_t key;
+    bzero(&key, sizeof(key));  // for valgrind
+    key.sport = (uint16_t)rand();
+    key.dport = (uint16_t)rand();
+    key.sip = rand();
+    key.dip = rand();
+    return key;
+}
+
+bgh_key_t get_rand_key() {
+    return keys[rand() % keys.size()];
+}
+
+void churn() {
+    printf("%s\n", __func__);
+
+    // Keep a small table about a third full while constantly replacing 
+    // sessions, so probes have to get past lots of deleted rows
+    const int nrows = 4099, nlive = nrows / 3;
+    bgh_tbl_t *tbl = bgh_new_tbl(nrows, nrows, nop_free_cb);
+
+    std::vector<bgh_key_t> live(nlive);
+    for(int i=0; i<nlive; i++) {
+        live[i] = gen_rand_key();
+        assert(bgh_insert_table(tbl, &live[i], (void*)&live[i]) == BGH_OK);
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = 1000000 * tv.tv_sec + tv.tv_usec;
+
+    for(int round=0; round<200; round++) {
+        for(int i=0; i<nlive; i+=7) {
+            int64_t idx = _lookup_idx(tbl, &live[i]);
+            assert(tbl->rows[idx].data == &live[i]);
+
+            bgh_delete_from_table(tbl, &live[i]);
+            assert_lookup_clear(tbl, &live[i]);
+
+            live[i] = gen_rand_key();
+            assert(bgh_insert_table(tbl, &live[i], (void*)&live[i]) == BGH_OK);
+        }
+
+        for(int i=0; i<nlive; i++) {
+            int64_t idx = _lookup_idx(tbl, &live[i]);
+            assert(idx >= 0 && tbl->rows[idx].data == &live[i]);
+        }
+    }
+
+    gettimeofday(&tv, NULL);
+    uint64_t fin = 1000000 * tv.tv_sec + tv.tv_usec;
+    printf("Churned lookups, deletes and inserts: %f ms\n", float((fin - now))/1000);
+
+    // Deletes that no probe depends on leave empty rows rather than 
+    // tombstones, and inserts reuse the tombstones there are. Without that 
+    // every free row eventually becomes a tombstone
+    assert(tbl->inserted == nlive);
+    printf("Tombstones: %llu\n", (unsigned long long)tbl->tombstones);
+    assert(tbl->tombstones < (nrows - nlive) * 3 / 4);
+
+    bgh_free_table(tbl);
+}
+
+void load_factor() {
+    printf("%s\n", __func__);
+
+    // Filled to the default limit, with the default probe bound, nearly 
+    // every key still goes in within a group or so of its home row
+    const uint64_t nrows = 1 << 16, 
+                   nkeys = nrows * BGH_DEFAULT_HASH_FULL_PCT / 100;
+    bgh_tbl_t *tbl = bgh_new_tbl(nrows, nrows, nop_free_cb);
+    tbl->max_probe = BGH_DEFAULT_MAX_PROBE;
+
+    std::vector<bgh_key_t> keys(nkeys);
+    std::vector<bool> in(nkeys);
+    for(uint64_t i=0; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        in[i] = bgh_insert_table(tbl, &keys[i], (void*)&keys[i]) == BGH_OK;
+    }
+    printf("\tProbe limit hits: %llu, mean distance %.2f rows, %.1f bytes a session\n",
+        (unsigned long long)tbl->probe_limit_hits, 
+        (double)tbl->collisions / tbl->inserted,
+        (double)(sizeof(bgh_row_t) + 1) * nrows / tbl->inserted);
+    assert(tbl->probe_limit_hits < nkeys / 1000);
+    assert(tbl->collisions < tbl->inserted * 4);
+    for(uint64_t i=0; i<nkeys; i++) {
+        if(in[i])
+            assert(tbl->rows[_lookup_idx(tbl, &keys[i])].data == &keys[i]);
+    }
+    bgh_free_table(tbl);
+
+    // Churn in a tracker kept near its limit leaves deleted rows behind. 
+    // Before they fill the table, a refresh is asked for to clear them
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 12;
+    conf.refresh_period = 3600;
+    conf.manual_maintenance = true;
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
+
+    const int nlive = (1 << 12) * 7 / 10;
+    std::vector<bgh_key_t> live(nlive);
+    for(int i=0; i<nlive; i++) {
+        live[i] = gen_rand_key();
+        assert(bgh_insert(tracker, &live[i], (void*)&live[i]) == BGH_OK);
+    }
+
+    int replaced = 0;
+    while(!tracker->overloaded) {
+        assert(replaced < 1000000);
+        int i = rand() % nlive;
+        bgh_clear(tracker, &live[i]);
+        live[i] = gen_rand_key();
+        assert(bgh_insert(tracker, &live[i], (void*)&live[i]) == BGH_OK);
+        replaced++;
+    }
+    printf("\tRefresh asked for after %d replaced, %llu tombstones\n", 
+        replaced, (unsigned long long)tracker->active->tombstones);
+    for(int i=0; i<nlive; i++)
+        assert(bgh_lookup(tracker, &live[i]) == &live[i]);
+
+    bgh_maintain(tracker, bgh_now_ms(), 0);
+    assert(tracker->refreshing && tracker->standby->tombstones == 0);
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.overload_refreshes == 1);
+    bgh_free(tracker);
+}
+
+uint64_t batch_freed = 0, batch_calls = 0;
+
+void count_batch_cb(void **data, uint32_t n) {
+    assert(n > 0 && n <= BGH_TEARDOWN_BATCH);
+    for(uint32_t i=0; i<n; i++)
+        assert_eq(data[i], "expire");
+    batch_freed += n;
+    batch_calls++;
+}
+
+void teardown() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 16;
+    conf.hash_full_pct = 50;
+    conf.scale_up_pct = 0;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.teardown_rows = 1024;
+    conf.teardown_pause_us = 100;
+    conf.free_batch_cb = count_batch_cb;
+
+    bgh_t *tracker = bgh_config_new(&conf, nop_free_cb);
+
+    const int nkeys = 5000;
+    for(int i=0; i<nkeys; i++) {
+        bgh_key_t key = gen_rand_key();
+        assert(bgh_insert(tracker, &key, (char*)"expire") == BGH_OK);
+    }
+
+    // Nothing is looked up, so everything expires with the first refresh
+    time_t start = time(NULL);
+    bgh_stats_t stats;
+    do {
+        usleep(10000);
+        bgh_get_stats(tracker, &stats);
+        assert(time(NULL) - start < 10);
+    } while(stats.expired < nkeys);
+
+    assert(stats.expired == nkeys);
+    assert(batch_freed == nkeys);
+    assert(batch_calls >= nkeys / BGH_TEARDOWN_BATCH);
+
+    // At least one slice per teardown_rows rows
+    uint64_t slices = 0;
+    printf("\tSlice durations:");
+    for(int i=0; i<BGH_TEARDOWN_HIST; i++) {
+        slices += stats.teardown_hist[i];
+        if(stats.teardown_hist[i])
+            printf(" <%dus: %lu", 1 << i, stats.teardown_hist[i]);
+    }
+    printf("\n");
+    assert(slices >= (1 << 16) / 1024);
+
+    bgh_free(tracker);
+}
+
+// Threads in this process
+int count_threads() {
+    FILE *f = fopen("/proc/self/status", "r");
+    assert(f);
+    char line[256];
+    int n = -1;
+    while(fgets(line, sizeof(line), f)) {
+        if(!strncmp(line, "Threads:", 8))
+            n = atoi(line + 8);
+    }
+    fclose(f);
+    return n;
+}
+
+void shared_maintenance() {
+    printf("%s\n", __func__);
+
+    int before = count_threads();
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 10;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+
+    // Every tracker is maintained by one thread, which goes away with the 
+    // last of them
+    const int ntrackers = 16;
+    bgh_t *trackers[ntrackers];
+    bgh_key_t keys[ntrackers];
+    for(int i=0; i<ntrackers; i++) {
+        trackers[i] = bgh_config_new(&conf, free_cb);
+        keys[i] = gen_rand_key();
+        assert(bgh_insert(trackers[i], &keys[i], strdup("shared")) == BGH_OK);
+    }
+    assert(count_threads() == before + 1);
+
+    // Each keeps its own refresh cycle. Keeping the sessions alive, every 
+    // tracker should get through a couple of refreshes
+    std::set<uint64_t> seeds[ntrackers];
+    time_t start = time(NULL);
+    bool done = false;
+    while(!done) {
+        assert(time(NULL) - start < 15);
+        done = true;
+        for(int i=0; i<ntrackers; i++) {
+            assert_eq(bgh_lookup(trackers[i], &keys[i]), "shared");
+            bgh_tbl_t *active = 
+                __atomic_load_n(&trackers[i]->active, __ATOMIC_SEQ_CST);
+            seeds[i].insert(active->seed);
+            if(seeds[i].size() < 3)
+                done = false;
+        }
+        usleep(10000);
+    }
+
+    for(int i=0; i<ntrackers; i++)
+        bgh_free(trackers[i]);
+    assert(count_threads() == before);
+}
+
+void manual_maintenance() {
+    printf("%s\n", __func__);
+
+    int before = count_threads();
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 14;
+    conf.refresh_period = 2;
+    conf.timeout = 1;
+    conf.teardown_pause_us = 0;
+    conf.manual_maintenance = true;
+
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    assert(count_threads() == before);
+
+    const int nkeys = 100;
+    bgh_key_t keys[nkeys];
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        assert(bgh_insert(tracker, &keys[i], strdup("manual")) == BGH_OK);
+    }
+
+    // Nothing happens unless we say so, and only at the times we give
+    uint64_t t0 = bgh_now_ms();
+    sleep(1);
+    assert(!tracker->refreshing);
+    uint64_t wait = bgh_maintain(tracker, t0 + 1000, 0);
+    assert(!tracker->refreshing);
+    assert(wait > 0 && wait <= 1000000);
+
+    bgh_maintain(tracker, t0 + 2000, 0);
+    assert(tracker->refreshing);
+
+    // Keep one session through the refresh
+    assert_eq(bgh_lookup(tracker, &keys[0]), "manual");
+
+    // Once the timeout has passed, the old table is torn down a budget's 
+    // worth of rows per call
+    uint64_t now = t0 + 3000;
+    const uint64_t budget = 1024;
+    bgh_stats_t stats;
+    int calls = 0;
+    do {
+        assert(++calls < 1000);
+        uint64_t hist = 0;
+        bgh_get_stats(tracker, &stats);
+        for(int i=0; i<BGH_TEARDOWN_HIST; i++)
+            hist += stats.teardown_hist[i];
+
+        bgh_maintain(tracker, now, budget);
+
+        // At most one slice per call, and then only as many rows as allowed
+        bgh_get_stats(tracker, &stats);
+        uint64_t after = 0;
+        for(int i=0; i<BGH_TEARDOWN_HIST; i++)
+            after += stats.teardown_hist[i];
+        assert(after - hist <= 1);
+    } while(tracker->maint != BGH_MAINT_IDLE);
+
+    assert(!tracker->refreshing);
+    assert(calls >= (1 << 14) / budget);
+    assert(stats.expired == nkeys - 1);
+    assert_eq(bgh_lookup(tracker, &keys[0]), "manual");
+    assert(!bgh_lookup(tracker, &keys[1]));
+
+    // Trackers with the maintenance thread ignore it
+    bgh_free(tracker);
+    conf.manual_maintenance = false;
+    tracker = bgh_config_new(&conf, free_cb);
+    assert(bgh_maintain(tracker, 0, 0) == UINT64_MAX);
+    bgh_free(tracker);
+}
+
+struct metrics_worker_t {
+    bgh_t *tracker;
+    bgh_key_t *keys;
+    int nkeys;
+};
+
+void *metrics_worker(void *p) {
+    metrics_worker_t *w = (metrics_worker_t*)p;
+    for(int i=0; i<w->nkeys; i++)
+        assert_eq(bgh_lookup(w->tracker, &w->keys[i]), "metrics");
+    return NULL;
+}
+
+uint64_t probe_total(bgh_metrics_t *m) {
+    uint64_t n = 0;
+    for(int i=0; i<BGH_PROBE_HIST; i++)
+        n += m->counters.probe_hist[i];
+    return n;
+}
+
+void metrics() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 12;
+    conf.hash_full_pct = 50;
+    conf.scale_up_pct = 0;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+
+    for(int sharded=0; sharded<2; sharded++) {
+        bgh_t *tracker = sharded ? 
+            bgh_sharded_new(4, &conf, free_cb) : bgh_config_new(&conf, free_cb);
+        uint64_t t0 = bgh_now_ms();
+
+        const int nkeys = 1000;
+        bgh_key_t keys[nkeys];
+        for(int i=0; i<nkeys; i++) {
+            keys[i] = gen_rand_key();
+            assert(bgh_insert(tracker, &keys[i], strdup("metrics")) == BGH_OK);
+        }
+
+        // Hits from several threads, misses and a burst from this one
+        pthread_t threads[4];
+        metrics_worker_t w = { tracker, keys, nkeys };
+        for(int i=0; i<4; i++)
+            pthread_create(&threads[i], NULL, metrics_worker, &w);
+        for(int i=0; i<4; i++)
+            pthread_join(threads[i], NULL);
+
+        for(int i=0; i<100; i++) {
+            bgh_key_t miss = gen_rand_key();
+            assert(!bgh_lookup(tracker, &miss));
+        }
+
+        void *data[64];
+        assert(bgh_lookup_burst(tracker, keys, 64, data) == 64);
+
+        bgh_metrics_t m;
+        bgh_get_metrics(tracker, &m);
+        assert(m.counters.lookups == 4 * nkeys + 100 + 64);
+        assert(m.counters.hits == 4 * nkeys + 64);
+        assert(m.counters.misses == 100);
+        assert(m.counters.inserts == nkeys);
+        assert(m.counters.full == 0);
+        assert(m.counters.moved == 0);
+        assert(probe_total(&m) == m.counters.lookups);
+        assert(m.active_inserted == nkeys);
+        assert(m.active_rows == 1 << 12);
+        assert(!m.in_refresh && !m.standby_rows);
+
+        // During a refresh, lookups move sessions into standby
+        bgh_maintain(tracker, t0 + 1000, 0);
+        for(int i=0; i<nkeys/2; i++)
+            assert_eq(bgh_lookup(tracker, &keys[i]), "metrics");
+
+        bgh_get_metrics(tracker, &m);
+        assert(m.in_refresh);
+        assert(m.counters.moved == nkeys/2);
+        assert(m.standby_inserted == nkeys/2);
+        assert(m.active_inserted == nkeys - nkeys/2);
+        assert(m.standby_rows == 1 << 12);
+        // Both tables are probed for sessions still in active
+        assert(probe_total(&m) > m.counters.lookups);
+
+        // Fill up the table past hash_full_pct
+        int full = 0;
+        for(int i=0; i<(1 << 12); i++) {
+            bgh_key_t key = gen_rand_key();
+            if(bgh_insert(tracker, &key, strdup("metrics")) == BGH_FULL)
+                full++;
+        }
+        bgh_get_metrics(tracker, &m);
+        assert(full > 0);
+        assert(m.counters.full == (uint64_t)full);
+        assert(m.counters.inserts == nkeys + (1 << 12) - full);
+
+        bgh_free(tracker);
+    }
+}
+
+// Wait until at least n sessions have been expired by idle timeouts
+void wait_idle_expired(bgh_t *tracker, uint64_t n, int ms, bgh_key_t *keep) {
+    bgh_stats_t stats;
+    for(int waited = 0; ; waited += 10) {
+        assert(waited < ms);
+        if(keep)
+            assert_eq(bgh_lookup(tracker, keep), "keep");
+        bgh_get_stats(tracker, &stats);
+        if(stats.idle_expired >= n)
+            break;
+        usleep(10000);
+    }
+    assert(stats.idle_expired == n);
+}
+
+void idle_timeouts() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 16;
+    // No refreshes, so only the wheel expires anything
+    conf.refresh_period = 0;
+    conf.tick_ms = 20;
+    conf.class_timeout_ms[0] = 600;
+    conf.class_timeout_ms[1] = 100;
+
+    for(int sharded=0; sharded<2; sharded++) {
+        bgh_t *tracker = sharded ? 
+            bgh_sharded_new(4, &conf, free_cb) : bgh_config_new(&conf, free_cb);
+
+        bgh_key_t keep = gen_rand_key(), idle = gen_rand_key(), 
+                  fast = gen_rand_key();
+        assert(bgh_insert(tracker, &keep, strdup("keep")) == BGH_OK);
+        assert(bgh_insert(tracker, &idle, strdup("idle")) == BGH_OK);
+        assert(bgh_insert(tracker, &fast, strdup("fast")) == BGH_OK);
+
+        // Overwriting doesn't schedule a second timer
+        assert(bgh_insert(tracker, &idle, strdup("idle")) == BGH_OK);
+
+        // Class 1 expires well before class 0
+        bgh_set_class(tracker, &fast, 1);
+        wait_idle_expired(tracker, 1, 400, &keep);
+        assert(!bgh_lookup(tracker, &fast));
+        assert_eq(bgh_lookup(tracker, &idle), "idle");
+
+        // That lookup keeps idle around for another timeout. Then it goes, 
+        // but keep, looked up all along, doesn't
+        wait_idle_expired(tracker, 2, 1500, &keep);
+        assert(!bgh_lookup(tracker, &idle));
+        assert_eq(bgh_lookup(tracker, &keep), "keep");
+
+        bgh_stats_t stats;
+        bgh_get_stats(tracker, &stats);
+        assert(stats.expired == 2);
+        assert(stats.inserted == 1);
+
+        bgh_free(tracker);
+    }
+}
+
+void deferred_expiry() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 12;
+    conf.refresh_period = 0;
+    conf.tick_ms = 20;
+    conf.class_timeout_ms[0] = 100;
+    conf.manual_maintenance = true;
+
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    uint64_t t0 = bgh_now_ms();
+    bgh_key_t key = gen_rand_key();
+    assert(bgh_insert(tracker, &key, strdup("deferred")) == BGH_OK);
+
+    // A reader that could still see the session doesn't hold up 
+    // maintenance, only the handover
+    uint64_t *rd = _bgh_read_begin(tracker);
+    bgh_maintain(tracker, t0 + 1000, 0);
+    assert(!bgh_lookup(tracker, &key));
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.expired == 0 && stats.idle_expired == 0);
+    _bgh_read_end(rd);
+
+    bgh_maintain(tracker, t0 + 1100, 0);
+    bgh_get_stats(tracker, &stats);
+    assert(stats.expired == 1 && stats.idle_expired == 1);
+    bgh_free(tracker);
+
+    // Trackers share a maintenance thread. One held up by a reader doesn't
+    // stop the others expiring
+    conf.manual_maintenance = false;
+    bgh_t *held = bgh_config_new(&conf, free_cb),
+          *other = bgh_config_new(&conf, free_cb);
+    bgh_key_t a = gen_rand_key(), b = gen_rand_key();
+    assert(bgh_insert(held, &a, strdup("held")) == BGH_OK);
+    assert(bgh_insert(other, &b, strdup("other")) == BGH_OK);
+
+    rd = _bgh_read_begin(held);
+    wait_idle_expired(other, 1, 1000, NULL);
+    bgh_get_stats(held, &stats);
+    assert(stats.idle_expired == 0);
+    _bgh_read_end(rd);
+    wait_idle_expired(held, 1, 1000, NULL);
+
+    bgh_free(held);
+    bgh_free(other);
+}
+
+void table_pool() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    // One size throughout, so every table fits the pool
+    conf.starting_rows = conf.min_rows = 1 << 14;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.teardown_pause_us = 0;
+    // Falls back to THP, or regular pages, if none are reserved
+    conf.hugepages = BGH_HUGEPAGES_HUGETLB;
+
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+
+    bgh_key_t key = gen_rand_key();
+    assert(bgh_insert(tracker, &key, strdup("pooled")) == BGH_OK);
+
+    // Watch a few refreshes, keeping the session alive
+    std::set<bgh_tbl_t*> tables;
+    std::set<uint64_t> seeds;
+    int swaps = 0;
+    bgh_tbl_t *last = tracker->active;
+    time_t start = time(NULL);
+
+    while(swaps < 3) {
+        assert(time(NULL) - start < 15);
+        assert_eq(bgh_lookup(tracker, &key), "pooled");
+
+        bgh_tbl_t *active = __atomic_load_n(&tracker->active, __ATOMIC_SEQ_CST);
+        if(active != last) {
+            swaps++;
+            tables.insert(active);
+            seeds.insert(active->seed);
+            last = active;
+        }
+        usleep(10000);
+    }
+
+    // After the first refresh, tables just alternate between the pool and 
+    // active, each time with a new seed
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.tables_allocated == 2);
+    assert(stats.alloc_failures == 0);
+    assert(tables.size() == 2);
+    assert(seeds.size() == 3);
+
+    bgh_free(tracker);
+}
+
+static int64_t inline nanos_total(struct timespec *start) {
+    static struct timespec end, ret;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if ((end.tv_nsec - start->tv_nsec) < 0) {
+        ret.tv_sec = end.tv_sec - start->tv_sec - 1;
+        ret.tv_nsec = 1000000000 + end.tv_nsec - start->tv_nsec;
+    } else {
+        ret.tv_sec = end.tv_sec - start->tv_sec;
+        ret.tv_nsec = end.tv_nsec - start->tv_nsec;
+    }
+
+    return (uint64_t)ret.tv_sec * 1000000000L + ret.tv_nsec;
+}
+
+void stress() {
+    puts("Starting long-running stress test");
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 3000017;
+    conf.timeout = 4;
+    conf.refresh_period = 8;
+
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+
+    for(int i=0; i<1024*512; i++) {
+        keys.push_back(gen_rand_key());
+    }
+
+    // Will arbitrarily restrict or grow the max number of sessions over time
+    int sessions_max = keys.size() / 2;
+
+    time_t last_out = 0,
+           last_state_change = 5,
+           start = time(NULL);
+    uint64_t failed_insert = 0,
+             lookup_total_time = 0,
+             lookup_count = 1, // hack to avoid /0 with first stat update
+             insert_total_time = 0,
+             insert_count = 1, // hack for first stat update
+             iteration = 0;
+    struct timespec tstart;
+
+    while(1) {
+        bgh_key_t key;
+
+        time_t now = time(NULL);
+        if(now - last_out > 2) {
+            last_out = now;
+
+            bgh_stats_t stats;
+            bgh_get_stats(tracker, &stats);
+            // print stats
+            printf("\n%lus, iteration %llu, - Simulating %d sessions\n",
+                    time(NULL) - start, iteration, sessions_max);
+            printf("- inserted:       %llu\n", stats.inserted);
+            printf("- collisions:     %llu\n", stats.collisions);
+            printf("- table size:     %llu\n", stats.num_rows);
+            printf("- in refresh:     %s\n", stats.in_refresh ? "yes" : "no");
+            printf("- failed inserts: %llu\n", failed_insert);
+            printf("- %% used:         %.1f\n", (float)stats.inserted / stats.num_rows * 100);
+            printf("- Lookup time avg: %llu ns\n", lookup_total_time/lookup_count);
+            printf("- Insert time avg: %llu ns\n", insert_total_time/insert_count);
+
+            failed_insert = 0;
+            lookup_total_time = lookup_count = 0,
+            insert_total_time = insert_count  = 0;
+        }
+
+        if(now - last_state_change > 30) {
+            sessions_max = rand() % keys.size();
+            if(sessions_max < 100)
+                sessions_max = 100;
+            last_state_change = now;
+        }
+
+        if(now - start > 60*5)
+            break;
+
+        // New session
+        if(!(rand() % 10)) {
+            key = get_rand_key();
+            void *d = strdup("data");
+
+            clock_gettime(CLOCK_MONOTONIC, &tstart);
+            if(bgh_insert(tracker, &key, d) != BGH_OK) {
+                failed_insert++;
+                free(d);
+            } 
+            else {
+                insert_total_time += nanos_total(&tstart);
+                insert_count++;
+            }
+        }
+
+        // Lookup
+        if(!(rand() % 2)) {
+            key = keys[rand() % keys.size()];
+            clock_gettime(CLOCK_MONOTONIC, &tstart);
+            bgh_lookup(tracker, &key);
+            lookup_total_time += nanos_total(&tstart);
+            lookup_count++;
+            // assert_eq(bgh_lookup(tracker, &key), "data");
+        }
+
+        // Clear
+        if(!(rand() % 20)) {
+            key = get_rand_key();
+            bgh_clear(tracker, &key);
+        }
+
+        // Replace a key. The old session will timeout
+        if(!(rand() % 20)) {
+            keys[rand() % sessions_max] = gen_rand_key();
+        }
+
+        iteration++;
+    }
+
+    bgh_free(tracker);
+}
+
+int32_t snapshot_serialize(void *data, void *buf, uint32_t len) {
+    // Leave out sessions marked to skip
+    if(!strcmp((char*)data, "skip"))
+        return -1;
+
+    size_t n = strlen((char*)data);
+    assert(n <= len);
+    memcpy(buf, data, n);
+    return n;
+}
+
+void *snapshot_deserialize(const void *buf, uint32_t len) {
+    return strndup((const char*)buf, len);
+}
+
+uint8_t row_class(bgh_t *tracker, bgh_key_t *key) {
+    bgh_tbl_t *tbl = tracker->active;
+    int64_t idx = _lookup_idx(tbl, key);
+    assert(idx >= 0);
+    bgh_row_t *row = (bgh_row_t*)((char*)tbl->rows + idx * tbl->row_size);
+    return (row->seen >> 24) & 0x7F;
+}
+
+void snapshot() {
+    printf("%s\n", __func__);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_bgh_snapshot.%d", getpid());
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 14;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    uint64_t t0 = bgh_now_ms();
+
+    const int nkeys = 1000;
+    std::vector<bgh_key_t> keys(nkeys);
+    std::vector<std::string> values(nkeys);
+    for(int i=0; i<nkeys/2; i++) {
+        keys[i] = gen_rand_key();
+        values[i] = "ssn-" + std::to_string(i);
+        assert(bgh_insert(tracker, &keys[i], strdup(values[i].c_str())) == BGH_OK);
+    }
+    for(int i=0; i<10; i++)
+        bgh_set_class(tracker, &keys[i], 3);
+
+    // Mid refresh: some sessions have moved to standby, and new ones go 
+    // straight there
+    bgh_maintain(tracker, t0 + 1000, 0);
+    assert(tracker->refreshing);
+    for(int i=0; i<nkeys/4; i++)
+        assert(!strcmp((char*)bgh_lookup(tracker, &keys[i]), values[i].c_str()));
+    for(int i=nkeys/2; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        values[i] = "ssn-" + std::to_string(i);
+        assert(bgh_insert(tracker, &keys[i], strdup(values[i].c_str())) == BGH_OK);
+    }
+
+    bgh_key_t skipped = gen_rand_key();
+    assert(bgh_insert(tracker, &skipped, strdup("skip")) == BGH_OK);
+
+    uint64_t saved = 0;
+    assert(bgh_snapshot(tracker, path, snapshot_serialize, &saved) == BGH_OK);
+    assert(saved == nkeys);
+    bgh_free(tracker);
+
+    // Into a plain tracker and a sharded one
+    for(int sharded=0; sharded<2; sharded++) {
+        tracker = sharded ? 
+            bgh_sharded_new(4, &conf, free_cb) : bgh_config_new(&conf, free_cb);
+
+        uint64_t restored = 0;
+        assert(bgh_restore(tracker, path, snapshot_deserialize, &restored) == BGH_OK);
+        assert(restored == nkeys);
+
+        bgh_stats_t stats;
+        bgh_get_stats(tracker, &stats);
+        assert(stats.inserted == nkeys);
+
+        for(int i=0; i<nkeys; i++)
+            assert(!strcmp((char*)bgh_lookup(tracker, &keys[i]), values[i].c_str()));
+        assert(!bgh_lookup(tracker, &skipped));
+
+        if(!sharded) {
+            for(int i=0; i<nkeys; i++)
+                assert(row_class(tracker, &keys[i]) == (i < 10 ? 3 : 0));
+        }
+        bgh_free(tracker);
+    }
+
+    // Too small to hold them all. The rest are freed
+    bgh_config_t small = conf;
+    small.starting_rows = small.max_rows = 256;
+    tracker = bgh_config_new(&small, free_cb);
+    uint64_t restored = 0;
+    assert(bgh_restore(tracker, path, snapshot_deserialize, &restored) == BGH_FULL);
+    assert(restored > 0 && restored < nkeys);
+    bgh_free(tracker);
+
+    // The wrong key type, a missing file, and a truncated one
+    bgh_config_t v6 = conf;
+    v6.key_type = BGH_KEY_V6;
+    tracker = bgh_config_new(&v6, free_cb);
+    assert(bgh_restore(tracker, path, snapshot_deserialize, NULL) == BGH_EXCEPTION);
+    bgh_free(tracker);
+
+    tracker = bgh_config_new(&conf, free_cb);
+    assert(bgh_restore(tracker, "/nonexistent/snapshot", 
+        snapshot_deserialize, NULL) == BGH_EXCEPTION);
+
+    FILE *f = fopen(path, "r+");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    assert(!ftruncate(fileno(f), ftell(f) - 1));
+    fclose(f);
+    assert(bgh_restore(tracker, path, snapshot_deserialize, &restored) == BGH_EXCEPTION);
+    assert(restored == 0);
+    bgh_free(tracker);
+
+    unlink(path);
+}
+
+struct restore_value_t {
+    uint64_t id, 
+             packets;
+};
+
+int32_t restore_serialize(void *data, void *buf, uint32_t len) {
+    assert(len >= sizeof(restore_value_t));
+    memcpy(buf, data, sizeof(restore_value_t));
+    return sizeof(restore_value_t);
+}
+
+// Hands back the same buffer every time, which bgh_restore copies from
+void *restore_deserialize(const void *buf, uint32_t len) {
+    static restore_value_t value;
+    assert(len == sizeof(value));
+    memcpy(&value, buf, sizeof(value));
+    return &value;
+}
+
+void snapshot_inline() {
+    printf("%s\n", __func__);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_bgh_snapshot_inline.%d", getpid());
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = 1 << 19;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 0;
+    conf.value_size = sizeof(restore_value_t);
+
+    bgh_t *tracker = bgh_config_new(&conf, NULL);
+    const int nkeys = 200000;
+    std::vector<bgh_key_t> keys(nkeys);
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        restore_value_t value = { (uint64_t)i, (uint64_t)i * 3 };
+        assert(bgh_insert(tracker, &keys[i], &value) == BGH_OK);
+        if(i % 7 == 0)
+            bgh_set_class(tracker, &keys[i], 2);
+    }
+
+    uint64_t saved = 0;
+    assert(bgh_snapshot(tracker, path, restore_serialize, &saved) == BGH_OK);
+    assert(saved == nkeys);
+    bgh_free(tracker);
+
+    tracker = bgh_config_new(&conf, NULL);
+    // Sessions already there are overwritten, and take the saved class
+    for(int i=0; i<10; i++) {
+        restore_value_t stale = { 0, 0 };
+        assert(bgh_insert(tracker, &keys[i], &stale) == BGH_OK);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t restored = 0;
+    assert(bgh_restore(tracker, path, restore_deserialize, &restored) == BGH_OK);
+    int64_t ns = nanos_total(&start);
+    assert(restored == nkeys);
+    printf("\tRestored %d inline values in %.1f ms, %.0f ns each\n", 
+        nkeys, ns / 1e6, (double)ns / nkeys);
+    // Loose, bursts keep this well under a microsecond a session
+    assert(ns < (int64_t)nkeys * 5000);
+
+    for(int i=0; i<nkeys; i++) {
+        restore_value_t *value = (restore_value_t*)bgh_lookup(tracker, &keys[i]);
+        assert(value && value->id == (uint64_t)i);
+        assert(value->packets == (uint64_t)i * 3);
+        assert(row_class(tracker, &keys[i]) == (i % 7 == 0 ? 2 : 0));
+    }
+    bgh_free(tracker);
+
+    unlink(path);
+}
+
+struct shm_value_t {
+    uint64_t id, 
+             packets;
+};
+
+// Look every session up from a reader attached to the region
+void shm_check(const char *name, std::vector<bgh_key_t> &keys) {
+    bgh_shm_reader_t *reader = bgh_shm_open(name);
+    assert(reader);
+
+    for(size_t i=0; i<keys.size(); i++) {
+        const shm_value_t *v = 
+            (const shm_value_t*)bgh_shm_lookup(reader, &keys[i]);
+        assert(v && v->id == i && v->packets == i * 10);
+    }
+
+    bgh_key_t missing = gen_rand_key();
+    assert(!bgh_shm_lookup(reader, &missing));
+    bgh_key6_t key6;
+    memset(&key6, 0, sizeof(key6));
+    assert(!bgh_shm_lookup6(reader, &key6));
+
+    bgh_shm_close(reader);
+}
+
+void shared_memory() {
+    printf("%s\n", __func__);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/test_bgh_shm.%d", getpid());
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 14;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+    conf.shm_name = name;
+    conf.value_size = sizeof(shm_value_t);
+
+    // Regions need inline values, and only hold one tracker
+    bgh_config_t bad = conf;
+    bad.value_size = 0;
+    assert(!bgh_config_new(&bad, NULL));
+    assert(!bgh_sharded_new(2, &conf, NULL));
+
+    assert(!bgh_shm_open(name));
+    bgh_t *tracker = bgh_config_new(&conf, NULL);
+    assert(tracker);
+    uint64_t t0 = bgh_now_ms();
+
+    const int nkeys = 1000;
+    std::vector<bgh_key_t> keys(nkeys);
+    for(int i=0; i<nkeys/2; i++) {
+        keys[i] = gen_rand_key();
+        shm_value_t v = { (uint64_t)i, (uint64_t)i * 10 };
+        assert(bgh_insert(tracker, &keys[i], &v) == BGH_OK);
+    }
+
+    // The writer gets a pointer to the value in the row
+    shm_value_t *v = (shm_value_t*)bgh_lookup(tracker, &keys[0]);
+    assert(v && v->id == 0 && v->packets == 0);
+    bgh_shm_reader_t *reader = bgh_shm_open(name);
+    assert(bgh_shm_lookup(reader, &keys[0]) == 
+        (char*)reader->hdr + ((char*)v - (char*)tracker->shm->hdr));
+    bgh_shm_close(reader);
+
+    std::vector<bgh_key_t> inserted(keys.begin(), keys.begin() + nkeys/2);
+    shm_check(name, inserted);
+
+    // Mid refresh, with sessions in both tables
+    bgh_maintain(tracker, t0 + 1000, 0);
+    assert(tracker->refreshing);
+    for(int i=0; i<nkeys/4; i++)
+        assert(((shm_value_t*)bgh_lookup(tracker, &keys[i]))->id == (uint64_t)i);
+    for(int i=nkeys/2; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        shm_value_t v = { (uint64_t)i, (uint64_t)i * 10 };
+        assert(bgh_insert(tracker, &keys[i], &v) == BGH_OK);
+    }
+    shm_check(name, keys);
+
+    // From another process too
+    pid_t pid = fork();
+    if(!pid) {
+        shm_check(name, keys);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    // A reader process in the middle of a lookup holds up the old table's 
+    // teardown, just like a thread of ours would
+    reader = bgh_shm_open(name);
+    uint64_t *rd = &reader->hdr->readers[0].active[reader->hdr->epoch & 1];
+    __atomic_fetch_add(rd, 1, __ATOMIC_SEQ_CST);
+
+    // Keep the sessions still in active through the swap
+    for(int i=nkeys/4; i<nkeys/2; i++)
+        assert(bgh_lookup(tracker, &keys[i]));
+
+    bgh_maintain(tracker, t0 + 2000, 0);
+    for(int i=0; i<10; i++)
+        bgh_maintain(tracker, t0 + 2000, 0);
+    assert(tracker->maint == BGH_MAINT_GRACE);
+
+    // Then the old table's slot is reused by the next refresh, which is 
+    // already due
+    __atomic_fetch_sub(rd, 1, __ATOMIC_SEQ_CST);
+    for(int i=0; i<100 && (tracker->maint == BGH_MAINT_GRACE || 
+                           tracker->maint == BGH_MAINT_TEARDOWN); i++)
+        bgh_maintain(tracker, t0 + 2000, 0);
+    assert(!tracker->retired);
+    assert(tracker->refreshing);
+    shm_check(name, keys);
+
+    // Updates in place are seen by readers
+    v = (shm_value_t*)bgh_lookup(tracker, &keys[1]);
+    v->packets = 11;
+    assert(((const shm_value_t*)bgh_shm_lookup(reader, &keys[1]))->packets == 11);
+    v->packets = 10;
+
+    // Cleared sessions are gone for readers
+    bgh_clear(tracker, &keys[0]);
+    assert(!bgh_shm_lookup(reader, &keys[0]));
+
+    // Once the writer is gone, nothing is found, and the name is free for 
+    // the next writer
+    bgh_free(tracker);
+    assert(!bgh_shm_lookup(reader, &keys[1]));
+    bgh_shm_close(reader);
+    assert(!bgh_shm_open(name));
+}
+
+static uint64_t inline_freed = 0;
+
+// Gets the value in the row, which isn't ours to free
+void inline_free_cb(void *p) {
+    assert(((shm_value_t*)p)->id != 0xdead);
+    inline_freed++;
+}
+
+void inline_values() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 12;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+    conf.value_size = sizeof(shm_value_t);
+
+    // Only for trackers with a value_size, and keys of their type
+    bgh_t *plain = bgh_new(nop_free_cb);
+    bgh_key_t key = gen_rand_key();
+    assert(!bgh_lookup_or_insert(plain, &key));
+    bgh_free(plain);
+
+    bgh_t *tracker = bgh_config_new(&conf, inline_free_cb);
+    assert(tracker);
+    bgh_key6_t key6;
+    memset(&key6, 0, sizeof(key6));
+    assert(!bgh_lookup_or_insert6(tracker, &key6));
+    uint64_t t0 = bgh_now_ms();
+
+    // New sessions start zeroed, and the same row comes back after
+    const int nkeys = 500;
+    std::vector<bgh_key_t> keys(nkeys);
+    std::vector<shm_value_t*> vals(nkeys);
+    for(int i=0; i<nkeys; i++) {
+        keys[i] = gen_rand_key();
+        vals[i] = (shm_value_t*)bgh_lookup_or_insert(tracker, &keys[i]);
+        assert(vals[i] && vals[i]->id == 0 && vals[i]->packets == 0);
+        vals[i]->id = i + 1;
+    }
+    for(int i=0; i<nkeys; i++) {
+        assert(bgh_lookup_or_insert(tracker, &keys[i]) == vals[i]);
+        assert(bgh_lookup(tracker, &keys[i]) == vals[i]);
+        vals[i]->packets++;
+    }
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == (uint64_t)nkeys);
+
+    // bgh_insert copies the value in, and overwrites in place
+    shm_value_t v = { 1000, 7 };
+    assert(bgh_insert(tracker, &keys[0], &v) == BGH_OK);
+    assert(inline_freed == 1);
+    v.id = 0xdead;
+    assert(bgh_lookup(tracker, &keys[0]) == vals[0]);
+    assert(vals[0]->id == 1000 && vals[0]->packets == 7);
+
+    // During a refresh, values are copied into the new table as sessions 
+    // are looked up, and lookups return the copy
+    bgh_maintain(tracker, t0 + 1000, 0);
+    assert(tracker->refreshing);
+    for(int i=1; i<nkeys/2; i++) {
+        shm_value_t *moved = (shm_value_t*)bgh_lookup_or_insert(tracker, &keys[i]);
+        assert(moved && moved != vals[i]);
+        assert(moved->id == (uint64_t)i + 1 && moved->packets == 1);
+        vals[i] = moved;
+    }
+    bgh_key_t fresh = gen_rand_key();
+    shm_value_t *f = (shm_value_t*)bgh_lookup_or_insert(tracker, &fresh);
+    assert(f && f->id == 0 && f->packets == 0);
+    f->id = 1;
+    assert(bgh_lookup(tracker, &fresh) == f);
+    assert(inline_freed == 1);
+
+    // Whatever wasn't looked up is expired along with the old table
+    for(int i=0; i<100 && tracker->refreshing; i++)
+        bgh_maintain(tracker, t0 + 2000, 0);
+    for(int i=0; i<100 && tracker->maint != BGH_MAINT_IDLE && 
+                       tracker->maint != BGH_MAINT_DRAINING; i++)
+        bgh_maintain(tracker, t0 + 2000, 0);
+    assert(inline_freed == 1 + nkeys - nkeys/2 + 1);
+    for(int i=1; i<nkeys/2; i++) {
+        shm_value_t *p = (shm_value_t*)bgh_lookup(tracker, &keys[i]);
+        assert(p && p->id == (uint64_t)i + 1);
+    }
+    assert(!bgh_lookup(tracker, &keys[0]));
+
+    bgh_clear(tracker, &fresh);
+    assert(inline_freed == 1 + nkeys - nkeys/2 + 2);
+    assert(!bgh_lookup(tracker, &fresh));
+    bgh_free(tracker);
+
+    // Sharded, and with IPv6 keys
+    conf.key_type = BGH_KEY_V6;
+    conf.manual_maintenance = false;
+    tracker = bgh_sharded_new(4, &conf, NULL);
+    assert(tracker);
+    for(int i=0; i<nkeys; i++) {
+        key6.sport = i;
+        shm_value_t *p = (shm_value_t*)bgh_lookup_or_insert6(tracker, &key6);
+        assert(p && !p->id);
+        p->id = i + 1;
+    }
+    for(int i=0; i<nkeys; i++) {
+        key6.sport = i;
+        shm_value_t *p = (shm_value_t*)bgh_lookup6(tracker, &key6);
+        assert(p && p->id == (uint64_t)i + 1);
+    }
+    bgh_free(tracker);
+}
+
+static int creates = 0;
+
+// Makes a copy of the string in ctx, or fills in an inline value's id 
+// from it. Declines to create anything for "none"
+void *create_cb(void *value, void *ctx) {
+    creates++;
+    if(!strcmp((char*)ctx, "none"))
+        return NULL;
+    if(value) {
+        ((shm_value_t*)value)->id = strlen((char*)ctx);
+        return value;
+    }
+    return strdup((char*)ctx);
+}
+
+struct find_worker_t {
+    bgh_t *tracker;
+    std::vector<bgh_key_t> *keys;
+    int created;
+};
+
+void *find_worker(void *p) {
+    find_worker_t *w = (find_worker_t*)p;
+    w->created = 0;
+    for(size_t i=0; i<w->keys->size(); i++) {
+        bool created;
+        shm_value_t *v = (shm_value_t*)bgh_find_or_insert(
+            w->tracker, &(*w->keys)[i], create_cb, (void*)"abc", &created);
+        assert(v && v->id == 3);
+        __atomic_add_fetch(&v->packets, 1, __ATOMIC_RELAXED);
+        w->created += created;
+    }
+    return NULL;
+}
+
+void find_or_insert() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 12;
+    conf.hash_full_pct = 50;
+    conf.refresh_period = 1;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+
+    // Data made by create_cb, only for new sessions
+    bgh_t *tracker = bgh_config_new(&conf, free_cb);
+    bgh_key_t key = gen_rand_key();
+    bool created;
+    assert(!bgh_find_or_insert(tracker, &key, NULL, NULL, &created));
+    assert(!created);
+    assert(!bgh_find_or_insert(tracker, &key, create_cb, (void*)"none", &created));
+    assert(!created && creates == 1 && !bgh_lookup(tracker, &key));
+
+    assert_eq(bgh_find_or_insert(tracker, &key, create_cb, (void*)"first", &created), 
+        "first");
+    assert(created && creates == 2);
+    assert_eq(bgh_find_or_insert(tracker, &key, create_cb, (void*)"again", &created), 
+        "first");
+    assert(!created && creates == 2);
+    assert_eq(bgh_find_or_insert(tracker, &key, create_cb, (void*)"again", NULL), 
+        "first");
+
+    bgh_key6_t key6;
+    memset(&key6, 0, sizeof(key6));
+    assert(!bgh_find_or_insert6(tracker, &key6, create_cb, (void*)"v6", &created));
+    assert(creates == 2);
+
+    // During a refresh, sessions left in the draining table move rather 
+    // than being created again, and new ones go in the new table
+    uint64_t t0 = bgh_now_ms();
+    bgh_maintain(tracker, t0 + 1000, 0);
+    assert(tracker->refreshing);
+    bgh_metrics_t metrics;
+    bgh_get_metrics(tracker, &metrics);
+    uint64_t moved = metrics.counters.moved;
+    assert_eq(bgh_find_or_insert(tracker, &key, create_cb, (void*)"again", &created), 
+        "first");
+    assert(!created && creates == 2);
+    assert_lookup_clear(tracker->active, &key);
+    assert_lookup_eq(tracker->standby, &key, "first");
+    bgh_get_metrics(tracker, &metrics);
+    assert(metrics.counters.moved == moved + 1);
+
+    bgh_key_t key2 = gen_rand_key();
+    assert_eq(bgh_find_or_insert(tracker, &key2, create_cb, (void*)"second", &created), 
+        "second");
+    assert(created && creates == 3);
+    assert_lookup_eq(tracker->standby, &key2, "second");
+    bgh_free(tracker);
+
+    // Full tables refuse new sessions, without calling create_cb
+    conf.starting_rows = conf.min_rows = conf.max_rows = 64;
+    conf.hash_full_pct = 100;
+    conf.max_probe = 16;
+    tracker = bgh_config_new(&conf, free_cb);
+    int refused = 0;
+    for(int i=0; i<200; i++) {
+        key = gen_rand_key();
+        int before = creates;
+        if(!bgh_find_or_insert(tracker, &key, create_cb, (void*)"x", &created)) {
+            assert(!created && creates == before);
+            refused++;
+        }
+    }
+    assert(refused);
+    bgh_get_metrics(tracker, &metrics);
+    assert(metrics.counters.full == (uint64_t)refused);
+    bgh_free(tracker);
+
+    // Inline values, with threads racing to create the same sessions. Each
+    // is created once, and they all see the value create_cb filled in
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 16;
+    conf.hash_full_pct = 50;
+    conf.max_probe = BGH_DEFAULT_MAX_PROBE;
+    conf.value_size = sizeof(shm_value_t);
+    conf.manual_maintenance = false;
+    conf.refresh_period = 0;
+    tracker = bgh_sharded_new(2, &conf, NULL);
+
+    const int nkeys = 10000, nthreads = 4;
+    std::vector<bgh_key_t> keys(nkeys);
+    for(int i=0; i<nkeys; i++)
+        keys[i] = gen_rand_key();
+
+    pthread_t threads[nthreads];
+    find_worker_t workers[nthreads];
+    for(int i=0; i<nthreads; i++) {
+        workers[i].tracker = tracker;
+        workers[i].keys = &keys;
+        pthread_create(&threads[i], NULL, find_worker, &workers[i]);
+    }
+    int total = 0;
+    for(int i=0; i<nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += workers[i].created;
+    }
+    assert(total == nkeys);
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == (uint64_t)nkeys);
+    for(int i=0; i<nkeys; i++) {
+        shm_value_t *v = (shm_value_t*)bgh_lookup(tracker, &keys[i]);
+        assert(v && v->id == 3 && v->packets == (uint64_t)nthreads);
+    }
+    bgh_free(tracker);
+}
+
+void normalized_keys() {
+    printf("%s\n", __func__);
+
+    // Padding as the caller left it, which normalizing clears
+    bgh_key_t fwd;
+    memset(&fwd, 0xff, sizeof(fwd));
+    fwd.sip = 10; fwd.sport = 1000;
+    fwd.dip = 20; fwd.dport = 80;
+    fwd.vlan = 3; fwd.proto = 6;
+
+    bgh_key_t rev = fwd;
+    rev.sip = fwd.dip; rev.sport = fwd.dport;
+    rev.dip = fwd.sip; rev.dport = fwd.sport;
+
+    bgh_key_t a = fwd, b = rev;
+    int dir = bgh_key_normalize(&a);
+    assert(bgh_key_normalize(&b) == !dir);
+    assert(!memcmp(&a, &b, sizeof(a)));
+    assert(a.vlan == 3 && a.proto == 6);
+    assert(((uint8_t*)&a)[sizeof(a) - 1] == 0);
+    assert(bgh_key_normalize(&b) == 0);
+
+    // Same address, different ports
+    bgh_key_t same = fwd, same_rev = fwd;
+    same.dip = same.sip;
+    same_rev.dip = same_rev.sip;
+    same_rev.sport = same.dport;
+    same_rev.dport = same.sport;
+    assert(bgh_key_normalize(&same) != bgh_key_normalize(&same_rev));
+    assert(!memcmp(&same, &same_rev, sizeof(same)));
+
+    bgh_key6_t f6, r6;
+    memset(&f6, 0xff, sizeof(f6));
+    memset(f6.sip, 1, 16);
+    memset(f6.dip, 0, 16);
+    f6.sport = 1; f6.dport = 2; f6.vlan = 0; f6.proto = 17;
+    r6 = f6;
+    memcpy(r6.sip, f6.dip, 16);
+    memcpy(r6.dip, f6.sip, 16);
+    r6.sport = f6.dport; r6.dport = f6.sport;
+    assert(bgh_key6_normalize(&f6) == 1);
+    assert(bgh_key6_normalize(&r6) == 0);
+    assert(f6.sport == 2 && f6.dport == 1 && !f6.sip[0]);
+    assert(!memcmp(&f6, &r6, sizeof(f6)));
+
+    // Either direction finds the session, whatever the padding, and keys 
+    // that only differ in their second endpoint don't
+    bgh_t *tracker = bgh_new(nop_free_cb);
+    assert(bgh_insert(tracker, &fwd, (void*)"fwd") == BGH_OK);
+    assert_eq(bgh_lookup(tracker, &fwd), "fwd");
+    assert_eq(bgh_lookup(tracker, &rev), "fwd");
+    assert_eq(bgh_lookup(tracker, &a), "fwd");
+    bgh_key_t other = a;
+    other.dport = 81;
+    assert(!bgh_lookup(tracker, &other));
+    other = a;
+    other.dip = 21;
+    assert(!bgh_lookup(tracker, &other));
+    assert(_key_hash(1, &fwd) == _key_hash(1, &rev));
+
+    bgh_key_t burst[2] = { fwd, rev };
+    void *data[2];
+    assert(bgh_lookup_burst(tracker, burst, 2, data) == 2);
+    assert(data[0] == data[1]);
+
+    bool created;
+    assert_eq(bgh_find_or_insert(tracker, &rev, create_cb, (void*)"rev", 
+        &created), "fwd");
+    assert(!created);
+    bgh_clear(tracker, &rev);
+    assert(!bgh_lookup(tracker, &fwd));
+
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == 0);
+    bgh_free(tracker);
+}
+
+static int overload_freed = 0;
+
+void overload_free_cb(void *p) {
+    free(p);
+    overload_freed++;
+}
+
+bgh_key_t overload_key(uint32_t i) {
+    bgh_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.sip = i;
+    key.dip = 0x0a000001;
+    key.sport = 1024 + (i & 0x7fff);
+    key.dport = 80;
+    key.proto = 6;
+    return key;
+}
+
+// A small table with a max of 103 sessions: max_inserts of 102, plus the 
+// one the limit lets in
+bgh_t *overload_tracker(uint32_t policy) {
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = 1 << 10;
+    conf.max_rows = 1 << 12;
+    conf.hash_full_pct = 10;
+    // Grows from about half the limit
+    conf.scale_up_pct = 5;
+    conf.scale_down_pct = 1;
+    conf.refresh_period = 3600;
+    conf.manual_maintenance = true;
+    conf.overload = policy;
+    conf.soft_limit_pct = 50;
+    return bgh_config_new(&conf, overload_free_cb);
+}
+
+void overload() {
+    printf("%s\n", __func__);
+
+    const uint32_t limit = 103;
+    bgh_stats_t stats;
+
+    // Without a policy, a full table refuses new sessions, but still takes 
+    // updates to those it has
+    bgh_t *tracker = overload_tracker(BGH_OVERLOAD_REFUSE);
+    for(uint32_t i=0; i<limit; i++) {
+        bgh_key_t key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("old")) == BGH_OK);
+    }
+    bgh_key_t key = overload_key(limit);
+    assert(bgh_insert(tracker, &key, strdup("new")) == BGH_FULL);
+    key = overload_key(0);
+    assert(bgh_insert(tracker, &key, strdup("update")) == BGH_OK);
+    assert_eq(bgh_lookup(tracker, &key), "update");
+    bgh_maintain(tracker, 0, 0);
+    assert(!tracker->refreshing);
+    bgh_free(tracker);
+
+    // Evict: sessions looked up since they went in are established, and 
+    // stay. Sessions only seen once go to make room
+    tracker = overload_tracker(BGH_OVERLOAD_EVICT);
+    for(uint32_t i=0; i<limit; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("old")) == BGH_OK);
+    }
+    for(uint32_t i=0; i<50; i++) {
+        key = overload_key(i);
+        assert(bgh_lookup(tracker, &key));
+    }
+
+    overload_freed = 0;
+    for(uint32_t i=limit; i<limit + 50; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("new")) == BGH_OK);
+    }
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted == limit);
+    assert(stats.evicted == 50);
+    for(uint32_t i=0; i<50; i++) {
+        key = overload_key(i);
+        assert_eq(bgh_lookup(tracker, &key), "old");
+    }
+
+    // Evicted data is freed by maintenance, after lookups are done with it.
+    // A lookup still in flight doesn't hold up maintenance, only the free
+    assert(overload_freed == 0);
+    uint64_t *rd = _bgh_read_begin(tracker);
+    bgh_maintain(tracker, 0, 0);
+    assert(overload_freed == 0);
+    _bgh_read_end(rd);
+    bgh_maintain(tracker, 0, 0);
+    assert(overload_freed == 50);
+    bgh_get_stats(tracker, &stats);
+    assert(stats.expired == 50);
+    bgh_free(tracker);
+
+    // If every session has been looked up lately, the first newcomer is 
+    // refused. The hand has cleared their marks on the way, so the next one
+    // gets in
+    tracker = overload_tracker(BGH_OVERLOAD_EVICT);
+    for(uint32_t i=0; i<limit; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("old")) == BGH_OK);
+        assert(bgh_lookup(tracker, &key));
+    }
+    key = overload_key(limit);
+    assert(bgh_insert(tracker, &key, strdup("new")) == BGH_FULL);
+    assert(bgh_insert(tracker, &key, strdup("new")) == BGH_OK);
+    bgh_free(tracker);
+
+    // Admit: past the soft limit of half, fewer and fewer get in, and the 
+    // table never goes past its limit
+    tracker = overload_tracker(BGH_OVERLOAD_ADMIT);
+    uint32_t ok = 0,
+             full = 0;
+    for(uint32_t i=0; i<1000; i++) {
+        key = overload_key(i);
+        char *data = strdup("new");
+        if(bgh_insert(tracker, &key, data) == BGH_OK)
+            ok++;
+        else {
+            free(data);
+            full++;
+            // Everything under the soft limit gets in
+            assert(i >= limit / 2);
+        }
+    }
+    bgh_get_stats(tracker, &stats);
+    assert(ok == stats.inserted && ok <= limit);
+    assert(stats.refused > 0 && stats.refused <= full);
+    bgh_free(tracker);
+
+    // Admit and evict: at the limit new sessions still get in, a few at a 
+    // time
+    tracker = overload_tracker(BGH_OVERLOAD_ADMIT | BGH_OVERLOAD_EVICT);
+    ok = 0;
+    for(uint32_t i=0; i<5000; i++) {
+        key = overload_key(i);
+        char *data = strdup("new");
+        if(bgh_insert(tracker, &key, data) == BGH_OK)
+            ok++;
+        else
+            free(data);
+    }
+    bgh_get_stats(tracker, &stats);
+    assert(stats.inserted <= limit);
+    assert(stats.evicted > 0 && ok == stats.inserted + stats.evicted);
+    bgh_free(tracker);
+
+    // Refresh: past the soft limit, the next maintenance step starts a 
+    // refresh into a bigger table, long before refresh_period. Lookups and
+    // find_or_insert count too
+    tracker = overload_tracker(BGH_OVERLOAD_REFRESH);
+    for(uint32_t i=0; i<limit / 2; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("old")) == BGH_OK);
+    }
+    bgh_maintain(tracker, 0, 0);
+    assert(!tracker->refreshing);
+    key = overload_key(limit);
+    assert(bgh_insert(tracker, &key, strdup("new")) == BGH_OK);
+    assert(tracker->overloaded);
+    bgh_maintain(tracker, 0, 0);
+    assert(tracker->refreshing && !tracker->overloaded);
+    assert(tracker->standby->num_rows == 1 << 11);
+    bgh_get_stats(tracker, &stats);
+    assert(stats.overload_refreshes == 1);
+    bgh_free(tracker);
+
+    // With the maintenance thread, it's woken for it
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = 1 << 10;
+    conf.hash_full_pct = 10;
+    conf.refresh_period = 3600;
+    conf.overload = BGH_OVERLOAD_REFRESH;
+    tracker = bgh_config_new(&conf, overload_free_cb);
+    for(uint32_t i=0; i<limit; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("old")) == BGH_OK);
+    }
+    assert_refresh_within(tracker, 2);
+    bgh_free(tracker);
+
+    // Sharded trackers evict per shard, and maintenance frees for them all
+    conf.overload = BGH_OVERLOAD_EVICT;
+    conf.manual_maintenance = true;
+    conf.starting_rows = conf.min_rows = conf.max_rows = 1 << 12;
+    tracker = bgh_sharded_new(4, &conf, overload_free_cb);
+    overload_freed = 0;
+    for(uint32_t i=0; i<4 * limit * 2; i++) {
+        key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("new")) == BGH_OK);
+    }
+    bgh_get_stats(tracker, &stats);
+    assert(stats.evicted > 0 && stats.inserted + stats.evicted == 4 * limit * 2);
+    bgh_maintain(tracker, 0, 0);
+    assert(overload_freed == (int)stats.evicted);
+    bgh_free(tracker);
+}
+
+// Sizes of the tables refreshes go to, one refresh a second of a clock we 
+// drive ourselves
+std::vector<uint64_t> refresh_sizes(bgh_t *tracker, uint64_t t0, int n) {
+    std::vector<uint64_t> sizes;
+    for(int i=1; i<=n; i++) {
+        bgh_maintain(tracker, t0 + i * 1000, 0);
+        assert(tracker->refreshing);
+        sizes.push_back(tracker->standby->num_rows);
+    }
+    return sizes;
+}
+
+void load_resize() {
+    printf("%s\n", __func__);
+
+    bgh_config_t conf;
+    bgh_config_init(&conf);
+    conf.starting_rows = conf.min_rows = 1 << 10;
+    conf.max_rows = 1 << 16;
+    conf.hash_full_pct = 50;
+    conf.scale_up_pct = 5;
+    conf.grow_pct = 10;
+    conf.refresh_period = 3600;
+    conf.timeout = 1;
+    conf.manual_maintenance = true;
+    bgh_t *tracker = bgh_config_new(&conf, overload_free_cb);
+
+    // Under grow_pct, nothing happens until refresh_period
+    uint64_t t0 = bgh_now_ms();
+    for(uint32_t i=0; i<100; i++) {
+        bgh_key_t key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("load")) == BGH_OK);
+    }
+    bgh_maintain(tracker, t0, 0);
+    assert(!tracker->refreshing);
+
+    // 100 more in 100ms, which smoothed from nothing is 500 a second. With
+    // those coming in over a 1s drain, the new table can expect 700 
+    // sessions, and to hold them under scale_up_pct it jumps four sizes
+    for(uint32_t i=100; i<200; i++) {
+        bgh_key_t key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("load")) == BGH_OK);
+    }
+    bgh_maintain(tracker, t0 + 100, 0);
+    assert(tracker->refreshing);
+    assert(tracker->standby->num_rows == 1 << 14);
+    bgh_stats_t stats;
+    bgh_get_stats(tracker, &stats);
+    assert(stats.load_refreshes == 1 && stats.overload_refreshes == 0);
+    bgh_free(tracker);
+
+    // With the maintenance thread, within a tick or so
+    conf.manual_maintenance = false;
+    tracker = bgh_config_new(&conf, overload_free_cb);
+    for(uint32_t i=0; i<200; i++) {
+        bgh_key_t key = overload_key(i);
+        assert(bgh_insert(tracker, &key, strdup("load")) == BGH_OK);
+    }
+    assert_refresh_within(tracker, 2);
+    bgh_free(tracker);
+
+    // An empty table only halves every other refresh
+    conf.starting_rows = 1 << 12;
+    conf.grow_pct = 0;
+    conf.refresh_period = 1;
+    conf.teardown_rows = 0;
+    conf.teardown_pause_us = 0;
+    conf.manual_maintenance = true;
+    tracker = bgh_config_new(&conf, overload_free_cb);
+    std::vector<uint64_t> sizes = refresh_sizes(tracker, bgh_now_ms(), 5);
+    assert(sizes[0] == 1 << 12 && sizes[1] == 1 << 11 && 
+           sizes[2] == 1 << 11 && sizes[3] == 1 << 10 && 
+           sizes[4] == 1 << 10);
+    bgh_free(tracker);
+
+    // Or every refresh, as before, with a shrink_refreshes of 1
+    conf.shrink_refreshes = 1;
+    tracker = bgh_config_new(&conf, overload_free_cb);
+    sizes = refresh_sizes(tracker, bgh_now_ms(), 3);
+    assert(sizes[0] == 1 << 11 && sizes[1] == 1 << 10 && sizes[2] == 1 << 10);
+    bgh_free(tracker);
+}
+
 int main(int argc, char **argv) {
     // Make rand repeatable
     srand(1);
@@ -677,13 +2880,36 @@ int main(int argc, char **argv) {
 
     basic();
     linear_probing();
-    primes_test();
+    distribution();
+    flood();
     drain();
     resize();
     time_draining();
     timeouts();
-    bench();
+    grace_period();
+    epoch_stress();
+    lockless_lookups();
+    sharded();
+    sharded_writers();
+    burst();
+    ipv6();
+    churn();
+    load_factor();
+    teardown();
+    table_pool();
+    idle_timeouts();
+    deferred_expiry();
+    shared_maintenance();
+    manual_maintenance();
+    metrics();
+    snapshot();
+    snapshot_inline();
+    shared_memory();
+    inline_values();
+    find_or_insert();
+    normalized_keys();
+    overload();
+    load_resize();
 
-    // TODO: check hash distrib?
     return 0;
 }